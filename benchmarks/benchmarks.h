@@ -0,0 +1,22 @@
+﻿#pragma once
+
+// Stand-alone measurements that can be started from the render UI.
+// They build their own data, so they do not disturb the scene, and print to the console.
+class Benchmarks
+{
+public:
+    // walks random rays through a worldSize^3 grid stored in linear and in tiled
+    // Morton order, and reports cache lines touched and simulated L1 misses per ray
+    static void VoxelLayout(uint worldSize = 256, uint rayCount = 1 << 18);
+    // saves a procedural worldSize^3 terrain as a world file, loads it on one core and
+    // on all cores, and reports the file size and the time to construct the scene
+    static void WorldFile(uint worldSize = 256);
+    // builds the binary and the 4-wide sphere BVH, with binned SAH and from Morton codes,
+    // and the binned binary one with quantized nodes, over a cloud of small spheres and
+    // reports their build time, memory, SAH cost and nearest-hit throughput on random rays
+    static void SphereBVH(uint sphereCount = 100000, uint rayCount = 1 << 20);
+    // writes a closed torus of about triangleCount triangles as an OBJ file, loads it on one
+    // core and on all cores, then traces random rays at it and rays from inside the tube,
+    // which must all hit: a miss there is a ray that leaked through a shared edge
+    static void Mesh(uint triangleCount = 1 << 20, uint rayCount = 1 << 20);
+};
@@ -0,0 +1,93 @@
+﻿#include "precomp.h"
+#include "benchmarks.h"
+
+#include "primitives/mesh.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
+{
+    constexpr float MajorRadius = 0.3f, MinorRadius = 0.1f;
+    const float3 TorusCenter(0.5f);
+
+    float3 TorusPoint(const float u, const float v)
+    {
+        const float ring = MajorRadius + MinorRadius * cosf(v);
+        return TorusCenter + float3(ring * cosf(u), MinorRadius * sinf(v), ring * sinf(u));
+    }
+}
+
+void Benchmarks::Mesh(const uint triangleCount, const uint rayCount)
+{
+    const char* path = "benchmark.obj";
+    const int threads = static_cast<int>(std::thread::hardware_concurrency());
+
+    // a torus of quads, written as polygons so the loader has to fan them
+    const uint segments = max(4u, static_cast<uint>(sqrtf(triangleCount / 2.0f)));
+    {
+        std::ofstream file(path);
+        char line[96];
+        for (uint i = 0; i < segments; i++) for (uint j = 0; j < segments; j++)
+        {
+            const float3 p = TorusPoint(i * TWOPI / segments, j * TWOPI / segments);
+            file.write(line, snprintf(line, sizeof(line), "v %.7f %.7f %.7f\n", p.x, p.y, p.z));
+        }
+        for (uint i = 0; i < segments; i++) for (uint j = 0; j < segments; j++)
+        {
+            const uint a = i * segments + j + 1, b = (i + 1) % segments * segments + j + 1;
+            const uint c = (i + 1) % segments * segments + (j + 1) % segments + 1, d = i * segments + (j + 1) % segments + 1;
+            file.write(line, snprintf(line, sizeof(line), "f %u %u %u %u\n", a, b, c, d));
+        }
+    }
+    std::ifstream written(path, std::ios::binary | std::ios::ate);
+    printf("mesh benchmark: %u triangles, %.1f MB OBJ file\n", segments * segments * 2, static_cast<double>(written.tellg()) / (1024 * 1024));
+
+    ::Mesh* mesh = nullptr;
+    for (const int threadCount : {1, threads})
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(threadCount);
+#endif
+        delete mesh;
+        Timer timer;
+        mesh = ::Mesh::LoadOBJ(path, float3(0), 1, Material(), 0xffffff);
+        printf("load and build  %2d threads %7.3f s\n", threadCount, timer.elapsed());
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    remove(path);
+    if (!mesh)
+    {
+        printf("mesh benchmark: could not load %s\n", path);
+        return;
+    }
+
+    // rays from random points around the torus to random points on it
+    uint hits = 0;
+    Timer timer;
+    for (uint i = 0; i < rayCount; i++)
+    {
+        const float3 origin = TorusCenter + float3(RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f) * 1.5f;
+        const float3 target = TorusPoint(RandomFloat() * TWOPI, RandomFloat() * TWOPI);
+        Ray ray(origin, normalize(target - origin));
+        HitInfo hitInfo;
+        hits += mesh->FindNearest(ray, hitInfo);
+    }
+    printf("trace     %7.2f Mrays/s, %u of %u hit\n", rayCount / timer.elapsed() * 1e-6f, hits, rayCount);
+
+    // from the core circle of the tube every direction hits the closed surface
+    uint leaks = 0;
+    for (uint i = 0; i < rayCount; i++)
+    {
+        const float u = RandomFloat() * TWOPI;
+        const float3 origin = TorusCenter + MajorRadius * float3(cosf(u), 0, sinf(u));
+        Ray ray(origin, normalize(float3(RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f)));
+        HitInfo hitInfo;
+        leaks += !mesh->FindNearest(ray, hitInfo);
+    }
+    printf("watertight: %u of %u rays from inside leaked\n", leaks, rayCount);
+    delete mesh;
+}
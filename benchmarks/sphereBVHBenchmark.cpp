@@ -0,0 +1,72 @@
+﻿#include "precomp.h"
+#include "benchmarks.h"
+
+#include "primitives/bvh.h"
+#include "primitives/bvh4.h"
+
+namespace
+{
+    // traces all rays against a sphere BVH and returns the number of hits
+    template <class BVH>
+    uint TraceAll(const BVH& bvh, const vector<Ray>& rays)
+    {
+        uint hits = 0;
+        for (Ray ray : rays)
+        {
+            HitInfo hitInfo;
+            hits += bvh.FindNearest(ray, hitInfo);
+        }
+        return hits;
+    }
+
+    size_t MemoryUsage(const BVHSphere& bvh) { return bvh.MemoryUsage(); }
+    size_t MemoryUsage(const BVH4Sphere& bvh) { return bvh.NodeCount() * sizeof(BVH4SphereNode) + bvh.LeafCount() * sizeof(SphereLeaf4); }
+
+    template <class BVH>
+    void Report(const char* name, const BVH& bvh, const float build, const vector<Ray>& rays)
+    {
+        Timer timer;
+        const uint hits = TraceAll(bvh, rays);
+        const float trace = timer.elapsed();
+        printf("%-10s build %7.3f s  %6.2f MB  %7.2f Mrays/s  SAH cost %6.2f  %u hits\n", name, build, MemoryUsage(bvh) / (1024.0 * 1024),
+               rays.size() / trace * 1e-6, bvh.SAHCost(), hits);
+    }
+
+    template <class BVH>
+    void Measure(const char* name, const SphereSet& spheres, const SphereBuild mode, const vector<Ray>& rays)
+    {
+        Timer timer;
+        const BVH bvh(spheres, mode);
+        Report(name, bvh, timer.elapsed(), rays);
+    }
+}
+
+void Benchmarks::SphereBVH(const uint sphereCount, const uint rayCount)
+{
+    // a particle cloud of small spheres in a 20-unit cube, with rays starting inside it
+    SphereSet spheres;
+    for (uint i = 0; i < sphereCount; i++)
+    {
+        const float3 center(RandomFloat() * 20 - 10, RandomFloat() * 20 - 10, RandomFloat() * 20 - 10);
+        spheres.Add(center, 0.02f + RandomFloat() * 0.1f, Material(), 0xffffff);
+    }
+    vector<Ray> rays;
+    for (uint i = 0; i < rayCount; i++)
+    {
+        const float3 origin(RandomFloat() * 20 - 10, RandomFloat() * 20 - 10, RandomFloat() * 20 - 10);
+        rays.emplace_back(origin, normalize(float3(RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f)));
+    }
+    printf("sphere BVH benchmark: %u spheres, %u rays\n", sphereCount, rayCount);
+
+    Measure<BVHSphere>("BVH2", spheres, SphereBuild::BinnedSAH, rays);
+    Measure<BVH4Sphere>("BVH4", spheres, SphereBuild::BinnedSAH, rays);
+    {
+        // the binned BVH2 again, traced over its 16-byte quantized nodes
+        Timer timer;
+        BVHSphere bvh(spheres);
+        bvh.Quantize();
+        Report("BVH2 Q8", bvh, timer.elapsed(), rays);
+    }
+    Measure<BVHSphere>("BVH2 LBVH", spheres, SphereBuild::Morton, rays);
+    Measure<BVH4Sphere>("BVH4 LBVH", spheres, SphereBuild::Morton, rays);
+}
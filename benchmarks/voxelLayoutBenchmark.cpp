@@ -0,0 +1,151 @@
+﻿#include "precomp.h"
+#include "benchmarks.h"
+
+namespace
+{
+    // set-associative LRU cache model, sized like a typical L1 data cache
+    class CacheModel
+    {
+    public:
+        static constexpr uint LineBytes = 64, Ways = 8, Sets = 32768 / LineBytes / Ways;
+
+        void Access(const size_t address, const uint stream)
+        {
+            const size_t line = address / LineBytes;
+            if (line == lastLine[stream]) return; // same line as the previous access to this array
+            lastLine[stream] = line;
+            linesTouched++;
+            const uint set = static_cast<uint>(line % Sets);
+            size_t* tags = &tag[set * Ways];
+            uint64* ages = &age[set * Ways];
+            uint victim = 0;
+            for (uint way = 0; way < Ways; way++)
+            {
+                if (tags[way] == line)
+                {
+                    ages[way] = ++clock;
+                    return;
+                }
+                if (ages[way] < ages[victim]) victim = way;
+            }
+            misses++;
+            tags[victim] = line;
+            ages[victim] = ++clock;
+        }
+
+        uint64 linesTouched = 0, misses = 0;
+
+    private:
+        size_t tag[Sets * Ways] = {};
+        uint64 age[Sets * Ways] = {};
+        uint64 clock = 0;
+        size_t lastLine[2] = {~static_cast<size_t>(0), ~static_cast<size_t>(0)};
+    };
+
+    struct LayoutResult
+    {
+        uint64 steps = 0, linesTouched = 0, misses = 0;
+        float seconds = 0;
+    };
+
+    // walks every ray with a voxel DDA until it hits a solid voxel or leaves the grid.
+    // each step reads the occupancy bit and the distance-field byte, like Scene::FindNearest.
+    template <class IndexFunction>
+    LayoutResult WalkRays(const vector<float3>& origins, const vector<float3>& directions, const uint worldSize,
+                          const uint64* occupancy, const uchar* distance, IndexFunction index, CacheModel* cache)
+    {
+        LayoutResult result;
+        const size_t distanceBase = (static_cast<size_t>(worldSize) * worldSize * worldSize / 8 + 4095) & ~static_cast<size_t>(4095);
+        uint sink = 0;
+        const Timer timer;
+        for (size_t r = 0; r < origins.size(); r++)
+        {
+            const float3 O = origins[r], D = directions[r];
+            const int3 step = make_int3(D.x < 0 ? -1 : 1, D.y < 0 ? -1 : 1, D.z < 0 ? -1 : 1);
+            const float3 tDelta = make_float3(fabsf(1.0f / D.x), fabsf(1.0f / D.y), fabsf(1.0f / D.z));
+            uint x = static_cast<uint>(O.x), y = static_cast<uint>(O.y), z = static_cast<uint>(O.z);
+            float3 tMax = make_float3(
+                (D.x < 0 ? O.x - x : x + 1 - O.x) * tDelta.x,
+                (D.y < 0 ? O.y - y : y + 1 - O.y) * tDelta.y,
+                (D.z < 0 ? O.z - z : z + 1 - O.z) * tDelta.z);
+            while (true)
+            {
+                const uint i = index(x, y, z);
+                result.steps++;
+                if (cache)
+                {
+                    cache->Access(i / 8, 0);
+                    cache->Access(distanceBase + i, 1);
+                }
+                sink += distance[i];
+                if (occupancy[i >> 6] >> (i & 63) & 1) break;
+                if (tMax.x < tMax.y && tMax.x < tMax.z) x += step.x, tMax.x += tDelta.x;
+                else if (tMax.y < tMax.z) y += step.y, tMax.y += tDelta.y;
+                else z += step.z, tMax.z += tDelta.z;
+                if (x >= worldSize || y >= worldSize || z >= worldSize) break;
+            }
+        }
+        result.seconds = timer.elapsed();
+        if (cache) result.linesTouched = cache->linesTouched, result.misses = cache->misses;
+        if (sink == 0x12345678) printf(" "); // keep the distance reads alive
+        return result;
+    }
+}
+
+void Benchmarks::VoxelLayout(const uint worldSize, const uint rayCount)
+{
+    const size_t voxelCount = static_cast<size_t>(worldSize) * worldSize * worldSize;
+    const auto linear = [worldSize](const uint x, const uint y, const uint z)
+    {
+        return ::VoxelLayout::LinearIndex(x, y, z, worldSize, worldSize);
+    };
+    const ::VoxelLayout::Offsets offsets(worldSize, worldSize, worldSize);
+    const auto tiled = [&offsets](const uint x, const uint y, const uint z)
+    {
+        return offsets.Index(x, y, z);
+    };
+
+    // sparse random content, so rays travel a few dozen voxels before they hit
+    const auto Fill = [&](auto index, vector<uint64>& occupancy, vector<uchar>& distance)
+    {
+        occupancy.assign(voxelCount / 64, 0);
+        distance.assign(voxelCount, 1);
+        uint seed = 0x2024;
+        for (uint z = 0; z < worldSize; z++) for (uint y = 0; y < worldSize; y++) for (uint x = 0; x < worldSize; x++)
+        {
+            if (RandomUInt(seed) % 1000 >= 15) continue;
+            const uint i = index(x, y, z);
+            occupancy[i >> 6] |= 1ull << (i & 63);
+            distance[i] = 0;
+        }
+    };
+    vector<uint64> linearOccupancy, tiledOccupancy;
+    vector<uchar> linearDistance, tiledDistance;
+    Fill(linear, linearOccupancy, linearDistance);
+    Fill(tiled, tiledOccupancy, tiledDistance);
+
+    vector<float3> origins(rayCount), directions(rayCount);
+    uint seed = 0x1234;
+    for (uint i = 0; i < rayCount; i++)
+    {
+        origins[i] = make_float3(RandomFloat(seed), RandomFloat(seed), RandomFloat(seed)) * static_cast<float>(worldSize - 1);
+        directions[i] = normalize(make_float3(RandomFloat(seed) - 0.5f, RandomFloat(seed) - 0.5f, RandomFloat(seed) - 0.5f));
+    }
+
+    const auto Report = [rayCount](const char* name, const LayoutResult& timed, const LayoutResult& simulated)
+    {
+        printf("%-8s %7.2f steps/ray %7.2f lines/ray %7.2f L1 misses/ray %8.2f Mrays/s\n", name,
+               static_cast<double>(simulated.steps) / rayCount, static_cast<double>(simulated.linesTouched) / rayCount,
+               static_cast<double>(simulated.misses) / rayCount, rayCount / timed.seconds * 1e-6);
+    };
+    printf("voxel layout benchmark: %u^3 grid, %u random rays\n", worldSize, rayCount);
+    const auto cache = new CacheModel();
+    const LayoutResult linearTimed = WalkRays(origins, directions, worldSize, linearOccupancy.data(), linearDistance.data(), linear, nullptr);
+    const LayoutResult linearSimulated = WalkRays(origins, directions, worldSize, linearOccupancy.data(), linearDistance.data(), linear, cache);
+    Report("linear", linearTimed, linearSimulated);
+    *cache = CacheModel();
+    const LayoutResult tiledTimed = WalkRays(origins, directions, worldSize, tiledOccupancy.data(), tiledDistance.data(), tiled, nullptr);
+    const LayoutResult tiledSimulated = WalkRays(origins, directions, worldSize, tiledOccupancy.data(), tiledDistance.data(), tiled, cache);
+    Report("tiled", tiledTimed, tiledSimulated);
+    delete cache;
+}
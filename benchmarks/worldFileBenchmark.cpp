@@ -0,0 +1,81 @@
+﻿#include "precomp.h"
+#include "benchmarks.h"
+
+#include "materials/materialManager.h"
+#include "voxels/worldFile.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+void Benchmarks::WorldFile(const uint worldSize)
+{
+    const char* path = "benchmark.voxels";
+    const uint3 size = make_uint3(worldSize);
+    const size_t voxelCount = static_cast<size_t>(worldSize) * worldSize * worldSize;
+    const int threads = static_cast<int>(std::thread::hardware_concurrency());
+
+    // rolling terrain in four colours up to about a third of the height, with air above it
+    auto* scene = new Scene(size);
+    ushort colors[4];
+    for (uint i = 0; i < 4; i++)
+    {
+        VoxelData voxel;
+        voxel.material.type = Material::Type::Diffuse;
+        voxel.color = 0x3a7d44 + i * 0x101010;
+        colors[i] = scene->materialManager->GetVoxelPaletteIndex(voxel);
+    }
+    const int brickCount = static_cast<int>(voxelCount / VoxelLayout::TileVoxels);
+#pragma omp parallel for schedule(dynamic)
+    for (int brickIndex = 0; brickIndex < brickCount; brickIndex++)
+    {
+        ushort brick[VoxelLayout::TileVoxels];
+        for (uint i = 0; i < VoxelLayout::TileVoxels; i++)
+        {
+            const uint3 P = scene->VoxelCoordinates(brickIndex * VoxelLayout::TileVoxels + i);
+            const float height = worldSize * (0.3f + 0.1f * sinf(P.x * 0.05f) * cosf(P.z * 0.07f) + 0.05f * sinf((P.x + P.z) * 0.21f));
+            // colour bands with one voxel in eight speckled, so chunks do not compress trivially
+            const uint hash = (P.x * 73856093u ^ P.y * 19349663u ^ P.z * 83492791u) * 2654435761u;
+            brick[i] = P.y < height ? colors[((hash >> 29) == 0 ? hash >> 8 : P.y / 4 + P.x / 16) & 3] : 0;
+        }
+        scene->SetBrick(brickIndex, brick);
+    }
+    // the terrain covers the special voxels, which a loaded world must have for the game
+    VoxelData special;
+    special.material.type = Material::Type::Diffuse;
+    special.color = 0xffffff;
+    special.special = true;
+    for (const uint index : scene->specialVoxels) scene->Set(index, special);
+
+    Timer timer;
+    if (!::WorldFile::Save(*scene, path))
+    {
+        printf("world file benchmark: could not write %s\n", path);
+        delete scene;
+        return;
+    }
+    const float saveSeconds = timer.elapsed();
+    delete scene;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    const double fileBytes = static_cast<double>(file.tellg());
+    const double rawBytes = static_cast<double>(voxelCount) * sizeof(ushort);
+    printf("world file benchmark: %u^3 terrain, %.1f MB of palette indices in a %.1f MB file (%.1fx)\n", worldSize,
+           rawBytes / (1024 * 1024), fileBytes / (1024 * 1024), rawBytes / fileBytes);
+    printf("save     %2d threads %7.3f s\n", threads, saveSeconds);
+
+    // loading constructs the whole scene, including the distance field, like a startup would
+    for (const int threadCount : {1, threads})
+    {
+#ifdef _OPENMP
+        omp_set_num_threads(threadCount);
+#endif
+        timer.reset();
+        auto* loaded = new Scene(path);
+        printf("load     %2d threads %7.3f s\n", threadCount, timer.elapsed());
+        delete loaded;
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    remove(path);
+}
@@ -38,20 +38,26 @@ void SpecialLights::Tick(float deltaTime)
                 bReset = false;
                 for (const auto specialLightIndex : specialLightIndices)
                 {
-                    scene->grid[specialLightIndex].specialColor = 0;
+                    auto voxel = scene->Get(specialLightIndex);
+                    voxel.specialColor = 0;
+                    scene->Set(specialLightIndex, voxel);
                 }
             }
             
             if (bActivated)
             {
                 const auto lightIndex = specialLightIndices[currentPattern];
-                scene->grid[lightIndex].color = 0xffffff;
+                auto voxel = scene->Get(lightIndex);
+                voxel.color = 0xffffff;
+                scene->Set(lightIndex, voxel);
             }
             else
             {
                 currentPattern = pattern[currentPatternIndex];
                 const auto lightIndex = specialLightIndices[currentPattern];
-                scene->grid[lightIndex].color = 0x00ffff;
+                auto voxel = scene->Get(lightIndex);
+                voxel.color = 0x00ffff;
+                scene->Set(lightIndex, voxel);
             }
             bActivated = !bActivated;
         }
@@ -75,8 +81,10 @@ void SpecialLights::Reset()
     for (auto i = 0; i < 6; i++)
     {
         const auto lightIndex = specialLightIndices[i];
-        scene->grid[lightIndex].color = 0xffffff;
-        scene->grid[lightIndex].specialColor = 0xff0000;
+        auto voxel = scene->Get(lightIndex);
+        voxel.color = 0xffffff;
+        voxel.specialColor = 0xff0000;
+        scene->Set(lightIndex, voxel);
     }
     currentSpecialLightIndices.clear();
     currentSpecialLightIndices.resize(1);
@@ -87,8 +95,10 @@ void SpecialLights::Win()
 {
     for (const unsigned int lightIndex : specialLightIndices)
     {
-        scene->grid[lightIndex].color = 0x00ff00;
-        scene->grid[lightIndex].specialColor = 0x00ff00;
+        auto voxel = scene->Get(lightIndex);
+        voxel.color = 0x00ff00;
+        voxel.specialColor = 0x00ff00;
+        scene->Set(lightIndex, voxel);
     }
     bWon = true;
     score++;
@@ -108,7 +118,9 @@ void SpecialLights::CheckSpecialLight(const uint hitVoxelIndex)
         {
             currentSpecialLightIndices[i].bActivated = true;
             const auto lightIndex = currentSpecialLightIndices[i].index;
-            scene->grid[lightIndex].specialColor = 0x00ffff;
+            auto voxel = scene->Get(lightIndex);
+            voxel.specialColor = 0x00ffff;
+            scene->Set(lightIndex, voxel);
             currentSpecialLightIndices.resize((i + 2));
             if (currentSpecialLightIndices.size() == 7)
             {
@@ -0,0 +1,302 @@
+﻿#include "precomp.h"
+#include "wavefront.h"
+
+#include "jobs/jobSystem.h"
+#include "materials/materialManager.h"
+
+namespace
+{
+    constexpr uint BatchPaths = 1 << 14; // paths in flight at once: enough chunks for all threads, few enough to stay in cache
+    constexpr uint ChunkSize = 256; // queue entries per job; a multiple of the packet width
+
+    uint ChunkCount(const uint count)
+    {
+        return (count + ChunkSize - 1) / ChunkSize;
+    }
+
+    // runs body(chunk, first, last) for the chunks of [0, count) on all threads
+    template <class F>
+    void ForEachChunk(const uint count, F&& body)
+    {
+        JobSystem::Instance().ParallelFor(ChunkCount(count), [&](const uint chunk)
+        {
+            body(chunk, chunk * ChunkSize, std::min((chunk + 1) * ChunkSize, count));
+        });
+    }
+}
+
+void WavefrontIntegrator::PathQueue::Resize(const uint capacity)
+{
+    for (vector<float>* field : {&originX, &originY, &originZ, &directionX, &directionY, &directionZ, &throughputR, &throughputG, &throughputB})
+    {
+        field->resize(capacity);
+    }
+    pixel.resize(capacity);
+}
+
+Ray WavefrontIntegrator::PathQueue::GetRay(const uint i) const
+{
+    return {float3(originX[i], originY[i], originZ[i]), float3(directionX[i], directionY[i], directionZ[i])};
+}
+
+void WavefrontIntegrator::PathQueue::SetRay(const uint i, const Ray& ray)
+{
+    originX[i] = ray.origin.x, originY[i] = ray.origin.y, originZ[i] = ray.origin.z;
+    directionX[i] = ray.direction.x, directionY[i] = ray.direction.y, directionZ[i] = ray.direction.z;
+}
+
+void WavefrontIntegrator::ShadowQueue::Resize(const uint capacity)
+{
+    for (vector<float>* field : {&originX, &originY, &originZ, &directionX, &directionY, &directionZ, &distance, &contributionR, &contributionG,
+                                 &contributionB})
+    {
+        field->resize(capacity);
+    }
+    visible.resize(capacity);
+}
+
+WavefrontIntegrator::WavefrontIntegrator():
+    tilesPerBatch(std::max(BatchPaths / (TILESIZE * TILESIZE), 1u)), frame(SCRWIDTH * SCRHEIGHT)
+{
+    const uint capacity = tilesPerBatch * TILESIZE * TILESIZE;
+    paths.Resize(capacity);
+    nextPaths.Resize(capacity);
+    hits.resize(capacity);
+    hitTypes.resize(capacity);
+    states.resize(capacity);
+    shadowFirst.resize(capacity);
+    shadowCount.resize(capacity);
+    chunkShadows.resize(ChunkCount(capacity));
+    chunkOffsets.resize(ChunkCount(capacity) + 1);
+}
+
+void WavefrontIntegrator::Render(const Scene& scene, const Camera& camera, const vector<int2>& tiles, const int maxDepth)
+{
+    for (size_t first = 0; first < tiles.size(); first += tilesPerBatch)
+    {
+        Generate(camera, tiles.data() + first, static_cast<uint>(std::min(tiles.size() - first, static_cast<size_t>(tilesPerBatch))));
+        for (int depth = 0; paths.count > 0; depth++)
+        {
+            Extend(scene, depth == 0);
+            Shade(scene, depth, maxDepth);
+            Connect(scene);
+            Resolve(scene, depth);
+        }
+    }
+}
+
+void WavefrontIntegrator::Generate(const Camera& camera, const int2* tiles, const uint tileCount)
+{
+    // tiles on the right and bottom edge may be cut off, so their first slots are summed up front
+    vector<uint> tileFirst(tileCount + 1, 0);
+    for (uint tile = 0; tile < tileCount; tile++)
+    {
+        const int width = std::min(TILESIZE, SCRWIDTH - tiles[tile].x), height = std::min(TILESIZE, SCRHEIGHT - tiles[tile].y);
+        tileFirst[tile + 1] = tileFirst[tile] + width * height;
+    }
+    JobSystem::Instance().ParallelFor(tileCount, [&](const uint tile)
+    {
+        const int2 tileMin = tiles[tile];
+        uint slot = tileFirst[tile];
+        for (int y = tileMin.y; y < std::min(tileMin.y + TILESIZE, SCRHEIGHT); y++)
+        {
+            for (int x = tileMin.x; x < std::min(tileMin.x + TILESIZE, SCRWIDTH); x++, slot++)
+            {
+                const auto sample = Math::SampleSquare();
+                paths.SetRay(slot, camera.GetPrimaryRay(static_cast<float>(x) + sample.x, static_cast<float>(y) + sample.y));
+                paths.throughputR[slot] = paths.throughputG[slot] = paths.throughputB[slot] = 1;
+                paths.pixel[slot] = x + y * SCRWIDTH;
+            }
+        }
+    });
+    paths.count = tileFirst[tileCount];
+}
+
+void WavefrontIntegrator::Extend(const Scene& scene, [[maybe_unused]] const bool primary)
+{
+    ForEachChunk(paths.count, [&](uint, const uint first, const uint last)
+    {
+#ifdef USE_SIMD
+        // camera rays run along tile lines, 8 pixels at a time: their voxel hits are found
+        // as packets, and the TLAS adds the other primitive types
+        if (primary)
+        {
+            for (uint i = first; i < last; i += 8)
+            {
+                Ray rays[8];
+                HitRecord records[8];
+                for (uint j = 0; j < 8; j++) rays[j] = paths.GetRay(i + j), hits[i + j] = HitInfo();
+                scene.FindNearestPacket(rays, records);
+                for (uint j = 0; j < 8; j++)
+                {
+                    scene.tlas.CompleteNearest(rays[j], records[j]);
+                    hitTypes[i + j] = scene.tlas.FillHitInfo(rays[j], records[j], hits[i + j]);
+                }
+            }
+            TLAS::FlushReplacedHits();
+            return;
+        }
+#endif
+        for (uint i = first; i < last; i++)
+        {
+            Ray ray = paths.GetRay(i);
+            hits[i] = HitInfo();
+            hitTypes[i] = scene.tlas.FindNearest(ray, hits[i]);
+        }
+        TLAS::FlushReplacedHits();
+    });
+}
+
+void WavefrontIntegrator::Shade(const Scene& scene, const int depth, const int maxDepth)
+{
+    const LightManager& lights = *scene.lightManager;
+    ForEachChunk(paths.count, [&](const uint chunk, const uint first, const uint last)
+    {
+        thread_local vector<LightSample> samples;
+        vector<ShadowSample>& chunkSamples = chunkShadows[chunk];
+        chunkSamples.clear();
+        for (uint i = first; i < last; i++)
+        {
+            shadowFirst[i] = shadowCount[i] = 0;
+            const float3 direction(paths.directionX[i], paths.directionY[i], paths.directionZ[i]);
+            const float3 throughput(paths.throughputR[i], paths.throughputG[i], paths.throughputB[i]);
+            const uint pixel = paths.pixel[i];
+            const HitInfo& hit = hits[i];
+            if (hitTypes[i] == HitType::None)
+            {
+                frame[pixel] = throughput * scene.skydome.Render(direction);
+                states[i] = PathState::Done;
+                continue;
+            }
+
+            // triangles scatter like spheres: a face normal, with frontFace telling inside from outside
+            Ray scattered;
+            const bool scatters = hitTypes[i] == HitType::Voxel ? scene.materialManager->Scatter(hit, scattered)
+                                                                : scene.materialManager->ScatterSphere(hit, scattered);
+            if (scatters && depth + 1 > maxDepth)
+            {
+                frame[pixel] = throughput * scene.skydome.Render(direction);
+                states[i] = PathState::Done;
+                continue;
+            }
+            if (!scatters && hitTypes[i] == HitType::Voxel && hit.special && depth == 0)
+            {
+                frame[pixel] = Math::GetColorNormalised(hit.specialColor);
+                states[i] = PathState::Done;
+                continue;
+            }
+
+            // the throughput takes the surface color now and the direct light once the
+            // shadow rays are in
+            const float3 weight = throughput * Math::GetColorNormalised(hit.color);
+            paths.throughputR[i] = weight.x, paths.throughputG[i] = weight.y, paths.throughputB[i] = weight.z;
+            if (scatters) paths.SetRay(i, scattered);
+            states[i] = scatters ? PathState::Continue : PathState::Finish;
+
+            samples.clear();
+            lights.SampleLights(hit.point, hit.normal, samples);
+            shadowFirst[i] = static_cast<uint>(chunkSamples.size());
+            for (const LightSample& sample : samples)
+            {
+                ShadowSample shadow;
+                if (!lights.ShadowRay(hit.point, hit.normal, sample.direction, sample.distance, shadow.ray)) continue;
+                shadow.contribution = sample.contribution;
+                chunkSamples.push_back(shadow);
+            }
+            shadowCount[i] = static_cast<uint>(chunkSamples.size()) - shadowFirst[i];
+        }
+    });
+
+    // the samples of the chunks follow each other in the shadow queue
+    const uint chunkCount = ChunkCount(paths.count);
+    chunkOffsets[0] = 0;
+    for (uint chunk = 0; chunk < chunkCount; chunk++) chunkOffsets[chunk + 1] = chunkOffsets[chunk] + static_cast<uint>(chunkShadows[chunk].size());
+    shadows.count = chunkOffsets[chunkCount];
+    if (shadows.count > shadows.visible.size()) shadows.Resize(shadows.count);
+    ForEachChunk(paths.count, [&](const uint chunk, const uint first, const uint last)
+    {
+        for (uint i = first; i < last; i++) shadowFirst[i] += chunkOffsets[chunk];
+        uint k = chunkOffsets[chunk];
+        for (const ShadowSample& sample : chunkShadows[chunk])
+        {
+            shadows.originX[k] = sample.ray.origin.x, shadows.originY[k] = sample.ray.origin.y, shadows.originZ[k] = sample.ray.origin.z;
+            shadows.directionX[k] = sample.ray.direction.x, shadows.directionY[k] = sample.ray.direction.y;
+            shadows.directionZ[k] = sample.ray.direction.z;
+            shadows.distance[k] = sample.ray.length;
+            shadows.contributionR[k] = sample.contribution.x, shadows.contributionG[k] = sample.contribution.y;
+            shadows.contributionB[k] = sample.contribution.z;
+            k++;
+        }
+    });
+}
+
+void WavefrontIntegrator::Connect(const Scene& scene)
+{
+    const LightManager& lights = *scene.lightManager;
+    ForEachChunk(shadows.count, [&](uint, const uint first, const uint last)
+    {
+        for (uint k = first; k < last; k++)
+        {
+            const Ray shadowRay(float3(shadows.originX[k], shadows.originY[k], shadows.originZ[k]),
+                                float3(shadows.directionX[k], shadows.directionY[k], shadows.directionZ[k]), shadows.distance[k]);
+            shadows.visible[k] = !lights.IsOccluded(shadowRay);
+        }
+    });
+}
+
+void WavefrontIntegrator::Resolve(const Scene& scene, [[maybe_unused]] const int depth)
+{
+    const float3 ambient = scene.lightManager->CalculateAmbientLight();
+    const uint chunkCount = ChunkCount(paths.count);
+    ForEachChunk(paths.count, [&](const uint chunk, const uint first, const uint last)
+    {
+        uint survivors = 0;
+        for (uint i = first; i < last; i++)
+        {
+            if (states[i] == PathState::Done) continue;
+            float3 direct = ambient;
+            for (uint k = shadowFirst[i]; k < shadowFirst[i] + shadowCount[i]; k++)
+            {
+                if (shadows.visible[k]) direct += float3(shadows.contributionR[k], shadows.contributionG[k], shadows.contributionB[k]);
+            }
+            float3 value = float3(paths.throughputR[i], paths.throughputG[i], paths.throughputB[i]) * direct;
+            if (states[i] == PathState::Finish)
+            {
+                frame[paths.pixel[i]] = value;
+                continue;
+            }
+#ifdef RUSSIANROULETTE
+            if (depth + 1 >= RUSSIANROULETTE && !Math::RussianRoulette(value))
+            {
+                frame[paths.pixel[i]] = float3(0);
+                states[i] = PathState::Done;
+                continue;
+            }
+#endif
+            paths.throughputR[i] = value.x, paths.throughputG[i] = value.y, paths.throughputB[i] = value.z;
+            survivors++;
+        }
+        chunkOffsets[chunk + 1] = survivors;
+    });
+
+    // compact the paths that scatter on into the other queue, in order
+    chunkOffsets[0] = 0;
+    for (uint chunk = 0; chunk < chunkCount; chunk++) chunkOffsets[chunk + 1] += chunkOffsets[chunk];
+    ForEachChunk(paths.count, [&](const uint chunk, const uint first, const uint last)
+    {
+        uint slot = chunkOffsets[chunk];
+        for (uint i = first; i < last; i++)
+        {
+            if (states[i] != PathState::Continue) continue;
+            nextPaths.originX[slot] = paths.originX[i], nextPaths.originY[slot] = paths.originY[i], nextPaths.originZ[slot] = paths.originZ[i];
+            nextPaths.directionX[slot] = paths.directionX[i], nextPaths.directionY[slot] = paths.directionY[i];
+            nextPaths.directionZ[slot] = paths.directionZ[i];
+            nextPaths.throughputR[slot] = paths.throughputR[i], nextPaths.throughputG[slot] = paths.throughputG[i];
+            nextPaths.throughputB[slot] = paths.throughputB[i];
+            nextPaths.pixel[slot] = paths.pixel[i];
+            slot++;
+        }
+    });
+    nextPaths.count = chunkOffsets[chunkCount];
+    std::swap(paths, nextPaths);
+}
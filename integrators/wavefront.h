@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include "lights/lightManager.h"
+
+// Wavefront path tracer. Instead of following one pixel's path through a deep recursive
+// call stack, it keeps a batch of paths in structure-of-arrays queues and advances all of
+// them one stage at a time: generate the camera rays, extend every ray to its nearest hit,
+// shade the hits (scatter the continuation, collect light samples), connect the samples to
+// their lights with shadow rays, then fold the light into each path, play Russian roulette
+// and compact the survivors for the next bounce. Each stage is one tight loop over one kind of work, so its
+// code and data stay hot; the image is the one Renderer::Trace computes.
+class WavefrontIntegrator
+{
+public:
+    WavefrontIntegrator();
+
+    // traces one path per pixel of the tiles, given by their top-left pixel, and stores
+    // the radiance of every pixel for Pixel
+    void Render(const Scene& scene, const Camera& camera, const vector<int2>& tiles, int maxDepth);
+    [[nodiscard]] const float3& Pixel(const int x, const int y) const { return frame[x + y * SCRWIDTH]; }
+
+private:
+    // the live paths of one bounce: their next ray, their throughput and their pixel
+    struct PathQueue
+    {
+        void Resize(uint capacity);
+        [[nodiscard]] Ray GetRay(uint i) const;
+        void SetRay(uint i, const Ray& ray);
+
+        vector<float> originX, originY, originZ;
+        vector<float> directionX, directionY, directionZ;
+        vector<float> throughputR, throughputG, throughputB;
+        vector<uint> pixel;
+        uint count = 0;
+    };
+
+    // shadow rays towards the light samples of the shaded hits; a path's samples are
+    // contiguous, starting at its shadowFirst
+    struct ShadowQueue
+    {
+        void Resize(uint capacity);
+
+        vector<float> originX, originY, originZ;
+        vector<float> directionX, directionY, directionZ, distance;
+        vector<float> contributionR, contributionG, contributionB;
+        vector<uchar> visible;
+        uint count = 0;
+    };
+
+    // a shadow ray and its light, as collected by one chunk of the shade stage
+    struct ShadowSample
+    {
+        Ray ray;
+        float3 contribution;
+    };
+
+    // what becomes of a path once its hit is shaded
+    enum class PathState : uchar
+    {
+        Continue, // scatters: its throughput takes the direct light, its ray is the scattered one
+        Finish, // absorbs: its pixel is the throughput times the direct light
+        Done // its pixel is already written: it missed, hit an emitter or ran out of bounces
+    };
+
+    void Generate(const Camera& camera, const int2* tiles, uint tileCount);
+    void Extend(const Scene& scene, bool primary);
+    void Shade(const Scene& scene, int depth, int maxDepth);
+    void Connect(const Scene& scene);
+    void Resolve(const Scene& scene, int depth);
+
+    uint tilesPerBatch;
+    PathQueue paths, nextPaths;
+    vector<HitInfo> hits;
+    vector<HitType> hitTypes;
+    vector<PathState> states;
+    vector<uint> shadowFirst, shadowCount;
+    ShadowQueue shadows;
+    vector<vector<ShadowSample>> chunkShadows;
+    vector<uint> chunkOffsets;
+    vector<float3> frame;
+};
@@ -0,0 +1,129 @@
+﻿#include "precomp.h"
+#include "jobSystem.h"
+
+namespace
+{
+    // set on worker threads, and on the calling thread while its loop runs
+    thread_local bool insideLoop = false;
+}
+
+JobSystem::JobSystem(const uint requestedThreads):
+    threadCount(requestedThreads ? requestedThreads : std::max(std::thread::hardware_concurrency(), 1u)),
+    blocks(std::make_unique<Block[]>(threadCount))
+{
+    for (uint thread = 1; thread < threadCount; thread++) workers.emplace_back(&JobSystem::WorkerLoop, this, thread);
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        shutdown = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) worker.join();
+}
+
+JobSystem& JobSystem::Instance()
+{
+    static JobSystem instance;
+    return instance;
+}
+
+void JobSystem::Run(const uint count, const Body loopBody, void* loopContext)
+{
+    std::unique_lock<std::mutex> loop(loopMutex, std::defer_lock);
+    if (insideLoop || threadCount == 1 || count <= 1 || !loop.try_lock())
+    {
+        for (uint i = 0; i < count; i++) loopBody(loopContext, i);
+        return;
+    }
+
+    // no worker touches the blocks between loops, so they are dealt out without waiting
+    for (uint thread = 0; thread < threadCount; thread++)
+    {
+        std::lock_guard<std::mutex> lock(blocks[thread].mutex);
+        blocks[thread].begin = static_cast<uint>(static_cast<uint64>(count) * thread / threadCount);
+        blocks[thread].end = static_cast<uint>(static_cast<uint64>(count) * (thread + 1) / threadCount);
+    }
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        body = loopBody, context = loopContext;
+        busyWorkers = threadCount - 1;
+        generation++;
+    }
+    wake.notify_all();
+    insideLoop = true;
+    Work(0);
+    insideLoop = false;
+
+    // the blocks are empty, but workers may still be running their last index
+    std::unique_lock<std::mutex> lock(wakeMutex);
+    finished.wait(lock, [this] { return busyWorkers == 0; });
+}
+
+void JobSystem::WorkerLoop(const uint thread)
+{
+    insideLoop = true;
+    uint seenGeneration = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            wake.wait(lock, [&] { return shutdown || generation != seenGeneration; });
+            if (shutdown) return;
+            seenGeneration = generation;
+        }
+        Work(thread);
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        if (--busyWorkers == 0) finished.notify_one();
+    }
+}
+
+void JobSystem::Work(const uint thread)
+{
+    uint index;
+    while (Next(thread, index)) body(context, index);
+}
+
+bool JobSystem::Next(const uint thread, uint& index)
+{
+    Block& own = blocks[thread];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.begin < own.end)
+        {
+            index = own.begin++;
+            return true;
+        }
+    }
+
+    while (true)
+    {
+        // pick the block with the most indices left; the counts are only a guess until the
+        // block is locked, and a thread never holds two block locks
+        uint victim = 0, mostLeft = 0;
+        for (uint t = 0; t < threadCount; t++)
+        {
+            const uint left = blocks[t].end.load(std::memory_order_relaxed) - blocks[t].begin.load(std::memory_order_relaxed);
+            if (t != thread && left > mostLeft && left < 1u << 31) victim = t, mostLeft = left;
+        }
+        if (mostLeft == 0) return false;
+
+        // take the back half, which the owner would have reached last
+        uint begin, end;
+        {
+            Block& block = blocks[victim];
+            std::lock_guard<std::mutex> lock(block.mutex);
+            if (block.begin >= block.end) continue;
+            end = block.end;
+            begin = end - (end - block.begin + 1) / 2;
+            block.end = begin;
+        }
+        index = begin;
+        std::lock_guard<std::mutex> lock(own.mutex);
+        own.begin = begin + 1;
+        own.end = end;
+        return true;
+    }
+}
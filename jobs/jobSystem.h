@@ -0,0 +1,67 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+// Portable work-stealing job system on std::thread. ParallelFor deals the index range out
+// in contiguous blocks, one per thread: a thread works through its own block from the
+// front and, once it is empty, steals the back half of the largest remaining block, so
+// neighbouring indices mostly run on the same thread and a costly region is shared out as
+// soon as a thread runs dry. The calling thread works along and returns when every index
+// is done.
+class JobSystem
+{
+public:
+    // threadCount 0 uses one thread per hardware thread, including the calling one
+    explicit JobSystem(uint threadCount = 0);
+    ~JobSystem();
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    // the shared instance, started on first use
+    static JobSystem& Instance();
+
+    // calls body(i) for every i in [0, count) and returns when all calls are done. a call
+    // from inside a body, or from another thread while a loop runs, runs serially on its
+    // own thread
+    template <class F>
+    void ParallelFor(const uint count, F&& body)
+    {
+        Run(count, [](void* context, const uint i) { (*static_cast<std::remove_reference_t<F>*>(context))(i); }, &body);
+    }
+    [[nodiscard]] uint ThreadCount() const { return threadCount; }
+
+private:
+    using Body = void (*)(void* context, uint i);
+
+    // the indices [begin, end) of one thread's block that have not started; changed under
+    // the mutex, read without it by thieves looking for the fullest block
+    struct alignas(64) Block
+    {
+        std::mutex mutex;
+        std::atomic<uint> begin{0}, end{0};
+    };
+
+    void Run(uint count, Body body, void* context);
+    void WorkerLoop(uint thread);
+    // runs the indices of one loop until none are left in any block
+    void Work(uint thread);
+    // takes the next index of the thread's own block, or steals half of another block
+    bool Next(uint thread, uint& index);
+
+    uint threadCount;
+    std::unique_ptr<Block[]> blocks;
+    vector<std::thread> workers;
+    std::mutex loopMutex; // one loop at a time
+    std::mutex wakeMutex;
+    std::condition_variable wake, finished;
+    uint generation = 0; // counts loops; workers wake when it changes
+    uint busyWorkers = 0; // workers that have not finished the current loop
+    bool shutdown = false;
+    Body body = nullptr;
+    void* context = nullptr;
+};
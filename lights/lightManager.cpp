@@ -1,6 +1,8 @@
 ﻿#include "precomp.h"
 #include "lightManager.h"
 
+#include "primitives/bvh4.h"
+
 float3 LightManager::CalculateAmbientLight() const
 {
     return ambientLight.color * ambientLight.intensity;
@@ -36,136 +38,95 @@ float3 LightManager::CalculateAreaLight(const AreaLightData& light, const float3
 
 float3 LightManager::CalculateTotalContribution(const float3& point, const float3& normal) const
 {
-    auto totalDiffuse = float3{0};
-    totalDiffuse += CalculateAmbientLight();
-
-    const int lightCount = static_cast<int>(pointLights.size() + directionalLights.size() + spotLights.size() +
-        areaLights.size());
-    if (bStochastic && lightCount > 0)
+    // reused by every call on a thread, so shading does not allocate
+    thread_local vector<LightSample> samples;
+    samples.clear();
+    SampleLights(point, normal, samples);
+    auto totalDiffuse = CalculateAmbientLight();
+    for (const LightSample& sample : samples)
     {
-        totalDiffuse += CalculateStochasticTotalContribution(point, normal);
+        totalDiffuse += sample.contribution * CastShadow(point, normal, sample.direction, sample.distance);
     }
-
-    else
-    {
-        auto shadowIntensity = 0.f;
-        // Handle lighting for point lights
-
-        for (auto& pointLight : pointLights)
-        {
-            auto diffuseVal = CalculatePointLight(pointLight, point);
-            const auto direction = normalize(pointLight.position - point);
-            const auto distance = length(pointLight.position - point);
-            shadowIntensity = CastShadow(point, normal, direction, distance);
-            const float diffuseIntensity = max(dot(normal, direction), 0.f);
-            totalDiffuse += diffuseVal * diffuseIntensity * shadowIntensity;
-        }
-
-        for (auto& directionalLight : directionalLights)
-        {
-            const auto diffuseVal = CalculateDirectionalLight(directionalLight);
-            const auto direction = normalize(-directionalLight.direction);
-            shadowIntensity = CastShadow(point, normal, direction);
-            const float diffuseIntensity = max(dot(normal, direction), 0.f);
-            totalDiffuse += diffuseVal * diffuseIntensity * shadowIntensity;
-        }
-
-        for (auto& spotLight : spotLights)
-        {
-            auto diffuseVal = CalculateSpotLight(spotLight, point);
-            const auto direction = normalize(point - spotLight.position);
-            const auto distance = length( point - spotLight.position);
-            shadowIntensity = CastShadow(point, normal, direction, distance);
-            totalDiffuse += diffuseVal * shadowIntensity;
-        }
-
-        for (auto& areaLight : areaLights)
-        {
-            auto diffuseVal = CalculateAreaLight(areaLight, point);
-            const auto direction = normalize(areaLight.position - point);
-            const auto distance = length(areaLight.position - point);
-            shadowIntensity = CastShadow(point, normal, direction, distance);
-            const float diffuseIntensity = max(dot(normal, direction), 0.f);
-            totalDiffuse += diffuseVal * diffuseIntensity * shadowIntensity;
-        }
-    }
-    
     return totalDiffuse;
 }
 
-float3 LightManager::CalculateStochasticTotalContribution(const float3& point, const float3& normal) const
+void LightManager::SampleLights(const float3& point, const float3& normal, vector<LightSample>& samples) const
 {
-    const int totalLights = static_cast<int>(pointLights.size() + directionalLights.size() + spotLights.size() +
+    const int lightCount = static_cast<int>(pointLights.size() + directionalLights.size() + spotLights.size() +
         areaLights.size());
-    int lightSelection = Math::RandomIntRange(0, totalLights);
-    int lightIndex;
-    auto totalDiffuse = float3{0};
-    float shadowIntensity;
+    if (lightCount == 0) return;
+    if (bStochastic)
+    {
+        // one light picked at random stands in for all of them
+        SampleLight(Math::RandomIntRange(0, lightCount), point, normal, static_cast<float>(lightCount), samples);
+        return;
+    }
+    for (int i = 0; i < lightCount; i++) SampleLight(i, point, normal, 1, samples);
+}
 
-    if (lightSelection < static_cast<int>(pointLights.size()))
+void LightManager::SampleLight(int lightIndex, const float3& point, const float3& normal, const float weight,
+                               vector<LightSample>& samples) const
+{
+    if (lightIndex < static_cast<int>(pointLights.size()))
     {
-        lightIndex = lightSelection;
         auto& pointLight = pointLights[lightIndex];
-        const auto diffuseVal = CalculatePointLight(pointLight, point);
         const auto direction = normalize(pointLight.position - point);
-        const auto distance = length(pointLight.position - point);
-        shadowIntensity = CastShadow(point, normal, direction, distance);
         const float diffuseIntensity = max(dot(normal, direction), 0.f);
-        totalDiffuse += diffuseVal * diffuseIntensity * shadowIntensity;
-        return totalDiffuse * static_cast<float>(totalLights);
+        samples.push_back({CalculatePointLight(pointLight, point) * diffuseIntensity * weight, direction,
+                           length(pointLight.position - point)});
+        return;
     }
-    
-    lightSelection -= static_cast<int>(pointLights.size());
-    if (lightSelection < static_cast<int>(directionalLights.size()))
+
+    lightIndex -= static_cast<int>(pointLights.size());
+    if (lightIndex < static_cast<int>(directionalLights.size()))
     {
-        lightIndex = lightSelection;
         auto& directionalLight = directionalLights[lightIndex];
-        const auto diffuseVal = CalculateDirectionalLight(directionalLight);
-        const auto direction = normalize(directionalLight.direction);
-        shadowIntensity = CastShadow(point, normal, direction);
+        const auto direction = normalize(-directionalLight.direction);
         const float diffuseIntensity = max(dot(normal, direction), 0.f);
-        totalDiffuse += diffuseVal * diffuseIntensity * shadowIntensity;
-        return totalDiffuse * static_cast<float>(totalLights);
+        samples.push_back({CalculateDirectionalLight(directionalLight) * diffuseIntensity * weight, direction, FLT_MAX});
+        return;
     }
-    
-    lightSelection -= static_cast<int>(directionalLights.size());
-    if (lightSelection < static_cast<int>(spotLights.size()))
+
+    lightIndex -= static_cast<int>(directionalLights.size());
+    if (lightIndex < static_cast<int>(spotLights.size()))
     {
-        lightIndex = lightSelection;
         auto& spotLight = spotLights[lightIndex];
-        const auto diffuseVal = CalculateSpotLight(spotLight, point);
         const auto direction = normalize(point - spotLight.position);
-        const auto distance = length( point - spotLight.position);
-        shadowIntensity = CastShadow(point, normal, direction, distance);
-        totalDiffuse += diffuseVal * shadowIntensity;
-        return totalDiffuse * static_cast<float>(totalLights);
+        samples.push_back({CalculateSpotLight(spotLight, point) * weight, direction, length(point - spotLight.position)});
+        return;
     }
-    
-    lightSelection -= static_cast<int>(spotLights.size());
-    if (lightSelection < static_cast<int>(areaLights.size()))
+
+    lightIndex -= static_cast<int>(spotLights.size());
+    if (lightIndex < static_cast<int>(areaLights.size()))
     {
-        lightIndex = lightSelection;
         auto& areaLight = areaLights[lightIndex];
-        const auto diffuseVal = CalculateAreaLight(areaLight, point);
         const auto direction = normalize(areaLight.position - point);
-        const auto distance = length(areaLight.position - point);
-        shadowIntensity = CastShadow(point, normal, direction, distance);
         const float diffuseIntensity = max(dot(normal, direction), 0.f);
-        totalDiffuse += diffuseVal * diffuseIntensity * shadowIntensity;
-        return totalDiffuse * static_cast<float>(totalLights);
+        samples.push_back({CalculateAreaLight(areaLight, point) * diffuseIntensity * weight, direction,
+                           length(areaLight.position - point)});
     }
-    return totalDiffuse;
 }
 
 float LightManager::CastShadow(const float3& intersection, const float3& normal, const float3& direction,
                                float distance) const
 {
-    if (dot(normal,direction) < 0) return 0;
-    float shadowIntensity = 0.f;
+    Ray shadowRay;
+    if (!ShadowRay(intersection, normal, direction, distance, shadowRay)) return 0;
+    return IsOccluded(shadowRay) ? 0.f : 1.f;
+}
+
+bool LightManager::ShadowRay(const float3& intersection, const float3& normal, const float3& direction, const float distance,
+                             Ray& shadowRay) const
+{
+    if (dot(normal,direction) < 0) return false;
     const auto shadowRayOrigin = intersection + normal * EPSILON;
     const auto shadowRayDirection = direction + Math::RandomUnitVector() * softShadowAmount;
+    shadowRay = Ray{shadowRayOrigin, shadowRayDirection, distance};
+    return true;
+}
 
-    const Ray shadowRay{shadowRayOrigin, shadowRayDirection, distance};
-    if (!scene->IsOccluded(shadowRay)) shadowIntensity += 1.f;
-    return shadowIntensity;
+bool LightManager::IsOccluded(const Ray& shadowRay) const
+{
+    // any-hit queries: the first voxel or sphere in front of the light settles it
+    return scene->IsOccluded(shadowRay) || scene->bvhSpheres->IsOccluded(shadowRay);
 }
@@ -6,6 +6,15 @@ namespace Tmpl8
     class Scene;
 }
 
+// Direct light at a surface point before shadowing: the light's color times its cosine
+// term, and the direction and distance a shadow ray has to clear.
+struct LightSample
+{
+    float3 contribution;
+    float3 direction;
+    float distance;
+};
+
 class LightManager
 {
 public:
@@ -16,8 +25,14 @@ public:
     [[nodiscard]] float3 CalculateAreaLight(const AreaLightData& light, const float3& point) const;
 
     [[nodiscard]] float3 CalculateTotalContribution(const float3& point, const float3& normal) const;
-    [[nodiscard]] float3 CalculateStochasticTotalContribution(const float3& point, const float3& normal) const;
+    // appends the unshadowed samples at point: one per light, or with bStochastic one random
+    // light weighted by the light count
+    void SampleLights(const float3& point, const float3& normal, vector<LightSample>& samples) const;
     [[nodiscard]] float CastShadow(const float3& intersection, const float3& normal, const float3& direction, float distance = FLT_MAX) const;
+    // the jittered shadow ray towards a light; false when the light is behind the surface
+    bool ShadowRay(const float3& intersection, const float3& normal, const float3& direction, float distance, Ray& shadowRay) const;
+    // whether a voxel or a sphere blocks the shadow ray
+    [[nodiscard]] bool IsOccluded(const Ray& shadowRay) const;
 
     vector<PointLightData> pointLights;
     vector<SpotLightData> spotLights;
@@ -27,4 +42,7 @@ public:
     Scene* scene;
     bool bStochastic = false;
     float softShadowAmount = 0.7f;
+
+private:
+    void SampleLight(int lightIndex, const float3& point, const float3& normal, float weight, vector<LightSample>& samples) const;
 };
@@ -47,3 +47,39 @@ struct Material
 
     uint* pixels = nullptr;
 };
+
+// everything a voxel looks like. the world only stores an index into the
+// voxel palette of the MaterialManager, so this is kept once per distinct look.
+struct VoxelData
+{
+    Material material;
+    uint color = 0;
+    uint specialColor = 0;
+    bool special = false;
+};
+
+// a VoxelData as world files and brick stores keep it: without the texture pointer, and
+// with the one float of the material union as parameter
+struct PaletteEntry
+{
+    uint type, color, specialColor, special;
+    float parameter;
+
+    static PaletteEntry From(const VoxelData& voxel)
+    {
+        return {static_cast<uint>(voxel.material.type), voxel.color, voxel.specialColor, voxel.special, voxel.material.glossy.fuzz};
+    }
+
+    [[nodiscard]] bool Valid() const { return type <= static_cast<uint>(Material::Type::Lambert); }
+
+    [[nodiscard]] VoxelData Voxel() const
+    {
+        VoxelData voxel;
+        voxel.material.type = static_cast<Material::Type>(type);
+        voxel.material.glossy.fuzz = parameter;
+        voxel.color = color;
+        voxel.specialColor = specialColor;
+        voxel.special = special != 0;
+        return voxel;
+    }
+};
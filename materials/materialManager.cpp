@@ -3,6 +3,46 @@
 
 MaterialManager::MaterialManager()
 {
+    voxelPalette.push_back(VoxelData());
+}
+
+ushort MaterialManager::GetVoxelPaletteIndex(const VoxelData& data)
+{
+    if (!Math::ValidColor(data.color)) return 0;
+    // palettes stay small (a handful of looks per world), so a linear search is fine
+    for (size_t i = 1; i < voxelPalette.size(); i++)
+    {
+        if (SameVoxel(voxelPalette[i], data)) return static_cast<ushort>(i);
+    }
+    if (voxelPalette.size() > 0xffff) FATALERROR("voxel palette is full (%zu entries)", voxelPalette.size());
+    voxelPalette.push_back(data);
+    return static_cast<ushort>(voxelPalette.size() - 1);
+}
+
+const VoxelData& MaterialManager::GetVoxelData(const ushort paletteIndex) const
+{
+    return voxelPalette[paletteIndex];
+}
+
+size_t MaterialManager::VoxelPaletteMemoryUsage() const
+{
+    return voxelPalette.capacity() * sizeof(VoxelData);
+}
+
+bool MaterialManager::SameVoxel(const VoxelData& a, const VoxelData& b)
+{
+    if (a.color != b.color || a.specialColor != b.specialColor || a.special != b.special) return false;
+    if (a.material.type != b.material.type || a.material.pixels != b.material.pixels) return false;
+    // only compare the union member that belongs to the type; the others are uninitialized
+    switch (a.material.type)
+    {
+    case Material::Type::Glossy:
+        return a.material.glossy.fuzz == b.material.glossy.fuzz;
+    case Material::Type::Dielectric:
+        return a.material.dielectric.refractiveIndex == b.material.dielectric.refractiveIndex;
+    default:
+        return true;
+    }
 }
 
 bool MaterialManager::Scatter(const HitInfo& hitInfo, Ray& scattered) const
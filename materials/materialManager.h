@@ -15,6 +15,11 @@ class MaterialManager
 public:
     MaterialManager();
 
+    // voxel palette: index 0 is the empty voxel, identical voxels share an entry
+    ushort GetVoxelPaletteIndex(const VoxelData& data);
+    [[nodiscard]] const VoxelData& GetVoxelData(ushort paletteIndex) const;
+    [[nodiscard]] size_t VoxelPaletteMemoryUsage() const;
+
     bool Scatter(const HitInfo& hitInfo, Ray& scattered) const;
     bool ScatterDiffuse(const HitInfo& hitInfo, Ray& scattered) const;
     bool ScatterMirror(const HitInfo& hitInfo, Ray& scattered) const;
@@ -27,4 +32,9 @@ public:
     bool ScatterMirrorSphere(const HitInfo& hitInfo, Ray& scattered) const;
     bool ScatterGlossySphere(const HitInfo& hitInfo, Ray& scattered) const;
     bool ScatterDielectricSphere(const HitInfo& hitInfo, Ray& scattered) const;
+
+    vector<VoxelData> voxelPalette;
+
+private:
+    static bool SameVoxel(const VoxelData& a, const VoxelData& b);
 };
@@ -223,6 +223,18 @@ public:
         return (fabs(v.x) < s) && (fabs(v.y) < s) && (fabs(v.z) < s);
     }
 
+    // Russian roulette on a path throughput: the path survives with the probability of its
+    // brightest channel, and a survivor's throughput is divided by that probability, so dim
+    // paths end early while the estimate stays unbiased
+    static bool RussianRoulette(float3& throughput)
+    {
+        const float survival = fminf(MaxComponent(throughput), 1.f);
+        if (survival >= 1) return true;
+        if (RandomFloat() >= survival) return false;
+        throughput *= 1 / survival;
+        return true;
+    }
+
     static float Reflectance(const float cosine, const float refractionRatio)
     {
         // Use Schlick's approximation for reflectance.
@@ -1,87 +1,763 @@
 ﻿#include "precomp.h"
 #include "bvh.h"
 
-BVHSphere::BVHSphere(const vector<Sphere*>& spheres)
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
 {
-    root = BuildBVH(spheres);
+    constexpr int Bins = 8;
+    constexpr int MaxStackSize = 64;
+    // past this depth nodes are split at the median, which halves them: a subtree of fewer
+    // than 2^32 spheres then adds at most 32 levels, so traversal never outgrows its stack
+    constexpr uint MaxSplitDepth = 32;
+    static_assert(MaxSplitDepth + 32 <= MaxStackSize, "the deepest leaf must fit on the traversal stack");
+    constexpr float NoHit = 1e34f;
+    constexpr uint MortonLeafSize = 4;
+    constexpr uint ParallelSubtreeSize = 4096; // smaller subtrees are not split up further before the parallel build
+    constexpr uint ParallelBinningSize = 1 << 16; // larger nodes are binned in chunks on all threads
+    constexpr int BinningChunks = 64;
+
+    // per axis: the bounds of the sphere centers, then the spheres in each bin
+    struct SplitBins
+    {
+        float3 centerMin, centerMax;
+        aabb bounds[3][Bins];
+        int count[3][Bins];
+    };
+
+    // runs f(chunk) for every chunk, on all threads when there is more than one; small
+    // nodes never enter a parallel region, which costs more than binning them
+    template <class F>
+    void ForEachChunk(const int chunkCount, F&& f)
+    {
+        if (chunkCount == 1)
+        {
+            f(0);
+            return;
+        }
+#pragma omp parallel for schedule(dynamic)
+        for (int chunk = 0; chunk < chunkCount; chunk++) f(chunk);
+    }
+
+    // inserts two zero bits before each of the lower 10 bits
+    uint SpreadBits(uint v)
+    {
+        v = (v * 0x00010001u) & 0xff0000ffu;
+        v = (v * 0x00000101u) & 0x0f00f00fu;
+        v = (v * 0x00000011u) & 0xc30c30c3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    float HalfArea(const BVHSphereNode& node)
+    {
+        const float3 extent = node.aabbMax - node.aabbMin;
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+
+    float NodeCost(const BVHSphereNode& node)
+    {
+        return node.count * HalfArea(node);
+    }
+
+    // step q of a quantized coordinate lies at boxMin * (1 - t) + boxMax * t, t = q / 255,
+    // which is exact at both ends of the box
+    const auto QuantizationSteps = []
+    {
+        std::array<float, 256> steps;
+        for (int q = 0; q < 256; q++) steps[q] = static_cast<float>(q) / 255;
+        return steps;
+    }();
+
+    // building and traversal must decode with the same operations, or a box that was
+    // rounded outwards while building could end up a little smaller while tracing
+    float Dequantize(const float boxMin, const float boxMax, const uchar q)
+    {
+        const float t = QuantizationSteps[q];
+        return boxMin * (1 - t) + boxMax * t;
+    }
+
+    float3 Dequantize(const float3& boxMin, const float3& boxMax, const uchar* q)
+    {
+        return float3(Dequantize(boxMin.x, boxMax.x, q[0]), Dequantize(boxMin.y, boxMax.y, q[1]), Dequantize(boxMin.z, boxMax.z, q[2]));
+    }
+
+    // quantizes the child box on the grid over the decoded box of its parent, rounding
+    // outwards, and returns the decoded child box that its own children are quantized in
+    void QuantizeBox(const float3& boxMin, const float3& boxMax, const BVHSphereNode& child, uchar* q, float3& childMin, float3& childMax)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            const float extent = boxMax.cell[a] - boxMin.cell[a];
+            int qMin = 0, qMax = 255;
+            if (extent > 0)
+            {
+                qMin = std::clamp(static_cast<int>(floorf((child.aabbMin.cell[a] - boxMin.cell[a]) / extent * 255)), 0, 255);
+                qMax = std::clamp(static_cast<int>(ceilf((child.aabbMax.cell[a] - boxMin.cell[a]) / extent * 255)), 0, 255);
+            }
+            // the estimate may be a step off after rounding
+            while (qMin > 0 && Dequantize(boxMin.cell[a], boxMax.cell[a], static_cast<uchar>(qMin)) > child.aabbMin.cell[a]) qMin--;
+            while (qMax < 255 && Dequantize(boxMin.cell[a], boxMax.cell[a], static_cast<uchar>(qMax)) < child.aabbMax.cell[a]) qMax++;
+            q[a] = static_cast<uchar>(qMin);
+            q[a + 3] = static_cast<uchar>(qMax);
+        }
+        childMin = Dequantize(boxMin, boxMax, q);
+        childMax = Dequantize(boxMin, boxMax, q + 3);
+    }
 }
 
-BVHSphereNode* BVHSphere::BuildBVH(const std::vector<Sphere*>& spheres)
+BVHSphere::BVHSphere(const SphereSet& spheres, const SphereBuild mode)
 {
-    if (spheres.empty()) return nullptr;
+    BuildBVH(spheres, mode);
+}
 
-    // Create a new node
-    const auto node = new BVHSphereNode();
-    // If there is only one sphere, assign it to the node
-    if (spheres.size() == 1) node->sphere = spheres[0];
+void BVHSphere::BuildBVH(const SphereSet& sceneSpheres, const SphereBuild mode)
+{
+    spheres = &sceneSpheres;
+    buildMode = mode;
+    nodesUsed = 0;
+    builtCost = 0;
+    const uint count = spheres->Count();
+    sphereIndices.resize(count);
+    if (count == 0) return;
 
-    // Otherwise, split the spheres and build the BVH
+    // a binary tree over n leaves has at most 2n - 1 nodes, so the whole tree is
+    // allocated up front and build threads only bump nodesUsed
+    nodes.assign(count * 2 - 1, BVHSphereNode());
+    BVHSphereNode& root = nodes[nodesUsed++];
+    root.leftFirst = 0;
+    root.count = count;
+    if (mode == SphereBuild::Morton) SortByMortonCode();
     else
     {
-        vector<Sphere*> left, right;
-        SplitSpheres(spheres, left, right);
-        node->left = BuildBVH(left);
-        node->right = BuildBVH(right);
+        for (uint i = 0; i < count; i++) sphereIndices[i] = i;
+        UpdateNodeBounds(0);
+    }
+
+    // split the largest subtree on this thread until there are enough of them to keep all
+    // threads busy; large nodes are binned on all threads meanwhile
+#ifdef _OPENMP
+    const size_t parallelSubtrees = static_cast<size_t>(omp_get_max_threads()) * 4;
+#else
+    const size_t parallelSubtrees = 1;
+#endif
+    struct Subtree
+    {
+        uint node, depth;
+    };
+    vector<Subtree> subtrees = {{0, 0}};
+    const auto smaller = [this](const Subtree& a, const Subtree& b) { return nodes[a.node].count < nodes[b.node].count; };
+    while (!subtrees.empty() && subtrees.size() < parallelSubtrees)
+    {
+        std::pop_heap(subtrees.begin(), subtrees.end(), smaller);
+        const Subtree largest = subtrees.back();
+        if (nodes[largest.node].count < ParallelSubtreeSize)
+        {
+            std::push_heap(subtrees.begin(), subtrees.end(), smaller);
+            break;
+        }
+        subtrees.pop_back();
+        if (!Split(largest.node, largest.depth)) continue;
+        for (const uint child : {nodes[largest.node].leftFirst, nodes[largest.node].leftFirst + 1})
+        {
+            subtrees.push_back({child, largest.depth + 1});
+            std::push_heap(subtrees.begin(), subtrees.end(), smaller);
+        }
+    }
+    std::sort_heap(subtrees.begin(), subtrees.end(), smaller);
+    // largest first, so the last subtree to start is a small one
+#pragma omp parallel for schedule(dynamic)
+    for (int i = static_cast<int>(subtrees.size()) - 1; i >= 0; i--) Subdivide(subtrees[i].node, subtrees[i].depth);
+
+    if (mode == SphereBuild::Morton)
+    {
+        // the Morton split ignores bounds, so they are computed once, bottom-up
+        mortonCodes = vector<uint>();
+        RefitNodes();
     }
-    return node;
+    builtCost = SAHCost();
+    if (quantized) ReleaseNodes();
 }
 
-void BVHSphere::SplitSpheres(const vector<Sphere*>& spheres, vector<Sphere*>& left, vector<Sphere*>& right) const
+bool BVHSphere::Bounds(float3& aabbMin, float3& aabbMax) const
 {
-    const aabb aabb = GetAABB(spheres);
-    const auto size = spheres.size();
-    const auto axis = aabb.LongestAxis();
+    if (nodesUsed == 0) return false;
+    if (quantized) aabbMin = rootMin, aabbMax = rootMax;
+    else aabbMin = nodes[0].aabbMin, aabbMax = nodes[0].aabbMax;
+    return true;
+}
+
+float BVHSphere::Refit()
+{
+    // a quantized tree has no float nodes to refit; they are rebuilt from its topology
+    // for the duration of the refit and quantized again afterwards
+    if (quantized) RestoreNodes();
+    RefitNodes();
+    const float cost = builtCost > 0 ? SAHCost() / builtCost : 1;
+    if (quantized) ReleaseNodes();
+    return cost;
+}
 
-    // Sort the spheres along the longest axis
-    vector<Sphere*> sortedSpheres = spheres;
-    std::sort(sortedSpheres.begin(), sortedSpheres.end(), [axis](Sphere* a, Sphere* b)
+void BVHSphere::RefitNodes()
+{
+    // children are allocated after their parent, so a backwards pass sees them first
+    for (int i = static_cast<int>(nodesUsed) - 1; i >= 0; i--)
     {
-        return a->center[axis] < b->center[axis];
-    });
+        BVHSphereNode& node = nodes[i];
+        if (node.IsLeaf())
+        {
+            UpdateNodeBounds(i);
+            continue;
+        }
+        const BVHSphereNode& left = nodes[node.leftFirst];
+        const BVHSphereNode& right = nodes[node.leftFirst + 1];
+        node.aabbMin = fminf(left.aabbMin, right.aabbMin);
+        node.aabbMax = fmaxf(left.aabbMax, right.aabbMax);
+    }
+}
 
-    // Split the spheres in half
-    const auto mid = size / 2;
-    left = vector(sortedSpheres.begin(), sortedSpheres.begin() + mid);
-    right = vector(sortedSpheres.begin() + mid, sortedSpheres.end());
+void BVHSphere::Quantize()
+{
+    if (quantized) return;
+    quantized = true;
+    ReleaseNodes();
 }
 
-aabb BVHSphere::GetAABB(const vector<Sphere*>& spheres) const
+void BVHSphere::ReleaseNodes()
 {
-    float3 min = spheres[0]->center - float3(spheres[0]->radius);
-    float3 max = spheres[0]->center + float3(spheres[0]->radius);
-    
-    for (const auto& sphere : spheres)
+    UpdateQuantizedNodes();
+    if (nodesUsed > 0) rootMin = nodes[0].aabbMin, rootMax = nodes[0].aabbMax;
+    quantizedCost = SAHCost();
+    nodes = vector<BVHSphereNode>();
+}
+
+void BVHSphere::RestoreNodes()
+{
+    // only the topology is restored; the refit that follows recomputes every box
+    nodes.resize(nodesUsed);
+    for (uint i = 0; i < nodesUsed; i++)
     {
-        const auto sphereMin = sphere->center - float3(sphere->radius);
-        const auto sphereMax = sphere->center + float3(sphere->radius);
+        const BVHSphereQuantizedNode& quantizedNode = quantizedNodes[i];
+        if (quantizedNode.IsLeaf()) nodes[i].leftFirst = quantizedNode.range[0], nodes[i].count = quantizedNode.range[1];
+        else nodes[i].leftFirst = quantizedNode.leftChild, nodes[i].count = 0;
+    }
+}
 
-        min.x = std::min(min.x, sphereMin.x);
-        min.y = std::min(min.y, sphereMin.y);
-        min.z = std::min(min.z, sphereMin.z);
+void BVHSphere::UpdateQuantizedNodes()
+{
+    quantizedNodes.resize(nodesUsed);
+    if (nodesUsed == 0) return;
 
-        max.x = std::max(max.x, sphereMax.x);
-        max.y = std::max(max.y, sphereMax.y);
-        max.z = std::max(max.z, sphereMax.z);
+    // children are allocated after their parent, so a forward pass has decoded the box of
+    // every node before its children are quantized in it; the root box is stored exactly
+    vector<float3> decodedMin(nodesUsed), decodedMax(nodesUsed);
+    decodedMin[0] = nodes[0].aabbMin, decodedMax[0] = nodes[0].aabbMax;
+    for (uint i = 0; i < nodesUsed; i++)
+    {
+        const BVHSphereNode& node = nodes[i];
+        BVHSphereQuantizedNode& quantizedNode = quantizedNodes[i];
+        if (node.IsLeaf())
+        {
+            quantizedNode.range[0] = node.leftFirst;
+            quantizedNode.range[1] = node.count;
+            quantizedNode.leftChild = BVHSphereQuantizedNode::LeafFlag;
+            continue;
+        }
+        quantizedNode.leftChild = node.leftFirst;
+        for (uint c = 0; c < 2; c++)
+        {
+            const uint child = node.leftFirst + c;
+            QuantizeBox(decodedMin[i], decodedMax[i], nodes[child], quantizedNode.childBounds[c], decodedMin[child], decodedMax[child]);
+        }
     }
+}
 
-    return {min, max};
+size_t BVHSphere::MemoryUsage() const
+{
+    return nodesUsed * (quantized ? sizeof(BVHSphereQuantizedNode) : sizeof(BVHSphereNode));
 }
 
-bool BVHSphere::Traverse(BVHSphereNode* node, Ray& ray, HitInfo& hitInfo) const
+float BVHSphere::SAHCost() const
 {
-    if (!node) return false;
+    if (nodesUsed == 0) return 0;
+    if (nodes.empty()) return quantizedCost;
+    const float rootArea = HalfArea(nodes[0]);
+    if (rootArea <= 0) return 0;
+    float cost = 0;
+    for (uint i = 0; i < nodesUsed; i++) cost += nodes[i].IsLeaf() ? NodeCost(nodes[i]) : HalfArea(nodes[i]);
+    return cost / rootArea;
+}
 
-    // If the node is a leaf, check for intersection
-    if (node->sphere)
+void BVHSphere::UpdateNodeBounds(const uint nodeIndex)
+{
+    BVHSphereNode& node = nodes[nodeIndex];
+    node.aabbMin = float3(1e34f);
+    node.aabbMax = float3(-1e34f);
+    for (uint i = node.leftFirst; i < node.leftFirst + node.count; i++)
     {
-        return node->sphere->HitSphere(ray, hitInfo);
+        const uint sphere = sphereIndices[i];
+        const float3 center = spheres->Center(sphere);
+        const float radius = spheres->radius[sphere];
+        node.aabbMin = fminf(node.aabbMin, center - float3(radius));
+        node.aabbMax = fmaxf(node.aabbMax, center + float3(radius));
     }
+}
 
-    // If the node is not a leaf, check both children
-    return Traverse(node->left, ray,hitInfo) || Traverse(node->right, ray, hitInfo);
+void BVHSphere::SortByMortonCode()
+{
+    // 30-bit codes of the centers quantized to 1024 steps per axis, paired with the sphere
+    // index and sorted by three 10-bit radix passes
+    const uint count = spheres->Count();
+    float3 centerMin(1e34f), centerMax(-1e34f);
+    for (uint i = 0; i < count; i++)
+    {
+        centerMin = fminf(centerMin, spheres->Center(i));
+        centerMax = fmaxf(centerMax, spheres->Center(i));
+    }
+    const float3 extent = centerMax - centerMin;
+    const float3 scale(extent.x > 0 ? 1023.99f / extent.x : 0, extent.y > 0 ? 1023.99f / extent.y : 0, extent.z > 0 ? 1023.99f / extent.z : 0);
+    vector<uint64> keys(count), sorted(count);
+#pragma omp parallel for schedule(dynamic, 4096)
+    for (int i = 0; i < static_cast<int>(count); i++)
+    {
+        const float3 cell = (spheres->Center(i) - centerMin) * scale;
+        const uint code = SpreadBits(static_cast<uint>(cell.x)) << 2 | SpreadBits(static_cast<uint>(cell.y)) << 1 |
+            SpreadBits(static_cast<uint>(cell.z));
+        keys[i] = static_cast<uint64>(code) << 32 | static_cast<uint>(i);
+    }
+    for (int shift = 32; shift < 62; shift += 10)
+    {
+        uint offsets[1024] = {};
+        for (const uint64 key : keys) offsets[key >> shift & 1023]++;
+        for (uint digit = 0, sum = 0; digit < 1024; digit++)
+        {
+            const uint digitCount = offsets[digit];
+            offsets[digit] = sum;
+            sum += digitCount;
+        }
+        for (const uint64 key : keys) sorted[offsets[key >> shift & 1023]++] = key;
+        keys.swap(sorted);
+    }
+    mortonCodes.resize(count);
+    for (uint i = 0; i < count; i++)
+    {
+        sphereIndices[i] = static_cast<uint>(keys[i]);
+        mortonCodes[i] = static_cast<uint>(keys[i] >> 32);
+    }
 }
 
-bool BVHSphere::BeginTraversal(Ray& ray, HitInfo& hitInfo) const
+void BVHSphere::Subdivide(const uint nodeIndex, const uint depth)
 {
-    return Traverse(root, ray, hitInfo);
-}
\ No newline at end of file
+    if (!Split(nodeIndex, depth)) return;
+    const uint leftChild = nodes[nodeIndex].leftFirst;
+    Subdivide(leftChild, depth + 1);
+    Subdivide(leftChild + 1, depth + 1);
+}
+
+bool BVHSphere::Split(const uint nodeIndex, const uint depth)
+{
+    BVHSphereNode& node = nodes[nodeIndex];
+    if (node.count <= 1) return false;
+
+    uint leftCount;
+    if (buildMode == SphereBuild::Morton)
+    {
+        if (node.count <= MortonLeafSize) return false;
+        leftCount = depth < MaxSplitDepth ? MortonSplit(node) : node.count / 2; // the codes are sorted
+    }
+    else
+    {
+        // stop when no split is cheaper than intersecting all spheres of the node
+        int axis;
+        float splitPosition;
+        const float splitCost = FindBestSplitPlane(node, axis, splitPosition);
+        if (splitCost >= NodeCost(node)) return false;
+
+        if (depth >= MaxSplitDepth)
+        {
+            // too deep for more uneven splits: halve the node along the widest axis of its bounds
+            const float3 extent = node.aabbMax - node.aabbMin;
+            const float* centers = Centers(extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2));
+            uint* first = sphereIndices.data() + node.leftFirst;
+            leftCount = node.count / 2;
+            std::nth_element(first, first + leftCount, first + node.count, [centers](const uint a, const uint b) { return centers[a] < centers[b]; });
+        }
+        else
+        {
+            // partition the spheres in place around the split plane
+            const float* centers = Centers(axis);
+            int i = static_cast<int>(node.leftFirst);
+            int j = i + static_cast<int>(node.count) - 1;
+            while (i <= j)
+            {
+                if (centers[sphereIndices[i]] < splitPosition) i++;
+                else std::swap(sphereIndices[i], sphereIndices[j--]);
+            }
+            leftCount = i - node.leftFirst;
+            if (leftCount == 0 || leftCount == node.count) return false;
+        }
+    }
+
+    const uint leftChild = nodesUsed.fetch_add(2);
+    const uint rightChild = leftChild + 1;
+    nodes[leftChild].leftFirst = node.leftFirst;
+    nodes[leftChild].count = leftCount;
+    nodes[rightChild].leftFirst = node.leftFirst + leftCount;
+    nodes[rightChild].count = node.count - leftCount;
+    node.leftFirst = leftChild;
+    node.count = 0;
+    if (buildMode == SphereBuild::BinnedSAH)
+    {
+        UpdateNodeBounds(leftChild);
+        UpdateNodeBounds(rightChild);
+    }
+    return true;
+}
+
+uint BVHSphere::MortonSplit(const BVHSphereNode& node) const
+{
+    // the codes of the node share a prefix; split where its next bit turns to one, or
+    // in the middle when all codes are equal
+    const uint first = node.leftFirst, last = node.leftFirst + node.count - 1;
+    const uint difference = mortonCodes[first] ^ mortonCodes[last];
+    if (difference == 0) return node.count / 2;
+    uint bit = 0;
+    while (difference >> (bit + 1)) bit++;
+    const uint boundary = mortonCodes[last] >> bit << bit;
+    const auto split = std::lower_bound(mortonCodes.begin() + first, mortonCodes.begin() + last, boundary);
+    return static_cast<uint>(split - (mortonCodes.begin() + first));
+}
+
+float BVHSphere::FindBestSplitPlane(const BVHSphereNode& node, int& axis, float& splitPosition) const
+{
+    // nodes near the root are binned in chunks on all threads, then the chunks are merged;
+    // the vector is only needed for them, smaller nodes bin into a local set
+    const int chunkCount = node.count > ParallelBinningSize ? BinningChunks : 1;
+    const uint chunkSize = (node.count + chunkCount - 1) / chunkCount;
+    SplitBins local;
+    vector<SplitBins> partial(chunkCount > 1 ? chunkCount : 0);
+    SplitBins* bins = chunkCount > 1 ? partial.data() : &local;
+
+    // bins span the bounds of the sphere centers, which decide the side of a sphere
+    const auto boundCenters = [&](const int chunk)
+    {
+        SplitBins& chunkBins = bins[chunk];
+        chunkBins.centerMin = float3(1e34f), chunkBins.centerMax = float3(-1e34f);
+        const uint first = node.leftFirst + chunk * chunkSize, end = std::min(node.leftFirst + node.count, first + chunkSize);
+        for (uint i = first; i < end; i++)
+        {
+            chunkBins.centerMin = fminf(chunkBins.centerMin, spheres->Center(sphereIndices[i]));
+            chunkBins.centerMax = fmaxf(chunkBins.centerMax, spheres->Center(sphereIndices[i]));
+        }
+    };
+    ForEachChunk(chunkCount, boundCenters);
+    float3 boundsMin = bins[0].centerMin, boundsMax = bins[0].centerMax;
+    for (int chunk = 1; chunk < chunkCount; chunk++)
+    {
+        boundsMin = fminf(boundsMin, bins[chunk].centerMin);
+        boundsMax = fmaxf(boundsMax, bins[chunk].centerMax);
+    }
+    float3 scale;
+    for (int a = 0; a < 3; a++) scale[a] = boundsMin[a] == boundsMax[a] ? 0 : Bins / (boundsMax[a] - boundsMin[a]);
+
+    const auto binSpheres = [&](const int chunk)
+    {
+        SplitBins& chunkBins = bins[chunk];
+        for (int a = 0; a < 3; a++)
+        {
+            for (aabb& bounds : chunkBins.bounds[a]) bounds.Reset();
+            for (int& count : chunkBins.count[a]) count = 0;
+        }
+        const uint first = node.leftFirst + chunk * chunkSize, end = std::min(node.leftFirst + node.count, first + chunkSize);
+        float3 binMin = boundsMin, binScale = scale;
+        for (uint i = first; i < end; i++)
+        {
+            const uint sphere = sphereIndices[i];
+            float3 center = spheres->Center(sphere);
+            const float radius = spheres->radius[sphere];
+            const __m128 boxMin = _mm_setr_ps(center.x - radius, center.y - radius, center.z - radius, 0);
+            const __m128 boxMax = _mm_setr_ps(center.x + radius, center.y + radius, center.z + radius, 0);
+            for (int a = 0; a < 3; a++)
+            {
+                const int bin = std::min(Bins - 1, static_cast<int>((center[a] - binMin[a]) * binScale[a]));
+                chunkBins.count[a][bin]++;
+                chunkBins.bounds[a][bin].Grow(boxMin, boxMax);
+            }
+        }
+    };
+    ForEachChunk(chunkCount, binSpheres);
+    for (int chunk = 1; chunk < chunkCount; chunk++)
+    {
+        for (int a = 0; a < 3; a++) for (int bin = 0; bin < Bins; bin++)
+        {
+            bins[0].count[a][bin] += bins[chunk].count[a][bin];
+            bins[0].bounds[a][bin].Grow(bins[chunk].bounds[a][bin]);
+        }
+    }
+
+    float bestCost = 1e34f;
+    for (int a = 0; a < 3; a++)
+    {
+        if (boundsMin[a] == boundsMax[a]) continue;
+        const aabb* binBounds = bins[0].bounds[a];
+        const int* binCount = bins[0].count[a];
+
+        // sweep from both sides to get the area and count left and right of each plane
+        float leftArea[Bins - 1], rightArea[Bins - 1];
+        int leftCount[Bins - 1], rightCount[Bins - 1];
+        aabb leftBox, rightBox;
+        leftBox.Reset();
+        rightBox.Reset();
+        int leftSum = 0, rightSum = 0;
+        for (int i = 0; i < Bins - 1; i++)
+        {
+            leftSum += binCount[i];
+            leftCount[i] = leftSum;
+            leftBox.Grow(binBounds[i]);
+            leftArea[i] = leftBox.Area();
+            rightSum += binCount[Bins - 1 - i];
+            rightCount[Bins - 2 - i] = rightSum;
+            rightBox.Grow(binBounds[Bins - 1 - i]);
+            rightArea[Bins - 2 - i] = rightBox.Area();
+        }
+
+        const float binWidth = (boundsMax[a] - boundsMin[a]) / Bins;
+        for (int i = 0; i < Bins - 1; i++)
+        {
+            // an empty side has reset bounds, whose area is meaningless
+            if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+            const float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (cost < bestCost)
+            {
+                axis = a;
+                splitPosition = boundsMin[a] + binWidth * static_cast<float>(i + 1);
+                bestCost = cost;
+            }
+        }
+    }
+    return bestCost;
+}
+
+const float* BVHSphere::Centers(const int axis) const
+{
+    return axis == 0 ? spheres->centerX.data() : axis == 1 ? spheres->centerY.data() : spheres->centerZ.data();
+}
+
+float BVHSphere::IntersectAABB(const Ray& ray, const float3& reciprocalDirection, const float3& aabbMin, const float3& aabbMax)
+{
+    // slab test; the entry distance, or NoHit when the box is missed or beyond ray.length
+    const float3 origin = ray.GetOrigin();
+    const float tx1 = (aabbMin.x - origin.x) * reciprocalDirection.x, tx2 = (aabbMax.x - origin.x) * reciprocalDirection.x;
+    float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
+    const float ty1 = (aabbMin.y - origin.y) * reciprocalDirection.y, ty2 = (aabbMax.y - origin.y) * reciprocalDirection.y;
+    tmin = std::max(tmin, std::min(ty1, ty2)), tmax = std::min(tmax, std::max(ty1, ty2));
+    const float tz1 = (aabbMin.z - origin.z) * reciprocalDirection.z, tz2 = (aabbMax.z - origin.z) * reciprocalDirection.z;
+    tmin = std::max(tmin, std::min(tz1, tz2)), tmax = std::min(tmax, std::max(tz1, tz2));
+    if (tmax >= tmin && tmin < ray.length && tmax > 0) return tmin;
+    return NoHit;
+}
+
+bool BVHSphere::FindNearest(Ray& ray, HitInfo& hitInfo) const
+{
+    const uint nearest = FindNearestSphere(ray);
+    if (nearest == ~0u) return false;
+    spheres->FillHitInfo(nearest, ray, hitInfo);
+    return true;
+}
+
+uint BVHSphere::FindNearestSphere(Ray& ray) const
+{
+    if (nodesUsed == 0) return ~0u;
+    if (quantized) return FindNearestQuantized(ray);
+    const float3 reciprocalDirection = ray.GetReciprocalDirection();
+    if (IntersectAABB(ray, reciprocalDirection, nodes[0].aabbMin, nodes[0].aabbMax) == NoHit) return ~0u;
+
+    // visit the nearer child first; every hit shortens the ray, which culls the farther
+    // subtrees and the stacked nodes that now start beyond it
+    struct StackEntry
+    {
+        const BVHSphereNode* node;
+        float distance;
+    };
+    StackEntry stack[MaxStackSize];
+    uint stackPtr = 0;
+    const BVHSphereNode* node = &nodes[0];
+    uint nearest = ~0u;
+    while (true)
+    {
+        if (node->IsLeaf())
+        {
+            for (uint i = node->leftFirst; i < node->leftFirst + node->count; i++)
+            {
+                const float distance = spheres->Intersect(sphereIndices[i], ray, ray.length);
+                if (distance == NoHit) continue;
+                ray.length = distance;
+                nearest = sphereIndices[i];
+            }
+        }
+        else
+        {
+            const BVHSphereNode* child1 = &nodes[node->leftFirst];
+            const BVHSphereNode* child2 = child1 + 1;
+            float distance1 = IntersectAABB(ray, reciprocalDirection, child1->aabbMin, child1->aabbMax);
+            float distance2 = IntersectAABB(ray, reciprocalDirection, child2->aabbMin, child2->aabbMax);
+            if (distance1 > distance2)
+            {
+                std::swap(child1, child2);
+                std::swap(distance1, distance2);
+            }
+            if (distance1 != NoHit)
+            {
+                if (distance2 != NoHit) stack[stackPtr++] = {child2, distance2};
+                node = child1;
+                continue;
+            }
+        }
+
+        node = nullptr;
+        while (stackPtr > 0)
+        {
+            const StackEntry& entry = stack[--stackPtr];
+            if (entry.distance >= ray.length) continue;
+            node = entry.node;
+            break;
+        }
+        if (!node) break;
+    }
+    return nearest;
+}
+
+bool BVHSphere::IsOccluded(const Ray& ray) const
+{
+    if (nodesUsed == 0) return false;
+    if (quantized) return IsOccludedQuantized(ray);
+    const float3 reciprocalDirection = ray.GetReciprocalDirection();
+
+    // children are visited in any order: there is no nearer hit to look for
+    const BVHSphereNode* stack[MaxStackSize];
+    uint stackPtr = 0;
+    stack[stackPtr++] = &nodes[0];
+    while (stackPtr > 0)
+    {
+        const BVHSphereNode* node = stack[--stackPtr];
+        if (IntersectAABB(ray, reciprocalDirection, node->aabbMin, node->aabbMax) == NoHit) continue;
+        if (!node->IsLeaf())
+        {
+            stack[stackPtr++] = &nodes[node->leftFirst];
+            stack[stackPtr++] = &nodes[node->leftFirst + 1];
+            continue;
+        }
+        for (uint i = node->leftFirst; i < node->leftFirst + node->count; i++)
+        {
+            if (spheres->Intersect(sphereIndices[i], ray, ray.length) != NoHit) return true;
+        }
+    }
+    return false;
+}
+
+uint BVHSphere::FindNearestQuantized(Ray& ray) const
+{
+    // the same traversal as FindNearestSphere; the box of the current node was decoded by its
+    // parent and travels along with it, on the stack for the farther child
+    const float3 reciprocalDirection = ray.GetReciprocalDirection();
+    float3 aabbMin = rootMin, aabbMax = rootMax;
+    if (IntersectAABB(ray, reciprocalDirection, aabbMin, aabbMax) == NoHit) return ~0u;
+
+    struct StackEntry
+    {
+        float3 aabbMin, aabbMax;
+        uint node;
+        float distance;
+    };
+    StackEntry stack[MaxStackSize];
+    uint stackPtr = 0;
+    uint nodeIndex = 0;
+    uint nearest = ~0u;
+    while (true)
+    {
+        const BVHSphereQuantizedNode& node = quantizedNodes[nodeIndex];
+        if (node.IsLeaf())
+        {
+            for (uint i = node.range[0]; i < node.range[0] + node.range[1]; i++)
+            {
+                const float distance = spheres->Intersect(sphereIndices[i], ray, ray.length);
+                if (distance == NoHit) continue;
+                ray.length = distance;
+                nearest = sphereIndices[i];
+            }
+        }
+        else
+        {
+            float3 childMin[2], childMax[2];
+            float distance[2];
+            for (int c = 0; c < 2; c++)
+            {
+                childMin[c] = Dequantize(aabbMin, aabbMax, node.childBounds[c]);
+                childMax[c] = Dequantize(aabbMin, aabbMax, node.childBounds[c] + 3);
+                distance[c] = IntersectAABB(ray, reciprocalDirection, childMin[c], childMax[c]);
+            }
+            const int nearer = distance[0] > distance[1] ? 1 : 0, farther = 1 - nearer;
+            if (distance[nearer] != NoHit)
+            {
+                if (distance[farther] != NoHit)
+                {
+                    stack[stackPtr++] = {childMin[farther], childMax[farther], node.leftChild + farther, distance[farther]};
+                }
+                nodeIndex = node.leftChild + nearer;
+                aabbMin = childMin[nearer], aabbMax = childMax[nearer];
+                continue;
+            }
+        }
+
+        bool found = false;
+        while (stackPtr > 0)
+        {
+            const StackEntry& entry = stack[--stackPtr];
+            if (entry.distance >= ray.length) continue;
+            nodeIndex = entry.node;
+            aabbMin = entry.aabbMin, aabbMax = entry.aabbMax;
+            found = true;
+            break;
+        }
+        if (!found) break;
+    }
+    return nearest;
+}
+
+bool BVHSphere::IsOccludedQuantized(const Ray& ray) const
+{
+    const float3 reciprocalDirection = ray.GetReciprocalDirection();
+    if (IntersectAABB(ray, reciprocalDirection, rootMin, rootMax) == NoHit) return false;
+
+    // stacked nodes have been hit already; their boxes are needed to decode their children
+    struct StackEntry
+    {
+        float3 aabbMin, aabbMax;
+        uint node;
+    };
+    StackEntry stack[MaxStackSize];
+    uint stackPtr = 0;
+    stack[stackPtr++] = {rootMin, rootMax, 0};
+    while (stackPtr > 0)
+    {
+        const StackEntry entry = stack[--stackPtr];
+        const BVHSphereQuantizedNode& node = quantizedNodes[entry.node];
+        if (node.IsLeaf())
+        {
+            for (uint i = node.range[0]; i < node.range[0] + node.range[1]; i++)
+            {
+                if (spheres->Intersect(sphereIndices[i], ray, ray.length) != NoHit) return true;
+            }
+            continue;
+        }
+        for (uint c = 0; c < 2; c++)
+        {
+            const float3 childMin = Dequantize(entry.aabbMin, entry.aabbMax, node.childBounds[c]);
+            const float3 childMax = Dequantize(entry.aabbMin, entry.aabbMax, node.childBounds[c] + 3);
+            if (IntersectAABB(ray, reciprocalDirection, childMin, childMax) != NoHit) stack[stackPtr++] = {childMin, childMax, node.leftChild + c};
+        }
+    }
+    return false;
+}
@@ -1,24 +1,113 @@
 ﻿#pragma once
 
-struct BVHSphereNode
+#include <atomic>
+
+// How a sphere BVH is built. Binned SAH gives the fastest traversal. Morton (LBVH) sorts
+// the spheres along a Morton curve and splits at the highest differing code bit: builds
+// several times faster, for sets that are rebuilt every simulation step, at some cost in
+// trace speed. Both finish the subtrees below the top levels on all threads.
+enum class SphereBuild
+{
+    BinnedSAH,
+    Morton
+};
+
+// One node of the flattened sphere BVH, 32 bytes so two siblings share a cache line.
+// Interior nodes have count 0 and their children at leftFirst and leftFirst + 1;
+// leaves hold count spheres starting at leftFirst in the BVH's own sphere order.
+struct ALIGN(32) BVHSphereNode
 {
-    BVHSphereNode* left = nullptr;
-    BVHSphereNode* right = nullptr;
-    Sphere* sphere = nullptr;
+    float3 aabbMin;
+    uint leftFirst = 0;
+    float3 aabbMax;
+    uint count = 0;
+
+    [[nodiscard]] bool IsLeaf() const { return count > 0; }
 };
 
+// The same node in 16 bytes, for sphere sets whose BVH no longer fits in cache. An interior
+// node stores the boxes of both children, each coordinate quantized to 8 bits on a grid over
+// its own box; the box of a node is therefore only known to its parent, and traversal
+// decodes it on the way down. Quantized boxes are rounded outwards, so they are never
+// smaller than the exact ones. A leaf stores its sphere range instead.
+struct ALIGN(16) BVHSphereQuantizedNode
+{
+    static constexpr uint LeafFlag = 1u << 31;
+
+    union
+    {
+        uchar childBounds[2][6]; // interior: min x, y, z and max x, y, z of the left and the right child
+        uint range[2]; // leaf: first sphere and count
+    };
+    uint leftChild = 0; // index of the left child, the right one follows; LeafFlag for leaves
+
+    [[nodiscard]] bool IsLeaf() const { return leftChild == LeafFlag; }
+};
+
+// Bounding volume hierarchy over the scene spheres, built into one preallocated node
+// array. Must be rebuilt when spheres are added or removed; moved or resized spheres
+// only need a Refit, until the tree has degraded too far. Quantize replaces the nodes with
+// 16-byte ones whose boxes traversal decodes on the fly; the float nodes are freed, so a
+// Refit or rebuild of a quantized tree briefly holds both and costs a quantization pass.
 class BVHSphere
 {
 public:
-    BVHSphere(const vector<Sphere*>& spheres);
-    BVHSphereNode* BuildBVH(const vector<Sphere*>& spheres);
-    void SplitSpheres(const vector<Sphere*>& spheres, vector<Sphere*>& left, vector<Sphere*>& right) const;
-    aabb GetAABB(const vector<Sphere*>& spheres) const;
-    
-    bool Traverse(BVHSphereNode* node, Ray& ray, HitInfo& hitInfo) const;
-    bool BeginTraversal(Ray& ray, HitInfo& hitInfo) const;
+    BVHSphere(const SphereSet& spheres, SphereBuild mode = SphereBuild::BinnedSAH);
+    void BuildBVH(const SphereSet& spheres, SphereBuild mode = SphereBuild::BinnedSAH);
+
+    // nearest sphere hit closer than ray.length; on a hit ray.length is its distance
+    bool FindNearest(Ray& ray, HitInfo& hitInfo) const;
+    // the same search without filling a HitInfo: the index of the nearest sphere, or ~0u
+    [[nodiscard]] uint FindNearestSphere(Ray& ray) const;
+    [[nodiscard]] const SphereSet& Spheres() const { return *spheres; }
+    // whether any sphere is hit closer than ray.length: stops at the first one found, so
+    // shadow rays do not pay for the nearest-hit search
+    [[nodiscard]] bool IsOccluded(const Ray& ray) const;
+    [[nodiscard]] uint NodeCount() const { return nodesUsed; }
+    // bytes of the nodes that traversal reads
+    [[nodiscard]] size_t MemoryUsage() const;
+    // bounds of all spheres; false when there are none
+    bool Bounds(float3& aabbMin, float3& aabbMax) const;
+
+    // recomputes all bounds bottom-up for the current sphere positions, in O(n), and
+    // returns the SAH cost of the refitted tree relative to its cost when it was built
+    float Refit();
+    // traverses quantized nodes from now on and frees the float ones; rebuilds and refits
+    // recreate the float nodes while they run and quantize them again
+    void Quantize();
+    [[nodiscard]] bool IsQuantized() const { return quantized; }
+    // SAH cost: expected node visits and sphere tests for a ray that hits the root; for a
+    // quantized tree, that of the exact boxes it was quantized from
+    [[nodiscard]] float SAHCost() const;
 
 private:
-    BVHSphereNode* root = nullptr;
-};
+    friend class BVH4Sphere; // collapses the binary hierarchy into a 4-wide one
+
+    void UpdateNodeBounds(uint nodeIndex);
+    void SortByMortonCode();
+    void Subdivide(uint nodeIndex, uint depth);
+    // splits a node in two, unless it should stay a leaf; nodes below MaxSplitDepth are halved
+    bool Split(uint nodeIndex, uint depth);
+    [[nodiscard]] uint MortonSplit(const BVHSphereNode& node) const;
+    float FindBestSplitPlane(const BVHSphereNode& node, int& axis, float& splitPosition) const;
+    [[nodiscard]] const float* Centers(int axis) const; // the center coordinates along axis
+    void RefitNodes();
+    void UpdateQuantizedNodes();
+    void ReleaseNodes(); // quantizes the float nodes, then frees them
+    void RestoreNodes(); // recreates the float nodes of a quantized tree, without their boxes
+    [[nodiscard]] uint FindNearestQuantized(Ray& ray) const;
+    [[nodiscard]] bool IsOccludedQuantized(const Ray& ray) const;
+    static float IntersectAABB(const Ray& ray, const float3& reciprocalDirection, const float3& aabbMin, const float3& aabbMax);
 
+    vector<BVHSphereNode> nodes;
+    vector<BVHSphereQuantizedNode> quantizedNodes; // the nodes in the same order, when quantized
+    float3 rootMin, rootMax; // when quantized: the exact root box, which no node stores
+    float quantizedCost = 0; // when quantized: SAHCost of the float nodes before they were freed
+    bool quantized = false;
+    const SphereSet* spheres = nullptr;
+    vector<uint> sphereIndices; // reordered so every leaf references a contiguous range
+    std::atomic<uint> nodesUsed{0}; // sibling pairs are taken from nodes by all build threads
+    SphereBuild buildMode = SphereBuild::BinnedSAH;
+    vector<uint> mortonCodes; // during a Morton build: the code of every sphere in sphereIndices
+    float builtCost = 0;
+};
@@ -0,0 +1,436 @@
+﻿#include "precomp.h"
+#include "bvh4.h"
+
+namespace
+{
+    // up to three entries per level. a level opens at least one level of the binary tree,
+    // which is at most 64 deep, and MakeLeaves adds at most 16 levels below a binary leaf
+    constexpr int MaxStackSize = 3 * (64 + 16);
+
+    struct StackEntry
+    {
+        int child;
+        float distance;
+    };
+
+    void SetChildBounds(BVH4SphereNode& node, const int lane, const float3& aabbMin, const float3& aabbMax)
+    {
+        reinterpret_cast<float*>(&node.minX)[lane] = aabbMin.x;
+        reinterpret_cast<float*>(&node.minY)[lane] = aabbMin.y;
+        reinterpret_cast<float*>(&node.minZ)[lane] = aabbMin.z;
+        reinterpret_cast<float*>(&node.maxX)[lane] = aabbMax.x;
+        reinterpret_cast<float*>(&node.maxY)[lane] = aabbMax.y;
+        reinterpret_cast<float*>(&node.maxZ)[lane] = aabbMax.z;
+    }
+
+    // a ray broadcast to all lanes, for the slab test of four child boxes
+    struct SlabRay
+    {
+        explicit SlabRay(const Ray& ray)
+        {
+            const float3 origin = ray.GetOrigin(), reciprocalDirection = ray.GetReciprocalDirection();
+            originX = _mm_set1_ps(origin.x), originY = _mm_set1_ps(origin.y), originZ = _mm_set1_ps(origin.z);
+            reciprocalX = _mm_set1_ps(reciprocalDirection.x), reciprocalY = _mm_set1_ps(reciprocalDirection.y);
+            reciprocalZ = _mm_set1_ps(reciprocalDirection.z);
+        }
+
+        __m128 originX, originY, originZ, reciprocalX, reciprocalY, reciprocalZ;
+    };
+
+    // the children of node whose boxes the ray enters before rayLength, as a lane mask,
+    // and their entry distances
+    int IntersectChildren(const BVH4SphereNode& node, const SlabRay& ray, const float rayLength, __m128& tmin)
+    {
+        const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(node.minX, ray.originX), ray.reciprocalX);
+        const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(node.maxX, ray.originX), ray.reciprocalX);
+        const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(node.minY, ray.originY), ray.reciprocalY);
+        const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(node.maxY, ray.originY), ray.reciprocalY);
+        const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(node.minZ, ray.originZ), ray.reciprocalZ);
+        const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(node.maxZ, ray.originZ), ray.reciprocalZ);
+        tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_max_ps(_mm_min_ps(tz1, tz2), _mm_setzero_ps()));
+        const __m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)),
+                                       _mm_min_ps(_mm_max_ps(tz1, tz2), _mm_set1_ps(rayLength)));
+        return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) & ((1 << node.childCount) - 1);
+    }
+
+    // SphereSet::Intersect on the four spheres of a leaf: a lane mask of the spheres hit in
+    // [EPSILON, ray.length], and the nearest valid root of every lane
+    int IntersectSpheres(const SphereLeaf4& leaf, const Ray& ray, __m128& root)
+    {
+        const float3 origin = ray.GetOrigin(), direction = ray.GetDirection();
+        const __m128 toCenterX = _mm_sub_ps(_mm_set1_ps(origin.x), leaf.centerX);
+        const __m128 toCenterY = _mm_sub_ps(_mm_set1_ps(origin.y), leaf.centerY);
+        const __m128 toCenterZ = _mm_sub_ps(_mm_set1_ps(origin.z), leaf.centerZ);
+        const __m128 a = _mm_set1_ps(sqrLength(direction));
+        const __m128 halfB = _mm_add_ps(_mm_add_ps(_mm_mul_ps(toCenterX, _mm_set1_ps(direction.x)), _mm_mul_ps(toCenterY, _mm_set1_ps(direction.y))),
+                                        _mm_mul_ps(toCenterZ, _mm_set1_ps(direction.z)));
+        const __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(toCenterX, toCenterX), _mm_mul_ps(toCenterY, toCenterY)),
+                                               _mm_mul_ps(toCenterZ, toCenterZ)), leaf.radiusSquared);
+        const __m128 discriminant = _mm_sub_ps(_mm_mul_ps(halfB, halfB), _mm_mul_ps(a, c));
+        const __m128 discriminantSqrt = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+        const __m128 nearRoot = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), halfB), discriminantSqrt), a);
+        const __m128 farRoot = _mm_div_ps(_mm_add_ps(_mm_sub_ps(_mm_setzero_ps(), halfB), discriminantSqrt), a);
+        const __m128 rayMin = _mm_set1_ps(EPSILON), rayMax = _mm_set1_ps(ray.length);
+        const __m128 nearValid = _mm_and_ps(_mm_cmpge_ps(nearRoot, rayMin), _mm_cmple_ps(nearRoot, rayMax));
+        const __m128 farValid = _mm_and_ps(_mm_cmpge_ps(farRoot, rayMin), _mm_cmple_ps(farRoot, rayMax));
+        root = _mm_blendv_ps(farRoot, nearRoot, nearValid);
+        return _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(discriminant, _mm_setzero_ps()), _mm_or_ps(nearValid, farValid)));
+    }
+
+    void InitNode(BVH4SphereNode& node)
+    {
+        node.minX = node.minY = node.minZ = _mm_set1_ps(1e34f);
+        node.maxX = node.maxY = node.maxZ = _mm_set1_ps(-1e34f);
+        node.child[0] = node.child[1] = node.child[2] = node.child[3] = 0;
+        node.childCount = 0;
+    }
+}
+
+BVH4Sphere::BVH4Sphere(const SphereSet& spheres, const SphereBuild mode)
+{
+    BuildBVH(spheres, mode);
+}
+
+void BVH4Sphere::BuildBVH(const SphereSet& sceneSpheres, const SphereBuild mode)
+{
+    spheres = &sceneSpheres;
+    nodes.clear();
+    leaves.clear();
+    if (sceneSpheres.Count() == 0) return;
+
+    // the binary BVH decides the hierarchy; children are allocated after their parent,
+    // so one backwards pass yields the sphere range of every subtree
+    const BVHSphere bvh(sceneSpheres, mode);
+    sphereIndices = bvh.sphereIndices;
+    // about one leaf per binary leaf, and fewer nodes than leaves
+    leaves.reserve((bvh.nodesUsed + 1) / 2);
+    nodes.reserve((bvh.nodesUsed + 1) / 2);
+    subtreeFirst.resize(bvh.nodesUsed);
+    subtreeCount.resize(bvh.nodesUsed);
+    for (int i = static_cast<int>(bvh.nodesUsed) - 1; i >= 0; i--)
+    {
+        const BVHSphereNode& node = bvh.nodes[i];
+        subtreeFirst[i] = node.IsLeaf() ? node.leftFirst : subtreeFirst[node.leftFirst];
+        subtreeCount[i] = node.IsLeaf() ? node.count : subtreeCount[node.leftFirst] + subtreeCount[node.leftFirst + 1];
+    }
+
+    // the root is always a node, so traversal can start with a node test
+    if (subtreeCount[0] <= 4 || bvh.nodes[0].IsLeaf())
+    {
+        const int child = MakeLeaves(0, subtreeCount[0]);
+        if (child < 0)
+        {
+            nodes.emplace_back();
+            InitNode(nodes[0]);
+            SetChildBounds(nodes[0], 0, bvh.nodes[0].aabbMin, bvh.nodes[0].aabbMax);
+            nodes[0].child[0] = child;
+            nodes[0].childCount = 1;
+        }
+    }
+    else Collapse(bvh, 0);
+    sphereIndices.clear();
+    subtreeFirst.clear();
+    subtreeCount.clear();
+    builtCost = SAHCost();
+}
+
+void BVH4Sphere::ChildBounds(const int child, float3& aabbMin, float3& aabbMax) const
+{
+    aabbMin = float3(1e34f), aabbMax = float3(-1e34f);
+    if (child < 0)
+    {
+        for (const uint sphere : leaves[~child].sphere)
+        {
+            if (sphere == ~0u) continue;
+            const float3 center = spheres->Center(sphere);
+            aabbMin = fminf(aabbMin, center - float3(spheres->radius[sphere]));
+            aabbMax = fmaxf(aabbMax, center + float3(spheres->radius[sphere]));
+        }
+        return;
+    }
+    const BVH4SphereNode& node = nodes[child];
+    for (uint lane = 0; lane < node.childCount; lane++)
+    {
+        aabbMin = fminf(aabbMin, float3(reinterpret_cast<const float*>(&node.minX)[lane], reinterpret_cast<const float*>(&node.minY)[lane],
+                                        reinterpret_cast<const float*>(&node.minZ)[lane]));
+        aabbMax = fmaxf(aabbMax, float3(reinterpret_cast<const float*>(&node.maxX)[lane], reinterpret_cast<const float*>(&node.maxY)[lane],
+                                        reinterpret_cast<const float*>(&node.maxZ)[lane]));
+    }
+}
+
+bool BVH4Sphere::Bounds(float3& aabbMin, float3& aabbMax) const
+{
+    if (nodes.empty()) return false;
+    ChildBounds(0, aabbMin, aabbMax);
+    return true;
+}
+
+float BVH4Sphere::Refit()
+{
+    for (SphereLeaf4& leaf : leaves)
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            const uint sphere = leaf.sphere[lane];
+            if (sphere == ~0u) continue;
+            reinterpret_cast<float*>(&leaf.centerX)[lane] = spheres->centerX[sphere];
+            reinterpret_cast<float*>(&leaf.centerY)[lane] = spheres->centerY[sphere];
+            reinterpret_cast<float*>(&leaf.centerZ)[lane] = spheres->centerZ[sphere];
+            reinterpret_cast<float*>(&leaf.radiusSquared)[lane] = spheres->radius[sphere] * spheres->radius[sphere];
+        }
+    }
+    // child nodes are allocated after their parent, so a backwards pass sees them first
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--)
+    {
+        BVH4SphereNode& node = nodes[i];
+        for (uint lane = 0; lane < node.childCount; lane++)
+        {
+            float3 aabbMin, aabbMax;
+            ChildBounds(node.child[lane], aabbMin, aabbMax);
+            SetChildBounds(node, static_cast<int>(lane), aabbMin, aabbMax);
+        }
+    }
+    return builtCost > 0 ? SAHCost() / builtCost : 1;
+}
+
+float BVH4Sphere::SAHCost() const
+{
+    // one node visit per box a ray enters, one sphere test per sphere in a leaf it enters
+    if (nodes.empty()) return 0;
+    const auto halfArea = [](const float3& extent) { return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x; };
+    float3 aabbMin, aabbMax;
+    ChildBounds(0, aabbMin, aabbMax);
+    const float rootArea = halfArea(aabbMax - aabbMin);
+    if (rootArea <= 0) return 0;
+    float cost = rootArea;
+    for (const BVH4SphereNode& node : nodes)
+    {
+        for (uint lane = 0; lane < node.childCount; lane++)
+        {
+            const int child = node.child[lane];
+            ChildBounds(child, aabbMin, aabbMax);
+            float tests = 1;
+            if (child < 0)
+            {
+                tests = 0;
+                for (const uint sphere : leaves[~child].sphere) tests += sphere != ~0u;
+            }
+            cost += tests * halfArea(aabbMax - aabbMin);
+        }
+    }
+    return cost / rootArea;
+}
+
+int BVH4Sphere::Collapse(const BVHSphere& bvh, const uint nodeIndex)
+{
+    const int index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    InitNode(nodes[index]);
+
+    // pull grandchildren up: keep opening the largest child that is too big for a leaf
+    uint children[4] = {bvh.nodes[nodeIndex].leftFirst, bvh.nodes[nodeIndex].leftFirst + 1};
+    uint childCount = 2;
+    while (childCount < 4)
+    {
+        int best = -1;
+        float bestArea = -1;
+        for (uint i = 0; i < childCount; i++)
+        {
+            const BVHSphereNode& child = bvh.nodes[children[i]];
+            if (child.IsLeaf() || subtreeCount[children[i]] <= 4) continue;
+            const float3 extent = child.aabbMax - child.aabbMin;
+            const float area = extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+            if (area > bestArea) best = static_cast<int>(i), bestArea = area;
+        }
+        if (best < 0) break;
+        const uint opened = children[best];
+        children[best] = bvh.nodes[opened].leftFirst;
+        children[childCount++] = bvh.nodes[opened].leftFirst + 1;
+    }
+
+    for (uint i = 0; i < childCount; i++)
+    {
+        const uint c = children[i];
+        const BVHSphereNode& child = bvh.nodes[c];
+        const int code = child.IsLeaf() || subtreeCount[c] <= 4 ? MakeLeaves(subtreeFirst[c], subtreeCount[c]) : Collapse(bvh, c);
+        // nodes may have grown, so index it again
+        SetChildBounds(nodes[index], static_cast<int>(i), child.aabbMin, child.aabbMax);
+        nodes[index].child[i] = code;
+    }
+    nodes[index].childCount = childCount;
+    return index;
+}
+
+int BVH4Sphere::MakeLeaves(const uint first, const uint count)
+{
+    if (count <= 4) return MakeLeaf(first, count);
+
+    // a binary leaf with more than four spheres, when their centers coincide: spread
+    // its range over the lanes of new nodes
+    const int index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    InitNode(nodes[index]);
+    const uint part = (count + 3) / 4;
+    uint lane = 0;
+    for (uint start = first; start < first + count; start += part, lane++)
+    {
+        const uint partCount = std::min(part, first + count - start);
+        float3 aabbMin(1e34f), aabbMax(-1e34f);
+        for (uint i = start; i < start + partCount; i++)
+        {
+            const float3 center = spheres->Center(sphereIndices[i]);
+            const float radius = spheres->radius[sphereIndices[i]];
+            aabbMin = fminf(aabbMin, center - float3(radius));
+            aabbMax = fmaxf(aabbMax, center + float3(radius));
+        }
+        const int code = MakeLeaves(start, partCount);
+        SetChildBounds(nodes[index], static_cast<int>(lane), aabbMin, aabbMax);
+        nodes[index].child[lane] = code;
+    }
+    nodes[index].childCount = lane;
+    return index;
+}
+
+int BVH4Sphere::MakeLeaf(const uint first, const uint count)
+{
+    SphereLeaf4 leaf;
+    auto* centerX = reinterpret_cast<float*>(&leaf.centerX);
+    auto* centerY = reinterpret_cast<float*>(&leaf.centerY);
+    auto* centerZ = reinterpret_cast<float*>(&leaf.centerZ);
+    auto* radiusSquared = reinterpret_cast<float*>(&leaf.radiusSquared);
+    for (uint lane = 0; lane < 4; lane++)
+    {
+        const uint sphere = lane < count ? sphereIndices[first + lane] : ~0u;
+        const bool used = sphere != ~0u;
+        centerX[lane] = used ? spheres->centerX[sphere] : 0;
+        centerY[lane] = used ? spheres->centerY[sphere] : 0;
+        centerZ[lane] = used ? spheres->centerZ[sphere] : 0;
+        radiusSquared[lane] = used ? spheres->radius[sphere] * spheres->radius[sphere] : -1;
+        leaf.sphere[lane] = sphere;
+    }
+    leaves.push_back(leaf);
+    return ~static_cast<int>(leaves.size() - 1);
+}
+
+uint BVH4Sphere::IntersectLeaf(const SphereLeaf4& leaf, Ray& ray) const
+{
+    __m128 root;
+    int mask = IntersectSpheres(leaf, ray, root);
+    if (!mask) return ~0u;
+
+    // the scalar test confirms the nearest lane, and the next lane is tried in the rare
+    // case it rounds the other way
+    const auto* roots = reinterpret_cast<const float*>(&root);
+    while (mask)
+    {
+        int nearest = -1;
+        for (int lane = 0; lane < 4; lane++)
+        {
+            if (mask >> lane & 1 && (nearest < 0 || roots[lane] < roots[nearest])) nearest = lane;
+        }
+        const float distance = spheres->Intersect(leaf.sphere[nearest], ray, ray.length);
+        if (distance < 1e34f)
+        {
+            ray.length = distance;
+            return leaf.sphere[nearest];
+        }
+        mask &= ~(1 << nearest);
+    }
+    return ~0u;
+}
+
+bool BVH4Sphere::FindNearest(Ray& ray, HitInfo& hitInfo) const
+{
+    // the hit is filled in once, for the nearest sphere
+    const uint nearest = FindNearestSphere(ray);
+    if (nearest == ~0u) return false;
+    spheres->FillHitInfo(nearest, ray, hitInfo);
+    return true;
+}
+
+uint BVH4Sphere::FindNearestSphere(Ray& ray) const
+{
+    if (nodes.empty()) return ~0u;
+    const SlabRay slabRay(ray);
+
+    // front to back: the nearest child is visited next, the others are stacked farthest
+    // first; hits shorten the ray, which culls stacked children that start beyond it
+    StackEntry stack[MaxStackSize];
+    uint stackPtr = 0;
+    int current = 0;
+    uint nearest = ~0u;
+    while (true)
+    {
+        if (current < 0)
+        {
+            const uint sphere = IntersectLeaf(leaves[~current], ray);
+            if (sphere != ~0u) nearest = sphere;
+        }
+        else
+        {
+            const BVH4SphereNode& node = nodes[current];
+            __m128 tmin;
+            const int mask = IntersectChildren(node, slabRay, ray.length, tmin);
+
+            // sort the hit children by entry distance
+            const auto* distances = reinterpret_cast<const float*>(&tmin);
+            StackEntry hits[4];
+            uint hitCount = 0;
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if (!(mask >> lane & 1)) continue;
+                StackEntry entry = {node.child[lane], distances[lane]};
+                uint i = hitCount++;
+                for (; i > 0 && hits[i - 1].distance > entry.distance; i--) hits[i] = hits[i - 1];
+                hits[i] = entry;
+            }
+            if (hitCount > 0)
+            {
+                for (uint i = hitCount - 1; i > 0; i--) stack[stackPtr++] = hits[i];
+                current = hits[0].child;
+                continue;
+            }
+        }
+
+        bool found = false;
+        while (stackPtr > 0)
+        {
+            const StackEntry& entry = stack[--stackPtr];
+            if (entry.distance >= ray.length) continue;
+            current = entry.child;
+            found = true;
+            break;
+        }
+        if (!found) break;
+    }
+    return nearest;
+}
+
+bool BVH4Sphere::IsOccluded(const Ray& ray) const
+{
+    if (nodes.empty()) return false;
+    const SlabRay slabRay(ray);
+
+    // any hit ends the walk, so children are stacked unsorted and the vector leaf test
+    // decides on its own: it differs from the scalar test only for grazing rays
+    int stack[MaxStackSize];
+    uint stackPtr = 0;
+    int current = 0;
+    while (true)
+    {
+        if (current < 0)
+        {
+            __m128 root;
+            if (IntersectSpheres(leaves[~current], ray, root)) return true;
+        }
+        else
+        {
+            const BVH4SphereNode& node = nodes[current];
+            __m128 tmin;
+            const int mask = IntersectChildren(node, slabRay, ray.length, tmin);
+            for (int lane = 0; lane < 4; lane++) if (mask >> lane & 1) stack[stackPtr++] = node.child[lane];
+        }
+        if (stackPtr == 0) return false;
+        current = stack[--stackPtr];
+    }
+}
@@ -0,0 +1,63 @@
+﻿#pragma once
+
+#include "bvh.h"
+
+// Node of the 4-wide sphere BVH: the bounds of four children in SoA form, so one SSE
+// slab test covers all of them. A child is a node index, or ~index of a leaf when
+// negative; lanes from childCount up are unused.
+struct ALIGN(64) BVH4SphereNode
+{
+    __m128 minX, minY, minZ, maxX, maxY, maxZ;
+    int child[4];
+    uint childCount;
+};
+
+// Up to four spheres in SoA form, tested with one vectorized ray-sphere test. Unused
+// lanes have a negative squared radius, which can never produce a hit, and sphere ~0u.
+struct ALIGN(64) SphereLeaf4
+{
+    __m128 centerX, centerY, centerZ, radiusSquared;
+    uint sphere[4]; // indices into the SphereSet
+};
+
+// BVH4 (QBVH) over the scene spheres: the binned-SAH binary BVH collapsed so every node
+// has up to four children and every leaf holds up to four spheres. Visits far fewer
+// nodes than BVHSphere and replaces most of its branches with lane masks.
+class BVH4Sphere
+{
+public:
+    BVH4Sphere(const SphereSet& spheres, SphereBuild mode = SphereBuild::BinnedSAH);
+    void BuildBVH(const SphereSet& spheres, SphereBuild mode = SphereBuild::BinnedSAH);
+
+    // nearest sphere hit closer than ray.length; on a hit ray.length is its distance
+    bool FindNearest(Ray& ray, HitInfo& hitInfo) const;
+    // the index of the nearest sphere, or ~0u, without filling a HitInfo
+    [[nodiscard]] uint FindNearestSphere(Ray& ray) const;
+    [[nodiscard]] const SphereSet& Spheres() const { return *spheres; }
+    // whether any sphere is hit closer than ray.length; for shadow rays
+    [[nodiscard]] bool IsOccluded(const Ray& ray) const;
+    [[nodiscard]] uint NodeCount() const { return static_cast<uint>(nodes.size()); }
+    [[nodiscard]] uint LeafCount() const { return static_cast<uint>(leaves.size()); }
+    bool Bounds(float3& aabbMin, float3& aabbMax) const;
+
+    // as BVHSphere: bottom-up bounds update, returns the SAH cost relative to the build
+    float Refit();
+    [[nodiscard]] float SAHCost() const;
+
+private:
+    int Collapse(const BVHSphere& bvh, uint nodeIndex);
+    int MakeLeaves(uint first, uint count);
+    int MakeLeaf(uint first, uint count);
+    // the nearest sphere of the leaf closer than ray.length, or ~0u; shortens the ray
+    uint IntersectLeaf(const SphereLeaf4& leaf, Ray& ray) const;
+    void ChildBounds(int child, float3& aabbMin, float3& aabbMax) const;
+
+    vector<BVH4SphereNode> nodes;
+    vector<SphereLeaf4> leaves;
+    const SphereSet* spheres = nullptr;
+    // during the build: the spheres in the order of the binary BVH, so subtrees are
+    // contiguous, and the sphere range of every binary BVH node
+    vector<uint> sphereIndices;
+    vector<uint> subtreeFirst, subtreeCount;
+    float builtCost = 0;
+};
@@ -0,0 +1,492 @@
+﻿#include "precomp.h"
+#include "mesh.h"
+
+#include <fstream>
+
+namespace
+{
+    constexpr int Bins = 8;
+    constexpr int MaxStackSize = 64;
+    // past this depth nodes are split at the median, which halves them: a subtree of fewer
+    // than 2^32 triangles then adds at most 32 levels, so traversal never outgrows its stack
+    constexpr uint MaxSplitDepth = 32;
+    static_assert(MaxSplitDepth + 32 <= MaxStackSize, "the deepest leaf must fit on the traversal stack");
+    constexpr float NoHit = 1e34f;
+    // cost of a node visit relative to a triangle test, for the SAH
+    constexpr float TraversalCost = 1.0f;
+    constexpr size_t ParseChunkBytes = 1 << 20;
+    // marks a face index that counts back from the vertices seen so far; the low 31 bits
+    // are the signed index relative to the first vertex of its chunk
+    constexpr uint RelativeIndex = 1u << 31;
+
+    float HalfArea(const float3& aabbMin, const float3& aabbMax)
+    {
+        const float3 extent = aabbMax - aabbMin;
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+
+    // what one chunk of an OBJ file contributes
+    struct ParsedChunk
+    {
+        vector<float> positions; // x, y, z per vertex
+        vector<uint> indices; // three per triangle: zero-based, or RelativeIndex | local index
+        bool failed = false;
+    };
+
+    const char* SkipSpaces(const char* p, const char* end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        return p;
+    }
+
+    // strtof without the locale lookup; enough for the plain and exponent notations of OBJ
+    const char* ParseFloat(const char* p, const char* end, float& value)
+    {
+        p = SkipSpaces(p, end);
+        const char* start = p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+        double mantissa = 0;
+        while (p < end && *p >= '0' && *p <= '9') mantissa = mantissa * 10 + (*p++ - '0');
+        if (p < end && *p == '.')
+        {
+            double scale = 0.1;
+            for (p++; p < end && *p >= '0' && *p <= '9'; p++, scale *= 0.1) mantissa += (*p - '0') * scale;
+        }
+        if (p < end && (*p == 'e' || *p == 'E'))
+        {
+            p++;
+            bool negativeExponent = false;
+            if (p < end && (*p == '-' || *p == '+')) negativeExponent = *p++ == '-';
+            int exponent = 0;
+            while (p < end && *p >= '0' && *p <= '9') exponent = exponent * 10 + (*p++ - '0');
+            mantissa *= pow(10.0, negativeExponent ? -exponent : exponent);
+        }
+        value = static_cast<float>(negative ? -mantissa : mantissa);
+        return p == start ? nullptr : p;
+    }
+
+    // one vertex reference of a face ("v", "v/vt", "v//vn" or "v/vt/vn"): the zero-based or
+    // relative position index; false at the end of the line
+    bool ParseFaceIndex(const char*& p, const char* end, const uint localVertexCount, uint& index, bool& valid)
+    {
+        p = SkipSpaces(p, end);
+        if (p >= end || *p == '\r' || *p == '#') return false;
+        bool negative = false;
+        if (*p == '-') negative = true, p++;
+        int value = 0;
+        const char* digits = p;
+        while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++; // texture and normal indices
+        valid = p != digits && value != 0;
+        if (negative) index = RelativeIndex | (static_cast<uint>(static_cast<int>(localVertexCount) - value) & ~RelativeIndex);
+        else index = static_cast<uint>(value - 1);
+        return true;
+    }
+
+    void ParseLines(const char* p, const char* end, ParsedChunk& chunk)
+    {
+        uint face[3];
+        while (p < end)
+        {
+            const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (!lineEnd) lineEnd = end;
+            p = SkipSpaces(p, lineEnd);
+            if (lineEnd - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+            {
+                float x, y, z;
+                const char* q = ParseFloat(p + 2, lineEnd, x);
+                if (q) q = ParseFloat(q, lineEnd, y);
+                if (q) q = ParseFloat(q, lineEnd, z);
+                if (!q) chunk.failed = true;
+                chunk.positions.insert(chunk.positions.end(), {x, y, z});
+            }
+            else if (lineEnd - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+            {
+                // fan the polygon into triangles around its first vertex
+                const char* q = p + 2;
+                const uint localVertexCount = static_cast<uint>(chunk.positions.size() / 3);
+                uint index, corners = 0;
+                bool valid = true;
+                while (ParseFaceIndex(q, lineEnd, localVertexCount, index, valid))
+                {
+                    if (!valid) chunk.failed = true;
+                    if (corners < 2) face[corners] = index;
+                    else
+                    {
+                        face[2] = index;
+                        chunk.indices.insert(chunk.indices.end(), {face[0], face[1], face[2]});
+                        face[1] = index;
+                    }
+                    corners++;
+                }
+                if (corners < 3) chunk.failed = true;
+            }
+            p = lineEnd + 1;
+        }
+    }
+}
+
+Mesh* Mesh::LoadOBJ(const char* path, const float3& position, const float scale, const Material& material, const uint color)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return nullptr;
+    vector<char> text(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(text.data(), text.size());
+    if (!file) return nullptr;
+
+    // chunks end after a newline, so no line is split between two of them
+    vector<size_t> chunkStart = {0};
+    while (chunkStart.back() + ParseChunkBytes < text.size())
+    {
+        const char* newline = static_cast<const char*>(memchr(text.data() + chunkStart.back() + ParseChunkBytes, '\n',
+                                                              text.size() - chunkStart.back() - ParseChunkBytes));
+        if (!newline) break;
+        chunkStart.push_back(newline - text.data() + 1);
+    }
+    chunkStart.push_back(text.size());
+    const int chunkCount = static_cast<int>(chunkStart.size() - 1);
+    vector<ParsedChunk> chunks(chunkCount);
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < chunkCount; i++) ParseLines(text.data() + chunkStart[i], text.data() + chunkStart[i + 1], chunks[i]);
+
+    // place the vertices of every chunk after those of the chunks before it
+    vector<size_t> vertexOffset(chunkCount + 1, 0), indexOffset(chunkCount + 1, 0);
+    for (int i = 0; i < chunkCount; i++)
+    {
+        if (chunks[i].failed) return nullptr;
+        vertexOffset[i + 1] = vertexOffset[i] + chunks[i].positions.size() / 3;
+        indexOffset[i + 1] = indexOffset[i] + chunks[i].indices.size();
+    }
+    const size_t vertexCount = vertexOffset[chunkCount];
+    if (vertexCount >= RelativeIndex) return nullptr;
+    vector<float> vertexX(vertexCount), vertexY(vertexCount), vertexZ(vertexCount);
+    vector<uint> indices(indexOffset[chunkCount]);
+    bool outOfRange = false;
+#pragma omp parallel for schedule(dynamic) reduction(|| : outOfRange)
+    for (int i = 0; i < chunkCount; i++)
+    {
+        const ParsedChunk& chunk = chunks[i];
+        for (size_t v = 0; v < chunk.positions.size() / 3; v++)
+        {
+            vertexX[vertexOffset[i] + v] = chunk.positions[v * 3] * scale + position.x;
+            vertexY[vertexOffset[i] + v] = chunk.positions[v * 3 + 1] * scale + position.y;
+            vertexZ[vertexOffset[i] + v] = chunk.positions[v * 3 + 2] * scale + position.z;
+        }
+        for (size_t j = 0; j < chunk.indices.size(); j++)
+        {
+            int64_t index = chunk.indices[j];
+            if (index & RelativeIndex) index = static_cast<int64_t>(vertexOffset[i]) + (static_cast<int>(chunk.indices[j] << 1) >> 1);
+            outOfRange = outOfRange || index < 0 || index >= static_cast<int64_t>(vertexCount);
+            indices[indexOffset[i] + j] = static_cast<uint>(index);
+        }
+    }
+    if (outOfRange || indices.empty()) return nullptr;
+    return new Mesh(std::move(vertexX), std::move(vertexY), std::move(vertexZ), std::move(indices), material, color);
+}
+
+Mesh::Mesh(vector<float> vertexX, vector<float> vertexY, vector<float> vertexZ, vector<uint> indices, const Material& material,
+           const uint color): material(material), color(color), vertexX(std::move(vertexX)), vertexY(std::move(vertexY)),
+                              vertexZ(std::move(vertexZ)), indices(std::move(indices))
+{
+    BuildBVH();
+}
+
+void Mesh::BuildBVH()
+{
+    const uint triangleCount = TriangleCount();
+    nodesUsed = 0;
+    if (triangleCount == 0) return;
+    centroids.resize(triangleCount);
+    for (uint i = 0; i < triangleCount; i++)
+    {
+        centroids[i] = (Vertex(indices[i * 3]) + Vertex(indices[i * 3 + 1]) + Vertex(indices[i * 3 + 2])) * (1.0f / 3);
+    }
+
+    nodes.assign(triangleCount * 2 - 1, MeshNode());
+    MeshNode& root = nodes[nodesUsed++];
+    root.leftFirst = 0;
+    root.count = triangleCount;
+    UpdateNodeBounds(0);
+    Subdivide();
+    nodes.resize(nodesUsed);
+    nodes.shrink_to_fit();
+    centroids.clear();
+    centroids.shrink_to_fit();
+}
+
+void Mesh::UpdateNodeBounds(const uint nodeIndex)
+{
+    MeshNode& node = nodes[nodeIndex];
+    node.aabbMin = float3(1e34f);
+    node.aabbMax = float3(-1e34f);
+    for (uint i = node.leftFirst * 3; i < (node.leftFirst + node.count) * 3; i++)
+    {
+        const float3 vertex = Vertex(indices[i]);
+        node.aabbMin = fminf(node.aabbMin, vertex);
+        node.aabbMax = fmaxf(node.aabbMax, vertex);
+    }
+}
+
+void Mesh::Subdivide()
+{
+    // depth first with an explicit stack, so degenerate input cannot exhaust the call stack;
+    // the left child is taken first, which allocates nodes in the order of a recursive build
+    struct Pending
+    {
+        uint node, depth;
+    };
+    vector<Pending> pending = {{0, 0}};
+    while (!pending.empty())
+    {
+        const Pending next = pending.back();
+        pending.pop_back();
+        if (!Split(next.node, next.depth)) continue;
+        const uint leftChild = nodes[next.node].leftFirst;
+        pending.push_back({leftChild + 1, next.depth + 1});
+        pending.push_back({leftChild, next.depth + 1});
+    }
+}
+
+bool Mesh::Split(const uint nodeIndex, const uint depth)
+{
+    MeshNode& node = nodes[nodeIndex];
+    if (node.count <= 1) return false;
+
+    int axis;
+    float splitPosition;
+    const float splitCost = FindBestSplitPlane(node, axis, splitPosition) + TraversalCost * HalfArea(node.aabbMin, node.aabbMax);
+    if (splitCost >= node.count * HalfArea(node.aabbMin, node.aabbMax)) return false;
+
+    uint leftCount;
+    if (depth >= MaxSplitDepth)
+    {
+        // too deep for more uneven splits: halve the node along the widest axis of its bounds,
+        // ordering the triangles by centroid first and moving them in one pass
+        const float3 extent = node.aabbMax - node.aabbMin;
+        const int widest = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        vector<uint> order(node.count);
+        for (uint i = 0; i < node.count; i++) order[i] = node.leftFirst + i;
+        leftCount = node.count / 2;
+        std::nth_element(order.begin(), order.begin() + leftCount, order.end(),
+                         [this, widest](const uint a, const uint b) { return centroids[a].cell[widest] < centroids[b].cell[widest]; });
+        vector<float3> movedCentroids(node.count);
+        vector<uint> movedIndices(node.count * 3);
+        for (uint i = 0; i < node.count; i++)
+        {
+            movedCentroids[i] = centroids[order[i]];
+            for (uint k = 0; k < 3; k++) movedIndices[i * 3 + k] = indices[order[i] * 3 + k];
+        }
+        std::copy(movedCentroids.begin(), movedCentroids.end(), centroids.begin() + node.leftFirst);
+        std::copy(movedIndices.begin(), movedIndices.end(), indices.begin() + node.leftFirst * 3);
+    }
+    else
+    {
+        // partition the triangles in place; their indices and centroids move together
+        int i = static_cast<int>(node.leftFirst);
+        int j = i + static_cast<int>(node.count) - 1;
+        while (i <= j)
+        {
+            if (centroids[i][axis] < splitPosition) i++;
+            else
+            {
+                std::swap(centroids[i], centroids[j]);
+                for (int k = 0; k < 3; k++) std::swap(indices[i * 3 + k], indices[j * 3 + k]);
+                j--;
+            }
+        }
+        leftCount = i - node.leftFirst;
+        if (leftCount == 0 || leftCount == node.count) return false;
+    }
+
+    const uint leftChild = nodesUsed++;
+    const uint rightChild = nodesUsed++;
+    nodes[leftChild].leftFirst = node.leftFirst;
+    nodes[leftChild].count = leftCount;
+    nodes[rightChild].leftFirst = node.leftFirst + leftCount;
+    nodes[rightChild].count = node.count - leftCount;
+    node.leftFirst = leftChild;
+    node.count = 0;
+    UpdateNodeBounds(leftChild);
+    UpdateNodeBounds(rightChild);
+    return true;
+}
+
+float Mesh::FindBestSplitPlane(const MeshNode& node, int& axis, float& splitPosition) const
+{
+    float bestCost = 1e34f;
+    for (int a = 0; a < 3; a++)
+    {
+        float boundsMin = 1e34f, boundsMax = -1e34f;
+        for (uint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        {
+            const float c = centroids[i].cell[a];
+            boundsMin = std::min(boundsMin, c);
+            boundsMax = std::max(boundsMax, c);
+        }
+        if (boundsMin == boundsMax) continue;
+
+        aabb binBounds[Bins];
+        int binCount[Bins] = {};
+        for (aabb& bounds : binBounds) bounds.Reset();
+        float scale = Bins / (boundsMax - boundsMin);
+        for (uint i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        {
+            const int bin = std::min(Bins - 1, static_cast<int>((centroids[i].cell[a] - boundsMin) * scale));
+            binCount[bin]++;
+            for (uint k = 0; k < 3; k++) binBounds[bin].Grow(Vertex(indices[i * 3 + k]));
+        }
+
+        float leftArea[Bins - 1], rightArea[Bins - 1];
+        int leftCount[Bins - 1], rightCount[Bins - 1];
+        aabb leftBox, rightBox;
+        leftBox.Reset();
+        rightBox.Reset();
+        int leftSum = 0, rightSum = 0;
+        for (int i = 0; i < Bins - 1; i++)
+        {
+            leftSum += binCount[i];
+            leftCount[i] = leftSum;
+            leftBox.Grow(binBounds[i]);
+            leftArea[i] = leftBox.Area();
+            rightSum += binCount[Bins - 1 - i];
+            rightCount[Bins - 2 - i] = rightSum;
+            rightBox.Grow(binBounds[Bins - 1 - i]);
+            rightArea[Bins - 2 - i] = rightBox.Area();
+        }
+
+        scale = (boundsMax - boundsMin) / Bins;
+        for (int i = 0; i < Bins - 1; i++)
+        {
+            if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+            const float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+            if (cost < bestCost)
+            {
+                axis = a;
+                splitPosition = boundsMin + scale * static_cast<float>(i + 1);
+                bestCost = cost;
+            }
+        }
+    }
+    return bestCost;
+}
+
+bool Mesh::Bounds(float3& aabbMin, float3& aabbMax) const
+{
+    if (nodesUsed == 0) return false;
+    aabbMin = nodes[0].aabbMin, aabbMax = nodes[0].aabbMax;
+    return true;
+}
+
+bool Mesh::FindNearest(Ray& ray, HitInfo& hitInfo) const
+{
+    const uint nearest = FindNearestTriangle(ray);
+    if (nearest == ~0u) return false;
+    FillHitInfo(nearest, ray, hitInfo);
+    return true;
+}
+
+uint Mesh::FindNearestTriangle(Ray& ray) const
+{
+    if (nodesUsed == 0) return ~0u;
+    const float3 origin = ray.GetOrigin(), direction = ray.GetDirection(), reciprocalDirection = ray.GetReciprocalDirection();
+
+    // watertight test setup: kz is the dominant axis of the direction, and vertices are
+    // sheared so the ray runs along +z; swapping kx and ky keeps the winding
+    const float o[3] = {origin.x, origin.y, origin.z}, d[3] = {direction.x, direction.y, direction.z};
+    int kz = fabsf(d[0]) > fabsf(d[1]) ? (fabsf(d[0]) > fabsf(d[2]) ? 0 : 2) : (fabsf(d[1]) > fabsf(d[2]) ? 1 : 2);
+    int kx = kz == 2 ? 0 : kz + 1, ky = kx == 2 ? 0 : kx + 1;
+    if (d[kz] < 0) std::swap(kx, ky);
+    const float shearX = d[kx] / d[kz], shearY = d[ky] / d[kz], shearZ = 1.0f / d[kz];
+    const float* vertices[3] = {vertexX.data(), vertexY.data(), vertexZ.data()};
+
+    uint nearest = ~0u;
+    const auto intersectAABB = [&](const MeshNode& node)
+    {
+        const float3 t1 = (node.aabbMin - origin) * reciprocalDirection, t2 = (node.aabbMax - origin) * reciprocalDirection;
+        const float tmin = std::max(std::max(std::min(t1.x, t2.x), std::min(t1.y, t2.y)), std::min(t1.z, t2.z));
+        const float tmax = std::min(std::min(std::max(t1.x, t2.x), std::max(t1.y, t2.y)), std::max(t1.z, t2.z));
+        return tmax >= tmin && tmin < ray.length && tmax > 0 ? tmin : NoHit;
+    };
+    const auto intersectTriangle = [&](const uint triangle)
+    {
+        const uint i0 = indices[triangle * 3], i1 = indices[triangle * 3 + 1], i2 = indices[triangle * 3 + 2];
+        const float az = vertices[kz][i0] - o[kz], bz = vertices[kz][i1] - o[kz], cz = vertices[kz][i2] - o[kz];
+        const float ax = vertices[kx][i0] - o[kx] - shearX * az, ay = vertices[ky][i0] - o[ky] - shearY * az;
+        const float bx = vertices[kx][i1] - o[kx] - shearX * bz, by = vertices[ky][i1] - o[ky] - shearY * bz;
+        const float cx = vertices[kx][i2] - o[kx] - shearX * cz, cy = vertices[ky][i2] - o[ky] - shearY * cz;
+        // scaled barycentrics; an exact zero is recomputed in double, so an edge shared by
+        // two triangles always belongs to one of them
+        float u = cx * by - cy * bx, v = ax * cy - ay * cx, w = bx * ay - by * ax;
+        if (u == 0 || v == 0 || w == 0)
+        {
+            u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+            v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+            w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+        }
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return;
+        const float determinant = u + v + w;
+        if (determinant == 0) return;
+        const float t = (u * shearZ * az + v * shearZ * bz + w * shearZ * cz) / determinant;
+        if (t < EPSILON || t > ray.length) return;
+        ray.length = t;
+        nearest = triangle;
+    };
+
+    struct StackEntry
+    {
+        const MeshNode* node;
+        float distance;
+    };
+    StackEntry stack[MaxStackSize];
+    uint stackPtr = 0;
+    const MeshNode* node = &nodes[0];
+    if (intersectAABB(*node) == NoHit) return ~0u;
+    while (true)
+    {
+        if (node->IsLeaf())
+        {
+            for (uint i = node->leftFirst; i < node->leftFirst + node->count; i++) intersectTriangle(i);
+        }
+        else
+        {
+            const MeshNode* child1 = &nodes[node->leftFirst];
+            const MeshNode* child2 = child1 + 1;
+            float distance1 = intersectAABB(*child1);
+            float distance2 = intersectAABB(*child2);
+            if (distance1 > distance2)
+            {
+                std::swap(child1, child2);
+                std::swap(distance1, distance2);
+            }
+            if (distance1 != NoHit)
+            {
+                if (distance2 != NoHit) stack[stackPtr++] = {child2, distance2};
+                node = child1;
+                continue;
+            }
+        }
+
+        node = nullptr;
+        while (stackPtr > 0)
+        {
+            const StackEntry& entry = stack[--stackPtr];
+            if (entry.distance >= ray.length) continue;
+            node = entry.node;
+            break;
+        }
+        if (!node) break;
+    }
+    return nearest;
+}
+
+void Mesh::FillHitInfo(const uint triangle, const Ray& ray, HitInfo& hitInfo) const
+{
+    const float3 v0 = Vertex(indices[triangle * 3]), v1 = Vertex(indices[triangle * 3 + 1]), v2 = Vertex(indices[triangle * 3 + 2]);
+    hitInfo.direction = ray.GetDirection();
+    hitInfo.point = ray.GetIntersection();
+    hitInfo.SetFaceNormal(normalize(cross(v1 - v0, v2 - v0)));
+    hitInfo.material = material;
+    hitInfo.color = color;
+}
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+// One node of a mesh BVH, in the same 32-byte layout as BVHSphereNode: interior nodes have
+// count 0 and their children at leftFirst and leftFirst + 1, leaves hold count triangles
+// starting at triangle leftFirst.
+struct ALIGN(32) MeshNode
+{
+    float3 aabbMin;
+    uint leftFirst = 0;
+    float3 aabbMax;
+    uint count = 0;
+
+    [[nodiscard]] bool IsLeaf() const { return count > 0; }
+};
+
+// Triangle mesh with one material, in world space. Vertex positions are stored as three
+// arrays (SoA) and triangles as three vertex indices each, in BVH leaf order, so a leaf
+// is a contiguous range of triangles. The BVH is built with binned SAH, and rays are
+// intersected with the watertight test of Woop, Benthin and Wald (2013), so rays never
+// slip through the shared edges and vertices of neighbouring triangles.
+class Mesh
+{
+public:
+    // loads a Wavefront OBJ file: vertex positions and faces, with polygons fanned into
+    // triangles; other statements are ignored. the file is parsed in chunks on all cores.
+    // the model is scaled, then moved to position. returns nullptr when it cannot be read.
+    static Mesh* LoadOBJ(const char* path, const float3& position, float scale, const Material& material, uint color);
+    Mesh(vector<float> vertexX, vector<float> vertexY, vector<float> vertexZ, vector<uint> indices, const Material& material, uint color);
+
+    // nearest triangle hit in [EPSILON, ray.length]; on a hit ray.length is its distance
+    bool FindNearest(Ray& ray, HitInfo& hitInfo) const;
+    // the same search without filling a HitInfo: the index of the nearest triangle, or ~0u
+    [[nodiscard]] uint FindNearestTriangle(Ray& ray) const;
+    // the hit on a triangle that FindNearestTriangle returned for this ray
+    void FillHitInfo(uint triangle, const Ray& ray, HitInfo& hitInfo) const;
+    // bounds of all triangles; false when there are none
+    bool Bounds(float3& aabbMin, float3& aabbMax) const;
+    [[nodiscard]] uint TriangleCount() const { return static_cast<uint>(indices.size() / 3); }
+    [[nodiscard]] uint VertexCount() const { return static_cast<uint>(vertexX.size()); }
+
+    Material material;
+    uint color = 0xffffff;
+
+private:
+    void BuildBVH();
+    void UpdateNodeBounds(uint nodeIndex);
+    void Subdivide();
+    // splits a node in two, unless it should stay a leaf; nodes below MaxSplitDepth are halved
+    bool Split(uint nodeIndex, uint depth);
+    float FindBestSplitPlane(const MeshNode& node, int& axis, float& splitPosition) const;
+    [[nodiscard]] float3 Vertex(uint index) const { return float3(vertexX[index], vertexY[index], vertexZ[index]); }
+
+    vector<float> vertexX, vertexY, vertexZ;
+    vector<uint> indices;
+    vector<float3> centroids; // per triangle, kept in the same order as indices
+    vector<MeshNode> nodes;
+    uint nodesUsed = 0;
+};
@@ -1,37 +1,103 @@
 ﻿#include "precomp.h"
 #include "sphere.h"
 
-Sphere::Sphere(const float3& center, const float radius, const Material& material, const uint color): center(center), radius(radius), material(material), color(color)
+SphereHandle SphereSet::Add(const float3& center, const float radius, const Material& material, const uint color)
 {
+    const uint index = Count();
+    centerX.push_back(center.x);
+    centerY.push_back(center.y);
+    centerZ.push_back(center.z);
+    this->radius.push_back(radius);
+    materialId.push_back(GetMaterialId(material));
+    this->color.push_back(color);
 
+    uint slot;
+    if (freeSlots.empty())
+    {
+        slot = static_cast<uint>(slotIndex.size());
+        slotIndex.push_back(index);
+        slotGeneration.push_back(0);
+    }
+    else
+    {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+        slotIndex[slot] = index;
+    }
+    indexSlot.push_back(slot);
+    return {slot, slotGeneration[slot]};
 }
 
-bool Sphere::HitSphere(Ray& ray, HitInfo& hitInfo, float rayMax) const
+void SphereSet::Remove(const SphereHandle handle)
 {
-    const auto originToCenter = ray.GetOrigin() - center;
+    if (!Contains(handle)) return;
+    // move the last sphere into the gap, so the arrays stay dense
+    const uint index = slotIndex[handle.slot], last = Count() - 1;
+    centerX[index] = centerX[last], centerY[index] = centerY[last], centerZ[index] = centerZ[last];
+    radius[index] = radius[last];
+    materialId[index] = materialId[last];
+    color[index] = color[last];
+    indexSlot[index] = indexSlot[last];
+    slotIndex[indexSlot[index]] = index;
+    centerX.pop_back(), centerY.pop_back(), centerZ.pop_back();
+    radius.pop_back();
+    materialId.pop_back();
+    color.pop_back();
+    indexSlot.pop_back();
+
+    slotGeneration[handle.slot]++;
+    freeSlots.push_back(handle.slot);
+}
+
+bool SphereSet::Contains(const SphereHandle handle) const
+{
+    // removal bumps the generation, so only live spheres match
+    return handle.slot < slotGeneration.size() && slotGeneration[handle.slot] == handle.generation;
+}
+
+void SphereSet::SetCenter(const uint index, const float3& center)
+{
+    centerX[index] = center.x;
+    centerY[index] = center.y;
+    centerZ[index] = center.z;
+}
+
+float SphereSet::Intersect(const uint index, const Ray& ray, const float rayMax) const
+{
+    const auto originToCenter = ray.GetOrigin() - Center(index);
     const auto a = sqrLength(ray.GetDirection());
     const auto halfB = dot(originToCenter, ray.GetDirection());
-    const auto c = sqrLength(originToCenter) - radius * radius;
+    const auto c = sqrLength(originToCenter) - radius[index] * radius[index];
     const auto discriminant = halfB * halfB - a * c;
 
-    hitInfo.direction = ray.GetDirection();
-    
     // If the discriminant is negative, there is no intersection
-    if (discriminant < 0) return false;
+    if (discriminant < 0) return 1e34f;
 
     const auto discriminantSqrt = sqrt(discriminant);
 
     auto root = (-halfB - discriminantSqrt) / a;
-    if (!Math::InRange(EPSILON, rayMax, root))
-    {
-        root = (-halfB + discriminantSqrt) / a;
-        if (!Math::InRange(EPSILON, rayMax, root)) return false;
-    }
+    if (Math::InRange(EPSILON, rayMax, root)) return root;
+    root = (-halfB + discriminantSqrt) / a;
+    return Math::InRange(EPSILON, rayMax, root) ? root : 1e34f;
+}
 
-    ray.length = root;
+void SphereSet::FillHitInfo(const uint index, const Ray& ray, HitInfo& hitInfo) const
+{
+    hitInfo.direction = ray.GetDirection();
     hitInfo.point = ray.GetIntersection();
-    hitInfo.SetFaceNormal((hitInfo.point - center) / radius);
-    hitInfo.material = material;
-    hitInfo.color = color;
-    return true;
+    hitInfo.SetFaceNormal((hitInfo.point - Center(index)) / radius[index]);
+    hitInfo.material = GetMaterial(index);
+    hitInfo.color = color[index];
+}
+
+ushort SphereSet::GetMaterialId(const Material& material)
+{
+    // the parameter is compared as the float of the union, as the world file stores it
+    for (size_t i = 0; i < materials.size(); i++)
+    {
+        const Material& other = materials[i];
+        if (other.type == material.type && other.glossy.fuzz == material.glossy.fuzz && other.pixels == material.pixels) return static_cast<ushort>(i);
+    }
+    materials.push_back(material);
+    return static_cast<ushort>(materials.size() - 1);
 }
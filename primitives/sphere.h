@@ -1,14 +1,48 @@
 ﻿#pragma once
 
-class Sphere
+// Stable reference to a sphere of a SphereSet. The slot is reused after a removal, with
+// a new generation, so a handle to a removed sphere never finds its successor.
+struct SphereHandle
+{
+    uint slot = ~0u;
+    uint generation = 0;
+};
+
+// The scene spheres in structure-of-arrays form: one array per attribute, indexed by a
+// dense sphere index, so BVH builds and leaf tests stream centers and radii without
+// chasing pointers. Materials are shared through a small palette; a sphere only
+// stores its index. Removal moves the last sphere into the gap: dense indices change
+// (and BVHs over the set must be rebuilt), handles do not.
+class SphereSet
 {
 public:
-    Sphere() = default;
-    Sphere(const float3& center, float radius, const Material& material, uint color);
-    [[nodiscard]] bool HitSphere(Ray& ray, HitInfo& hitInfo, float rayMax = 1e34f) const;
-    
-    float3 center;
-    float radius;
-    Material material;
-    uint color = 0xffffff;
+    SphereHandle Add(const float3& center, float radius, const Material& material, uint color);
+    void Remove(SphereHandle handle);
+    [[nodiscard]] bool Contains(SphereHandle handle) const;
+    // dense index of a sphere in the set, valid until the next Remove
+    [[nodiscard]] uint IndexOf(SphereHandle handle) const { return slotIndex[handle.slot]; }
+    [[nodiscard]] SphereHandle HandleAt(const uint index) const { return {indexSlot[index], slotGeneration[indexSlot[index]]}; }
+    [[nodiscard]] uint Count() const { return static_cast<uint>(radius.size()); }
+
+    [[nodiscard]] float3 Center(const uint index) const { return float3(centerX[index], centerY[index], centerZ[index]); }
+    void SetCenter(uint index, const float3& center);
+    [[nodiscard]] const Material& GetMaterial(const uint index) const { return materials[materialId[index]]; }
+
+    // distance to the nearest intersection in [EPSILON, rayMax], or 1e34f
+    [[nodiscard]] float Intersect(uint index, const Ray& ray, float rayMax) const;
+    // fills in the hit with sphere index at distance ray.length; called once per ray, for
+    // the nearest sphere, so the material is not copied for the hits it replaces
+    void FillHitInfo(uint index, const Ray& ray, HitInfo& hitInfo) const;
+
+    vector<float> centerX, centerY, centerZ, radius;
+    vector<ushort> materialId; // into materials
+    vector<uint> color;
+    vector<Material> materials; // distinct sphere materials
+
+private:
+    ushort GetMaterialId(const Material& material);
+
+    vector<uint> indexSlot; // handle slot of every dense index
+    vector<uint> slotIndex, slotGeneration; // per slot: dense index and current generation
+    vector<uint> freeSlots;
 };
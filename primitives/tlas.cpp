@@ -0,0 +1,153 @@
+﻿#include "precomp.h"
+#include "tlas.h"
+
+#include "bvh.h"
+#include "bvh4.h"
+#include "mesh.h"
+
+#include <atomic>
+
+namespace
+{
+    constexpr uint MaxEntries = 16; // instances sorted per ray
+    std::atomic<uint> replacedHits{0}; // flushed by all threads
+    thread_local uint threadReplacedHits = 0; // counted on this thread since its last flush
+    // entry distance of a ray into a box, or 1e34f when it misses or starts beyond ray.length
+    float EntryDistance(const Ray& ray, const float3& reciprocalDirection, const float3& aabbMin, const float3& aabbMax)
+    {
+        const float3 origin = ray.GetOrigin();
+        const float3 t1 = (aabbMin - origin) * reciprocalDirection, t2 = (aabbMax - origin) * reciprocalDirection;
+        const float tmin = std::max(std::max(std::min(t1.x, t2.x), std::min(t1.y, t2.y)), std::max(std::min(t1.z, t2.z), 0.0f));
+        const float tmax = std::min(std::min(std::max(t1.x, t2.x), std::max(t1.y, t2.y)), std::min(std::max(t1.z, t2.z), ray.length));
+        return tmin <= tmax ? tmin : 1e34f;
+    }
+}
+
+bool TLAS::Build(const Tmpl8::Scene& newScene)
+{
+    const vector<Instance> previous = std::move(instances);
+    scene = &newScene;
+    instances.clear();
+    instances.push_back({scene->cube.b[0], scene->cube.b[1], HitType::Voxel, 0});
+    float3 aabbMin, aabbMax;
+    if (scene->bvhSpheres && scene->bvhSpheres->Bounds(aabbMin, aabbMax)) instances.push_back({aabbMin, aabbMax, HitType::Sphere, 0});
+    for (uint i = 0; i < scene->meshes.size(); i++)
+    {
+        if (scene->meshes[i]->Bounds(aabbMin, aabbMax)) instances.push_back({aabbMin, aabbMax, HitType::Mesh, i});
+    }
+    const auto same = [](const Instance& a, const Instance& b)
+    {
+        return a.type == b.type && a.index == b.index && a.aabbMin.x == b.aabbMin.x && a.aabbMin.y == b.aabbMin.y &&
+            a.aabbMin.z == b.aabbMin.z && a.aabbMax.x == b.aabbMax.x && a.aabbMax.y == b.aabbMax.y && a.aabbMax.z == b.aabbMax.z;
+    };
+    return !std::equal(instances.begin(), instances.end(), previous.begin(), previous.end(), same);
+}
+
+HitType TLAS::FindNearest(Ray& ray, HitInfo& info) const
+{
+    HitRecord hit;
+    FindNearest(ray, hit);
+    return FillHitInfo(ray, hit, info);
+}
+
+void TLAS::FindNearest(Ray& ray, HitRecord& hit) const
+{
+    hit = HitRecord();
+    Traverse(ray, hit, false);
+}
+
+void TLAS::CompleteNearest(Ray& ray, HitRecord& hit) const
+{
+    Traverse(ray, hit, true);
+}
+
+HitType TLAS::FillHitInfo(Ray& ray, const HitRecord& hit, HitInfo& info) const
+{
+    info.direction = ray.GetDirection();
+    switch (hit.type)
+    {
+    case HitType::Voxel:
+        scene->FillHitInfo(ray, static_cast<ushort>(hit.primitive), ray.length, info);
+        break;
+    case HitType::Sphere:
+        scene->bvhSpheres->Spheres().FillHitInfo(hit.primitive, ray, info);
+        break;
+    case HitType::Mesh:
+        scene->meshes[hit.mesh]->FillHitInfo(hit.primitive, ray, info);
+        break;
+    default:
+        break;
+    }
+    return hit.type;
+}
+
+void TLAS::FlushReplacedHits()
+{
+    if (threadReplacedHits == 0) return;
+    replacedHits.fetch_add(threadReplacedHits, std::memory_order_relaxed);
+    threadReplacedHits = 0;
+}
+
+uint TLAS::TakeReplacedHits()
+{
+    return replacedHits.exchange(0, std::memory_order_relaxed);
+}
+
+void TLAS::Traverse(Ray& ray, HitRecord& hit, const bool skipVoxels) const
+{
+    // sort the instances the ray enters by entry distance
+    struct Entry
+    {
+        const Instance* instance;
+        float distance;
+    };
+    Entry entries[MaxEntries];
+    uint entryCount = 0;
+    const float3 reciprocalDirection = ray.GetReciprocalDirection();
+    for (const Instance& instance : instances)
+    {
+        if (skipVoxels && instance.type == HitType::Voxel) continue;
+        const float distance = EntryDistance(ray, reciprocalDirection, instance.aabbMin, instance.aabbMax);
+        if (distance == 1e34f) continue;
+        if (entryCount == MaxEntries)
+        {
+            // more instances on this ray than the list holds: visit this one out of order
+            Intersect(instance, ray, hit);
+            continue;
+        }
+        uint i = entryCount++;
+        for (; i > 0 && entries[i - 1].distance > distance; i--) entries[i] = entries[i - 1];
+        entries[i] = {&instance, distance};
+    }
+
+    for (uint i = 0; i < entryCount && entries[i].distance < ray.length; i++) Intersect(*entries[i].instance, ray, hit);
+}
+
+void TLAS::Intersect(const Instance& instance, Ray& ray, HitRecord& hit) const
+{
+    // every query below only reports hits nearer than ray.length, so a hit replaces the record
+    HitRecord nearer = {instance.type, ~0u, instance.index};
+    switch (instance.type)
+    {
+    case HitType::Sphere:
+        nearer.primitive = scene->bvhSpheres->FindNearestSphere(ray);
+        break;
+    case HitType::Mesh:
+        nearer.primitive = scene->meshes[instance.index]->FindNearestTriangle(ray);
+        break;
+    default:
+    {
+        // the voxel traversal returns its first hit regardless of ray.length, so it runs
+        // on the full ray and is kept only when it is nearer
+        const float length = ray.length;
+        ray.length = 1e34f;
+        ushort paletteIndex;
+        if (scene->FindNearestVoxel(ray, paletteIndex) >= 0 && ray.length < length) nearer.primitive = paletteIndex;
+        else ray.length = length;
+        break;
+    }
+    }
+    if (nearer.primitive == ~0u) return;
+    if (hit.type != HitType::None) threadReplacedHits++;
+    hit = nearer;
+}
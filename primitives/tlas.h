@@ -0,0 +1,71 @@
+﻿#pragma once
+
+namespace Tmpl8
+{
+    class Scene;
+}
+
+// what a closest-hit query over the whole scene found; the HitInfo holds the details
+enum class HitType : uchar
+{
+    None,
+    Voxel,
+    Sphere,
+    Mesh
+};
+
+// the nearest hit so far, before anything about its surface is looked up: the ray length
+// is its distance, the record says which primitive it is. a nearer hit simply replaces
+// the record, and TLAS::FillHitInfo looks up the surface of the final one only.
+struct HitRecord
+{
+    HitType type = HitType::None;
+    uint primitive = 0; // voxel palette index, sphere index or triangle index
+    uint mesh = 0; // index into Scene::meshes, for HitType::Mesh
+};
+
+// Top-level acceleration structure: one instance per bottom-level structure of the scene,
+// the voxel grid (bounded by the scene cube), the sphere BVH and the BVH of every mesh. A query visits the
+// instances front to back by the distance to their bounds and skips those that start
+// beyond the nearest hit so far, so the first structure that is hit clips the others and
+// only the nearest primitive is shaded.
+class TLAS
+{
+public:
+    // refreshes the instances from the scene; call at a frame boundary, after the scene
+    // was moved or its sphere BVH rebuilt or refitted. returns whether the instances
+    // differ from the previous build, e.g. because a mesh was added or removed
+    bool Build(const Tmpl8::Scene& scene);
+
+    // nearest hit of any type closer than ray.length; on a hit ray.length is its distance.
+    // resolves the record first and fills info once, for the nearest hit
+    HitType FindNearest(Ray& ray, HitInfo& info) const;
+    // the closest-hit search alone
+    void FindNearest(Ray& ray, HitRecord& hit) const;
+    // the same for a ray whose voxel hit is already in ray and hit, as found by
+    // Scene::FindNearestPacket: only the other instances are traversed
+    void CompleteNearest(Ray& ray, HitRecord& hit) const;
+    // the surface at a resolved hit; returns its type
+    HitType FillHitInfo(Ray& ray, const HitRecord& hit, HitInfo& info) const;
+    // hits that a nearer one replaced before their surface was looked up: the HitInfo
+    // fills saved by resolving hits first. every thread counts its own; a job adds its
+    // count to the total with FlushReplacedHits once it is done, and TakeReplacedHits
+    // returns the total since its last call
+    static void FlushReplacedHits();
+    static uint TakeReplacedHits();
+
+private:
+    struct Instance
+    {
+        float3 aabbMin, aabbMax;
+        HitType type; // the bottom-level structure: the grid, the sphere BVH or a mesh
+        uint index; // into Scene::meshes
+    };
+
+    void Traverse(Ray& ray, HitRecord& hit, bool skipVoxels) const;
+    // replaces hit with a nearer hit in one instance, if there is one
+    void Intersect(const Instance& instance, Ray& ray, HitRecord& hit) const;
+
+    vector<Instance> instances;
+    const Tmpl8::Scene* scene = nullptr;
+};
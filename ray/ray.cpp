@@ -11,10 +11,10 @@ Ray::Ray(const float3& origin, const float3& direction, const float length): len
                     static_cast<float>(zSign) * 2 - 1) + 1) * 0.5f;
 }
 
-float3 Ray::GetNormal() const
+float3 Ray::GetNormal(const float scale) const
 {
     // return the voxel normal at the nearest intersection
-    const float3 I1 = GetIntersection() * VOXELAMOUNT; // our scene size is (1,1,1), so this scales each voxel to (1,1,1)
+    const float3 I1 = GetIntersection() * scale; // this scales each voxel to (1,1,1)
     const float3 fG = fracf( I1 );
     const float3 d = min3( fG, 1.0f - fG );
     const float mind = min( min( d.x, d.y ), d.z );
@@ -25,7 +25,8 @@ public:
     Ray() = default;
     Ray(const float3& origin, const float3& direction, const float length = 1e34f);
 
-    [[nodiscard]] float3 GetNormal() const;
+    // voxel normal at the intersection; scale is the number of voxels per world unit
+    [[nodiscard]] float3 GetNormal(float scale) const;
     [[nodiscard]] float3 GetIntersection() const { return origin + length * direction; }
     [[nodiscard]] float3 GetOrigin() const { return origin; }
     [[nodiscard]] float3 GetDirection() const { return direction; }
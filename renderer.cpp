@@ -1,11 +1,15 @@
 #include "precomp.h"
 
 #include "game/specialLights.h"
+#include "integrators/wavefront.h"
+#include "jobs/jobSystem.h"
 #include "lights/lightManager.h"
 #include "materials/materialManager.h"
 #include "primitives/bvh.h"
+#include "primitives/bvh4.h"
 #include "primitives/sphere.h"
 #include "ui/uiManager.h"
+#include "voxels/brickStore.h"
 
 // YOU GET:
 // 1. A fast voxel renderer in plain C/C++
@@ -74,9 +78,8 @@ void Renderer::Init()
 {
 	camera = new Camera();
 
-	// create fp32 rgb pixel buffer to render to
-	accumulator = (float4*)MALLOC64( SCRWIDTH * SCRHEIGHT * 16 * camera->numFramesToAccumulate );
-	memset( accumulator, 0, SCRWIDTH * SCRHEIGHT * 16 );
+	// create fp32 rgb pixel buffer to render to; the first accumulated frame overwrites it
+	accumulator = (float4*)MALLOC64( SCRWIDTH * SCRHEIGHT * sizeof( float4 ) );
 	
 	/*// try to load a camera
 	FILE* f = fopen( "camera.bin", "rb" );
@@ -88,113 +91,104 @@ void Renderer::Init()
 	
 	camera->SetCamera();
 	prevMousePos = mousePos;
-	
-	scene.bvhSpheres = new BVHSphere(scene.spheres);
-	scene.bvhSpheres->BuildBVH(scene.spheres);
+
+	// screen tiles in Morton order: the run of tiles a thread starts with is one compact
+	// region, which keeps its rays on the same bricks and BVH nodes
+	static_assert(SCRWIDTH % 8 == 0 && TILESIZE % 8 == 0, "packets cover 8 pixels of a tile line");
+	for (int y = 0; y < SCRHEIGHT; y += TILESIZE) for (int x = 0; x < SCRWIDTH; x += TILESIZE) tiles.push_back(int2(x, y));
+	const auto mortonCode = [](const int2& tile)
+	{
+		uint code = 0;
+		for (uint bit = 0; bit < 16; bit++)
+			code |= (static_cast<uint>(tile.x / TILESIZE) >> bit & 1) << (2 * bit) | (static_cast<uint>(tile.y / TILESIZE) >> bit & 1) << (2 * bit + 1);
+		return code;
+	};
+	std::sort(tiles.begin(), tiles.end(), [&](const int2& a, const int2& b) { return mortonCode(a) < mortonCode(b); });
+#ifdef WAVEFRONT
+	wavefront = new WavefrontIntegrator();
+#endif
 }
 
 int maxDepth = 10;
 
-float3 Renderer::HandleVoxelTrace(const HitInfo& hitInfo, const int depth) 
+// -----------------------------------------------------------
+// Evaluate light transport
+// -----------------------------------------------------------
+float3 Renderer::Trace( Ray& ray, const int depth) 
 {
-	// Extract information from hitInfo
-	const auto intersection = hitInfo.point;
-	const auto normal = hitInfo.normal;
-	const auto color = Math::GetColorNormalised(hitInfo.color);
-	
-	// Calculate direct lighting contribution
-	auto directLighting = scene.lightManager->CalculateTotalContribution(intersection, normal);
-
-	// Handle scattering
-	Ray scattered;
-	if (scene.materialManager->Scatter(hitInfo, scattered))
-	{
-		if (depth + 1 > maxDepth) return scene.skydome.Render(hitInfo.direction);
-		directLighting *= color * Trace(scattered, depth + 1);
-	}
-	else
-	{
-		if (hitInfo.special && depth == 0)
-		{
-			directLighting = Math::GetColorNormalised(hitInfo.specialColor);
-		}
-		else
-		{
-			directLighting *= color;
-		}
-	}
-
-	return directLighting;
+	// resolve the nearest hit over all primitive types first, then look up its surface
+	// once and shade it once; hits that turn out to be hidden are never filled in
+	HitRecord hit;
+	scene.tlas.FindNearest( ray, hit );
+	HitInfo info;
+	scene.tlas.FillHitInfo( ray, hit, info );
+	return Shade( ray, info, hit.type, depth );
 }
 
-float3 Renderer::HandleSphereTrace(Ray& ray, HitInfo info, const int depth)
+// -----------------------------------------------------------
+// Light transport for a ray whose nearest hit is already known
+// -----------------------------------------------------------
+float3 Renderer::Shade( Ray& ray, const HitInfo& firstInfo, const HitType firstHit, int depth )
 {
-	auto sphereTrace = float3(0);
-	if (scene.bvhSpheres->BeginTraversal(ray, info))
+	// the path is followed in a loop: every vertex multiplies the throughput by its direct
+	// light and its color, and the path ends in the sky, on a surface that does not
+	// scatter, at maxDepth, or by Russian roulette
+	float3 throughput( 1 );
+	HitInfo info = firstInfo;
+	HitType hit = firstHit;
+	float3 direction = ray.GetDirection();
+	while (true)
 	{
+		if (hit == HitType::None) return throughput * scene.skydome.Render( direction );
+
+		// triangles scatter like spheres: a face normal, with frontFace telling inside from outside
 		Ray scattered;
-		const auto color = Math::GetColorNormalised(info.color);
-		const auto intersection = info.point;
-		const auto normal = info.normal;
+		const bool scatters = hit == HitType::Voxel ? scene.materialManager->Scatter( info, scattered )
+			: scene.materialManager->ScatterSphere( info, scattered );
+		if (scatters && depth + 1 > maxDepth) return throughput * scene.skydome.Render( direction );
+		if (!scatters && hit == HitType::Voxel && info.special && depth == 0) return Math::GetColorNormalised( info.specialColor );
 
-		const float3 directLighting = scene.lightManager->CalculateTotalContribution(intersection, normal);
-			
-		if (scene.materialManager->ScatterSphere(info, scattered))
-		{
-			if (depth + 1 > maxDepth) return scene.skydome.Render(ray.GetDirection());
-			sphereTrace = directLighting * color * Trace(scattered, depth + 1);
-		}
-		else
-		{
-			sphereTrace = directLighting * color;
-		}
+		const float3 directLighting = scene.lightManager->CalculateTotalContribution( info.point, info.normal );
+		throughput *= directLighting * Math::GetColorNormalised( info.color );
+		if (!scatters) return throughput;
+#ifdef RUSSIANROULETTE
+		if (depth + 1 >= RUSSIANROULETTE && !Math::RussianRoulette( throughput )) return float3( 0 );
+#endif
+
+		depth++;
+		direction = scattered.GetDirection();
+		info = HitInfo();
+		hit = scene.tlas.FindNearest( scattered, info );
 	}
-	return sphereTrace;
 }
 
-// -----------------------------------------------------------
-// Evaluate light transport
-// -----------------------------------------------------------
-float3 Renderer::Trace( Ray& ray, const int depth) 
+void Renderer::Accumulation(const int x, const int y, const float4& pixel) const
 {
-	HitInfo info;
-	scene.FindNearest(ray, info, depth);
-	const auto voxelDistance = ray.length;
-
-	const auto sphereTrace = HandleSphereTrace(ray, info, depth);
-	const auto sphereDistance = ray.length;
-
-	// If no intersection occurs, show skydome
-	if (sphereDistance == 1e34f && voxelDistance == 1e34f)
-	{
-		return scene.skydome.Render(ray.GetDirection());
-	}
+	// move the stored average towards the new sample; with a weight of 1/n this is the
+	// mean of all n samples, without keeping the older frames around
+	float4& average = accumulator[x + y * SCRWIDTH];
+	average += sampleWeight * (pixel - average);
 
-	const auto voxelTrace = HandleVoxelTrace(info, depth);
-	if (sphereDistance < voxelDistance)
-	{
-		return sphereTrace;
-	}
-	return voxelTrace;
+	// Convert accumulated pixel to RGB8 and store it in the screen buffer
+	screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&average);
 }
 
-void Renderer::Accumulation(const int& frameIndex, int x, int y, const float4 pixel) const
+void Renderer::StorePixel(const int x, const int y, const float4& pixel, const bool accumulate)
 {
-	const int numFramesToAccumulate = camera->numFramesToAccumulate;
-	// Blend current pixel with accumulated pixel from previous frames
-	auto blendedPixel = pixel;
-	for (int i = 0; i < numFramesToAccumulate; ++i)
+#ifdef _DEBUG
+	// Convert pixel to RGB8 and store it in the screen buffer
+	screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&pixel);
+#else
+	if (accumulate)
 	{
-		const int prevFrameIndex = (frameIndex - i + numFramesToAccumulate) % numFramesToAccumulate;
-		blendedPixel += accumulator[x + y * SCRWIDTH + prevFrameIndex * SCRWIDTH * SCRHEIGHT];
+		Accumulation(x, y, pixel);
 	}
-	blendedPixel *= 1.0f / (numFramesToAccumulate + 1); // Normalize by number of accumulated frames
-
-	// Update accumulated pixel buffer
-	accumulator[x + y * SCRWIDTH + frameIndex * SCRWIDTH * SCRHEIGHT] = blendedPixel;
-
-	// Convert accumulated pixel to RGB8 and store it in the screen buffer
-	screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&blendedPixel);
+	else
+	{
+		// Convert pixel to RGB8 and store it in the screen buffer
+		screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&pixel);
+	}
+#endif
 }
 
 // -----------------------------------------------------------
@@ -202,36 +196,71 @@ void Renderer::Accumulation(const int& frameIndex, int x, int y, const float4 pi
 // -----------------------------------------------------------
 void Renderer::Tick(float deltaTime)
 {
-	static int frameIndex = 0;
 	const bool bAccumulate = camera->bAccumulate;
+	// bring derived voxel data and the TLAS up to date with last frame's edits before any ray uses them
+	const bool sceneChanged = scene.ApplyChanges();
 
-	// lines are executed as OpenMP parallel tasks (disabled in DEBUG)
-#pragma omp parallel for schedule(dynamic)
-	for (int y = 0; y < SCRHEIGHT; y++)
-	{
-		// trace a primary ray for each pixel on the line
-		for (int x = 0; x < SCRWIDTH; x++)
-		{
-			const auto sample = Math::SampleSquare();
-			auto ray = camera->GetPrimaryRay(static_cast<float>(x) + sample.x, static_cast<float>(y) + sample.y);
-			const auto pixel = float4(Trace(ray, 0), 0);
+	// the average restarts when the image it converges to changes
+	if (sceneChanged || !bAccumulate || !camera->SameView( accumulatedView )) accumulatedFrames = 0;
+	accumulatedView = *camera;
+	accumulatedFrames++;
+	const uint window = static_cast<uint>(max( camera->numFramesToAccumulate, 0 ));
+	sampleWeight = 1.0f / static_cast<float>(window > 0 ? min( accumulatedFrames, window ) : accumulatedFrames);
 
-#ifdef _DEBUG
-			// Convert pixel to RGB8 and store it in the screen buffer
-			screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&pixel);
+#ifdef WAVEFRONT
+	// all paths advance bounce by bounce, stage by stage; the pixels are stored afterwards
+	wavefront->Render(scene, *camera, tiles, maxDepth);
+	JobSystem::Instance().ParallelFor(SCRHEIGHT, [&](const uint y)
+	{
+		for (int x = 0; x < SCRWIDTH; x++) StorePixel(x, static_cast<int>(y), float4(wavefront->Pixel(x, y), 0), bAccumulate);
+	} );
 #else
-			if (bAccumulate)
-			{
-				Accumulation(frameIndex, x, y, pixel);
-			}
-			else
+	// tiles are rendered as jobs; threads steal tiles from each other, so a few costly
+	// regions (the mirror wall, glass spheres) no longer hold up the frame
+	JobSystem::Instance().ParallelFor(static_cast<uint>(tiles.size()), [&](const uint tile)
+	{
+		const int2 tileMin = tiles[tile];
+		const int tileMaxX = min(tileMin.x + TILESIZE, SCRWIDTH), tileMaxY = min(tileMin.y + TILESIZE, SCRHEIGHT);
+		for (int y = tileMin.y; y < tileMaxY; y++)
+		{
+			// trace a primary ray for each pixel on the tile line
+#ifdef USE_SIMD
+			Ray rays[8];
+			HitRecord hits[8];
+#endif
+			for (int x = tileMin.x; x < tileMaxX; x++)
 			{
-				// Convert pixel to RGB8 and store it in the screen buffer
-				screen->pixels[x + y * SCRWIDTH] = RGBF32_to_RGB8(&pixel);
-			}
+#ifdef USE_SIMD
+				// primary rays of 8 neighbouring pixels are coherent: find their voxel hits as one packet
+				if ((x & 7) == 0)
+				{
+					for (int i = 0; i < 8; i++)
+					{
+						const auto sample = Math::SampleSquare();
+						rays[i] = camera->GetPrimaryRay(static_cast<float>(x + i) + sample.x, static_cast<float>(y) + sample.y);
+					}
+					scene.FindNearestPacket(rays, hits);
+				}
+				// the packet found the voxel hits; the TLAS adds the other primitive types
+				scene.tlas.CompleteNearest( rays[x & 7], hits[x & 7] );
+				HitInfo info;
+				scene.tlas.FillHitInfo( rays[x & 7], hits[x & 7], info );
+				const auto pixel = float4(Shade(rays[x & 7], info, hits[x & 7].type, 0), 0);
+#else
+				const auto sample = Math::SampleSquare();
+				auto ray = camera->GetPrimaryRay(static_cast<float>(x) + sample.x, static_cast<float>(y) + sample.y);
+				const auto pixel = float4(Trace(ray, 0), 0);
 #endif
+
+				StorePixel(x, y, pixel, bAccumulate);
+			}
 		}
-	}
+		TLAS::FlushReplacedHits();
+	} );
+#endif
+	// no rays are in flight now, so a streamed world can unmap bricks it has not used recently
+	if (scene.bricks) scene.bricks->EndFrame();
+	replacedHits = TLAS::TakeReplacedHits();
 	
 	//camera->HandleCameraInput(deltaTime);
 	/*const auto mouseDelta = mousePos - prevMousePos;
@@ -241,10 +270,6 @@ void Renderer::Tick(float deltaTime)
 		camera->UpdateCameraOrientation(static_cast<float>(mouseDelta.x), static_cast<float>(mouseDelta.y));
 	}*/
 	scene.specialLights->Tick(deltaTime);
-	
-	
-	// Increment frame index
-	frameIndex = (frameIndex + 1) % camera->numFramesToAccumulate;
 }
 
 // -----------------------------------------------------------
@@ -254,6 +279,10 @@ void Renderer::UI(float deltaTime)
 {
 	ImGui::Begin("Debug Information");
 	scene.uiManager->HandleAllUI(deltaTime,*camera);
+	ImGui::Text("Hit lookups saved: %u", replacedHits);
+	ImGui::Text("Accumulated frames: %u", accumulatedFrames);
+	// an edit through the UI (lights, materials, meshes, the camera) changes the image
+	if (ImGui::IsAnyItemActive()) accumulatedFrames = 0;
 	ImGui::End();
 	
 	ImGui::Begin("Score", nullptr,
@@ -300,7 +329,7 @@ void Renderer::MouseDown(int button)
 		const int hitVoxelIndex = scene.GetHitVoxelIndex(r);
 		if (hitVoxelIndex != -1 )
 		{
-			if (scene.grid[hitVoxelIndex].special && !scene.specialLights->bWon)
+			if (scene.Get(hitVoxelIndex).special && !scene.specialLights->bWon)
 			{
 				scene.specialLights->CheckSpecialLight(hitVoxelIndex);
 			}
@@ -1,6 +1,7 @@
 #pragma once
 
 class Character;
+class WavefrontIntegrator;
 
 namespace Tmpl8
 {
@@ -10,10 +11,10 @@ class Renderer : public TheApp
 public:
 	// game flow methods
 	void Init();
-	float3 HandleVoxelTrace(const HitInfo& hitInfo, const int depth);
-	float3 HandleSphereTrace(Ray& ray, HitInfo info, int depth);
 	float3 Trace(Ray& ray, int depth);
-	void Accumulation(const int& frameIndex, int x, int y, float4 pixel) const;
+	float3 Shade(Ray& ray, const HitInfo& info, HitType hit, int depth);
+	void Accumulation(int x, int y, const float4& pixel) const;
+	void StorePixel(int x, int y, const float4& pixel, bool accumulate);
 	void Tick( float deltaTime ) override;
 	void UI(float deltaTime) override;
 	void Shutdown();
@@ -27,10 +28,16 @@ public:
 	// data members
 	int2 mousePos;
 	int2 prevMousePos;
-	float4* accumulator;
+	float4* accumulator; // per pixel: the average of the accumulated frames
+	uint accumulatedFrames = 0; // samples in the average; 0 restarts it
+	float sampleWeight = 1; // of this frame's sample: 1 / accumulatedFrames, or the moving-average weight
+	Camera accumulatedView; // the view the average belongs to
 	Scene scene;
 	Camera* camera;
 	Character* character;
+	vector<int2> tiles; // top-left pixel of every screen tile, in Morton order
+	WavefrontIntegrator* wavefront = nullptr; // with WAVEFRONT defined
+	uint replacedHits = 0; // last frame: hits replaced by nearer ones before their surface was looked up
 };
 
 } // namespace Tmpl8
\ No newline at end of file
@@ -68,6 +68,15 @@ public:
 		return {rayOrigin, direction};
 	}
 
+	// whether the other camera takes the same primary rays; accumulated frames of one
+	// view are no use for the other
+	[[nodiscard]] bool SameView(const Camera& other) const
+	{
+		const auto same = [](const float3& a, const float3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+		return same(camPos, other.camPos) && same(topLeft, other.topLeft) && same(topRight, other.topRight) &&
+			same(bottomLeft, other.bottomLeft) && focalLength == other.focalLength && apertureRadius == other.apertureRadius;
+	}
+
 	[[nodiscard]] float3 GetForwardVector() const
 	{
 		return normalize(camTarget - camPos);
@@ -172,7 +181,9 @@ public:
 	float3 topRight;
 	float3 bottomLeft;
 
-	int numFramesToAccumulate = 8;
+	// 0: average all frames since the view last changed; n: an exponential moving average
+	// that weighs the newest frame 1/n, for an image that keeps up with moving objects
+	int numFramesToAccumulate = 0;
 	bool bAccumulate = true;
 
 	float focalLength = 2.3f;
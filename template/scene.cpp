@@ -1,10 +1,34 @@
 #include "precomp.h"
 
+#include <unordered_map>
+
 #include "game/specialLights.h"
 #include "materials/materialManager.h"
 #include "lights/lightManager.h"
 #include "primitives/bvh.h"
+#include "primitives/bvh4.h"
+#include "primitives/mesh.h"
 #include "ui/uiManager.h"
+#include "voxels/brickStore.h"
+#include "voxels/tree64.h"
+#include "voxels/worldFile.h"
+
+#ifdef TWOLEVEL
+static_assert(BRICKSIZE == VoxelLayout::TileSize, "bricks are addressed as storage tiles");
+#endif
+
+static SphereBVH* BuildSphereBVH( const SphereSet& spheres )
+{
+#ifdef SPHERELBVH
+	SphereBVH* bvh = new SphereBVH( spheres, SphereBuild::Morton );
+#else
+	SphereBVH* bvh = new SphereBVH( spheres, SphereBuild::BinnedSAH );
+#endif
+#if defined(SPHEREBVHQUANTIZED) && !defined(SPHEREBVH4)
+	bvh->Quantize();
+#endif
+	return bvh;
+}
 
 Cube::Cube( const float3 pos, const float3 size )
 {
@@ -48,8 +72,81 @@ bool Cube::Contains( const float3& pos ) const
 		pos.x <= b[1].x && pos.y <= b[1].y && pos.z <= b[1].z;
 }
 
-Scene::Scene()
+Scene::Scene(const uint3& size, const VoxelStructure structure): Scene(size, structure, WorldSource::Generate)
+{
+}
+
+static uint3 WorldFileSize(const char* worldFile)
+{
+	uint3 size;
+	if (!WorldFile::ReadSize( worldFile, size )) FATALERROR( "could not read world file %s", worldFile );
+	return size;
+}
+
+Scene::Scene(const char* worldFile, const VoxelStructure structure): Scene(WorldFileSize( worldFile ), structure, WorldSource::WorldFile)
+{
+	if (!WorldFile::Load( *this, worldFile )) FATALERROR( "could not load world file %s", worldFile );
+	CompleteSpecialVoxels( worldFile );
+#ifdef DISTANCEFIELD
+	if (occupancy) BuildDistanceField();
+#endif
+	specialLights = new SpecialLights(this);
+}
+
+static uint3 BrickStoreSize()
+{
+	uint3 size;
+	if (!BrickStore::ReadSize( BRICKSTOREFILE, size )) FATALERROR( "could not read brick store %s", BRICKSTOREFILE );
+	return size;
+}
+
+Scene::Scene(ReopenBrickStore): Scene(BrickStoreSize(), VoxelStructure::Streamed, WorldSource::BrickStore)
 {
+#ifdef TWOLEVEL
+	// the bricks index the palette of the session that wrote them, which the store kept
+	if (!bricks->LoadPalette( materialManager->voxelPalette )) FATALERROR( "brick store %s has no valid palette", BRICKSTOREFILE );
+	// specialVoxels are not stored, so they are found again; every index is checked on the way
+	const vector<VoxelData>& palette = materialManager->voxelPalette;
+	const uint brickCount = static_cast<uint>(brickChanges.size());
+	for (uint brickIndex = 0; brickIndex < brickCount; brickIndex++)
+	{
+		if (!brickVoxelCount[brickIndex]) continue;
+		const StreamedBrick* brick = bricks->Brick( brickIndex );
+		for (uint i = 0; i < BRICKSIZE3; i++)
+		{
+			const ushort paletteIndex = brick->paletteIndices[i];
+			if (paletteIndex >= palette.size()) FATALERROR( "brick store %s uses palette entry %u of %zu", BRICKSTOREFILE, paletteIndex, palette.size() );
+			if (palette[paletteIndex].special) specialVoxels.push_back( brickIndex * BRICKSIZE3 + i );
+		}
+		// stay within the budget while the whole world is read
+		if (brickIndex % 4096 == 4095) bricks->EndFrame();
+	}
+	bricks->EndFrame();
+	CompleteSpecialVoxels( BRICKSTOREFILE );
+	specialLights = new SpecialLights(this);
+#endif
+}
+
+void Scene::CompleteSpecialVoxels(const char* source)
+{
+	// the game cycles through six special voxels; a world with fewer repeats the first one
+	if (specialVoxels.empty()) FATALERROR( "world %s has no special voxels for the game", source );
+	const uint first = specialVoxels[0];
+	specialVoxels.resize( max( specialVoxels.size(), static_cast<size_t>(6) ), first );
+}
+
+Scene::Scene(const uint3& size, const VoxelStructure structure, const WorldSource source): structure(structure),
+	extent{ size.x, size.y, size.z, static_cast<float>(max( max( size.x, size.y ), size.z )) },
+	layout( size.x, size.y, size.z )
+{
+	if (size.x % VoxelLayout::TileSize || size.y % VoxelLayout::TileSize || size.z % VoxelLayout::TileSize)
+		FATALERROR( "world size %ux%ux%u is not a multiple of %u", size.x, size.y, size.z, VoxelLayout::TileSize );
+	if (size.x == 16 && size.y == 16 && size.z == 16) commonExtent = CommonExtent::Cube16;
+	else if (size.x == 64 && size.y == 64 && size.z == 64) commonExtent = CommonExtent::Cube64;
+	else if (size.x == 128 && size.y == 128 && size.z == 128) commonExtent = CommonExtent::Cube128;
+	else if (size.x == 256 && size.y == 256 && size.z == 256) commonExtent = CommonExtent::Cube256;
+	else if (size.x == 1024 && size.y == 128 && size.z == 1024) commonExtent = CommonExtent::Terrain1024x128;
+
 	lightManager = new LightManager();
 	lightManager->scene = this;
 	lightManager->ambientLight = { {1.f}, 0.0f };
@@ -63,30 +160,64 @@ Scene::Scene()
 	Material material;
 	material.type = Material::Type::Dielectric;
 	material.dielectric.refractiveIndex = 1.5f;
-	spheres.push_back(new Sphere{ {0.2f, 0.5f, 1.5f}, 0.2f, {material}, 0xffffff });
+	spheres = new SphereSet();
+	spheres->Add( {0.2f, 0.5f, 1.5f}, 0.2f, material, 0xffffff );
 	material.type = Material::Type::Glossy;
 	material.glossy.fuzz = 0.1f;
-	spheres.push_back(new Sphere{ {0.2f, 0.5f, -0.5f}, 0.2f, {material}, 0xffffff });
+	spheres->Add( {0.2f, 0.5f, -0.5f}, 0.2f, material, 0xffffff );
 
-	bvhSpheres->BuildBVH(spheres);
+	tracedSpheres = new SphereSet( *spheres );
+	bvhSpheres = BuildSphereBVH( *tracedSpheres );
 	
 	uiManager = new UIManager();
 	uiManager->scene = this;
 	materialManager = new MaterialManager();
-	// the voxel world sits in a 1x1x1 cube
-	cube = Cube( float3( 0, 0, 0 ), float3( 1, 1, 1 ) );
+	brickChanges.resize( static_cast<size_t>(size.x) * size.y * size.z / VoxelLayout::TileVoxels );
+	// the voxel world sits in a box whose longest side is 1
+	cube = Cube( float3( 0, 0, 0 ), float3( size ) * (1.0f / extent.scale) );
+	tlas.Build( *this );
 	// initialize the scene using Perlin noise, parallel over z
-	grid = static_cast<VoxelData*>(MALLOC64(GRIDSIZE3 * sizeof( VoxelData )));
-	memset( grid, 0, GRIDSIZE3 * sizeof( VoxelData ) );
+	if (structure == VoxelStructure::Tree64)
+	{
+		tree = new Tree64( size, extent.scale );
+	}
+	else if (structure == VoxelStructure::Streamed)
+	{
+#ifdef TWOLEVEL
+		// the brick counts are the store's summary, so they persist with the bricks. a world
+		// that is generated or loaded starts from an empty store, with the palette it indexes
+		const bool reopen = source == WorldSource::BrickStore;
+		bricks = new BrickStore( BRICKSTOREFILE, size, BRICKSTOREBUDGET, reopen ? BrickStore::Open::Existing : BrickStore::Open::Create );
+		brickVoxelCount = bricks->brickVoxelCount;
+		if (!reopen) bricks->StorePalette( materialManager->voxelPalette );
+#else
+		FATALERROR( "streamed worlds need TWOLEVEL" );
+#endif
+	}
+	else
+	{
+		const size_t voxelCount = static_cast<size_t>(size.x) * size.y * size.z;
+		occupancy = static_cast<uint64*>(MALLOC64(voxelCount / 8));
+		memset( occupancy, 0, voxelCount / 8 );
+		paletteIndices = static_cast<ushort*>(MALLOC64(voxelCount * sizeof( ushort )));
+		memset( paletteIndices, 0, voxelCount * sizeof( ushort ) );
+#ifdef TWOLEVEL
+		brickVoxelCount = static_cast<ushort*>(MALLOC64(voxelCount / BRICKSIZE3 * sizeof( ushort )));
+		memset( brickVoxelCount, 0, voxelCount / BRICKSIZE3 * sizeof( ushort ) );
+#endif
+	}
+
+	// a world that is loaded stays empty here
+	if (source != WorldSource::Generate) return;
 
 	specialVoxels.resize(6);
 	int currentSpecial = 0;
 	
-	for (int z = 0; z < VOXELAMOUNT; z++)
+	for (uint z = 0; z < size.z; z++)
 	{
-		for (int y = 0; y < VOXELAMOUNT; y++)
+		for (uint y = 0; y < size.y; y++)
 		{
-			for (int x = 0; x < VOXELAMOUNT; x++)
+			for (uint x = 0; x < size.x; x++)
 			{
 				if (x == 0)
 				{
@@ -125,27 +256,340 @@ Scene::Scene()
 					data.material = material;
 					data.color = 0xffffff;
 					data.special = true;
-					specialVoxels[currentSpecial++] = x + y * GRIDSIZE + z * GRIDSIZE2;
+					specialVoxels[currentSpecial++] = VoxelIndex(x, y, z);
 					Set(x,y,z,data);
 				}
 			}
 		}
+		// keep a streamed world within its budget while it is being filled
+		if (bricks) bricks->EndFrame();
 	}
+	// the generated world is the starting point, not a change
+	for (const uint brickIndex : dirtyBricks) brickChanges[brickIndex] = 0;
+	dirtyBricks.clear();
+#ifdef DISTANCEFIELD
+	if (occupancy) BuildDistanceField();
+#endif
 	specialLights = new SpecialLights(this);
 }
 
+Scene::~Scene()
+{
+	// the rebuild reads its own copy of the spheres; let it finish and drop the result
+	if (sphereRebuild.valid())
+	{
+		const SphereRebuild rebuilt = sphereRebuild.get();
+		delete rebuilt.bvh;
+		delete rebuilt.spheres;
+	}
+	for (const Mesh* mesh : meshes) delete mesh;
+	delete specialLights;
+	delete bvhSpheres;
+	delete tracedSpheres;
+	delete spheres;
+	delete tree;
+#ifdef TWOLEVEL
+	// a streamed world's brick counts are the store's summary, which the store unmaps
+	if (!bricks) FREE64( brickVoxelCount );
+#endif
+	delete bricks;
+	FREE64( occupancy );
+	FREE64( paletteIndices );
+#ifdef DISTANCEFIELD
+	FREE64( distanceField );
+#endif
+	delete uiManager;
+	delete lightManager;
+	delete materialManager;
+}
+
+uint Scene::VoxelIndex(const uint x, const uint y, const uint z) const
+{
+	return layout.Index( x, y, z );
+}
+
+uint3 Scene::VoxelCoordinates(const uint index) const
+{
+	return VoxelLayout::Coordinates( index, extent.x / VoxelLayout::TileSize, extent.y / VoxelLayout::TileSize );
+}
+
 int Scene::GetHitVoxelIndex(Ray& ray) const
 {
-	HitInfo info;
-	return FindNearest(ray, info, 0);
+	ushort paletteIndex;
+	return FindNearestVoxel(ray, paletteIndex);
+}
+
+void Scene::Set(const uint x, const uint y, const uint z, const VoxelData& data)
+{
+	const ushort paletteIndex = materialManager->GetVoxelPaletteIndex(data);
+	const uint index = VoxelIndex(x, y, z);
+	// bricks are the storage tiles, so the brick index is the tile part of the voxel index
+	const uint brickIndex = index / VoxelLayout::TileVoxels;
+	const bool isSolid = paletteIndex != 0;
+	bool wasSolid;
+	if (tree)
+	{
+		const ushort previous = tree->Get(x, y, z);
+		if (previous == paletteIndex) return;
+		wasSolid = previous != 0;
+		tree->Set(x, y, z, paletteIndex);
+	}
+#ifdef TWOLEVEL
+	else if (bricks)
+	{
+		const uint voxel = index & (BRICKSIZE3 - 1);
+		// clearing a voxel in an empty brick changes nothing, and must not map its chunk
+		if (!isSolid && !brickVoxelCount[brickIndex]) return;
+		// the store holds every palette entry before a brick uses it
+		if (paletteIndex >= bricks->PaletteSize()) bricks->StorePalette( materialManager->voxelPalette );
+		StreamedBrick* brick = bricks->Brick( brickIndex );
+		if (brick->paletteIndices[voxel] == paletteIndex) return;
+		wasSolid = brick->occupancy[voxel >> 6] >> (voxel & 63) & 1;
+		brick->paletteIndices[voxel] = paletteIndex;
+		if (wasSolid != isSolid) brick->occupancy[voxel >> 6] ^= 1ull << (voxel & 63);
+	}
+#endif
+	else
+	{
+		if (paletteIndices[index] == paletteIndex) return;
+		wasSolid = IsSolid(index);
+		paletteIndices[index] = paletteIndex;
+		if (wasSolid != isSolid) occupancy[index >> 6] ^= 1ull << (index & 63);
+	}
+	if (wasSolid == isSolid)
+	{
+		// a recoloured voxel leaves all traversal data as it is
+		MarkChanged(brickIndex, AppearanceChanged);
+		return;
+	}
+#ifdef TWOLEVEL
+	// keep the brick counts in sync so the top-level DDA never skips a filled brick
+	if (!tree)
+	{
+		if (isSolid) brickVoxelCount[brickIndex]++;
+		else brickVoxelCount[brickIndex]--;
+	}
+#endif
+#ifdef DISTANCEFIELD
+	// a new voxel can only bring its neighbourhood closer, which is cheap and must be seen by
+	// the next ray. around a removed voxel the old distances are too small, which is safe,
+	// so that region is recomputed in ApplyChanges.
+	if (distanceField && isSolid) AddToDistanceField( x, y, z );
+#endif
+	MarkChanged(brickIndex, OccupancyChanged);
+}
+
+void Scene::Set(const uint index, const VoxelData& data)
+{
+	const uint3 P = VoxelCoordinates(index);
+	Set(P.x, P.y, P.z, data);
+}
+
+VoxelData Scene::Get(const uint index) const
+{
+	ushort paletteIndex;
+	if (tree)
+	{
+		const uint3 P = VoxelCoordinates(index);
+		paletteIndex = tree->Get(P.x, P.y, P.z);
+	}
+#ifdef TWOLEVEL
+	else if (bricks)
+	{
+		const uint brickIndex = index / BRICKSIZE3;
+		paletteIndex = brickVoxelCount[brickIndex] ? bricks->Brick( brickIndex )->paletteIndices[index & (BRICKSIZE3 - 1)] : 0;
+	}
+#endif
+	else paletteIndex = paletteIndices[index];
+	return materialManager->GetVoxelData(paletteIndex);
+}
+
+void Scene::GetBrick( const uint brickIndex, ushort* brickPaletteIndices ) const
+{
+	const uint first = brickIndex * VoxelLayout::TileVoxels;
+	if (tree)
+	{
+		for (uint i = 0; i < VoxelLayout::TileVoxels; i++)
+		{
+			const uint3 P = VoxelCoordinates( first + i );
+			brickPaletteIndices[i] = tree->Get( P.x, P.y, P.z );
+		}
+		return;
+	}
+#ifdef TWOLEVEL
+	if (bricks)
+	{
+		if (brickVoxelCount[brickIndex]) memcpy( brickPaletteIndices, bricks->Brick( brickIndex )->paletteIndices, VoxelLayout::TileVoxels * sizeof( ushort ) );
+		else memset( brickPaletteIndices, 0, VoxelLayout::TileVoxels * sizeof( ushort ) );
+		return;
+	}
+#endif
+	memcpy( brickPaletteIndices, paletteIndices + first, VoxelLayout::TileVoxels * sizeof( ushort ) );
+}
+
+void Scene::SetBrick( const uint brickIndex, const ushort* brickPaletteIndices )
+{
+	const uint first = brickIndex * VoxelLayout::TileVoxels;
+	if (tree)
+	{
+		for (uint i = 0; i < VoxelLayout::TileVoxels; i++)
+		{
+			const uint3 P = VoxelCoordinates( first + i );
+			tree->Set( P.x, P.y, P.z, brickPaletteIndices[i] );
+		}
+		return;
+	}
+	// a tile is 8 whole occupancy words, so tiles never share a word
+	uint64 words[VoxelLayout::TileVoxels / 64] = {};
+	uint count = 0;
+	for (uint i = 0; i < VoxelLayout::TileVoxels; i++)
+	{
+		if (!brickPaletteIndices[i]) continue;
+		words[i >> 6] |= 1ull << (i & 63);
+		count++;
+	}
+#ifdef TWOLEVEL
+	if (bricks)
+	{
+		if (!count && !brickVoxelCount[brickIndex]) return;
+		StreamedBrick* brick = bricks->Brick( brickIndex );
+		memcpy( brick->occupancy, words, sizeof( words ) );
+		memcpy( brick->paletteIndices, brickPaletteIndices, VoxelLayout::TileVoxels * sizeof( ushort ) );
+		brickVoxelCount[brickIndex] = static_cast<ushort>(count);
+		return;
+	}
+	brickVoxelCount[brickIndex] = static_cast<ushort>(count);
+#endif
+	memcpy( occupancy + first / 64, words, sizeof( words ) );
+	memcpy( paletteIndices + first, brickPaletteIndices, VoxelLayout::TileVoxels * sizeof( ushort ) );
+}
+
+void Scene::MarkChanged( const uint brickIndex, const uchar change )
+{
+	if (!brickChanges[brickIndex]) dirtyBricks.push_back( brickIndex );
+	brickChanges[brickIndex] |= change;
+}
+
+void Scene::Subscribe( ChangeListener listener )
+{
+	listeners.push_back( std::move( listener ) );
+}
+
+bool Scene::ApplyChanges()
+{
+	const bool spheresChanged = ApplySphereChanges();
+	const bool instancesChanged = tlas.Build( *this );
+	if (dirtyBricks.empty()) return spheresChanged || instancesChanged;
+	vector<DirtyBrick> changed( dirtyBricks.size() );
+	for (size_t i = 0; i < dirtyBricks.size(); i++)
+	{
+		changed[i] = { dirtyBricks[i], brickChanges[dirtyBricks[i]] };
+		brickChanges[dirtyBricks[i]] = 0;
+	}
+	dirtyBricks.clear();
+#ifdef DISTANCEFIELD
+	if (distanceField) RefreshDistanceField( changed );
+#endif
+	for (const ChangeListener& listener : listeners) listener( changed );
+	return true;
+}
+
+void Scene::SpheresEdited()
+{
+	spheresEdited = true;
+}
+
+void Scene::SpheresChanged()
+{
+	sphereVersion++;
+}
+
+bool Scene::ApplySphereChanges()
+{
+	// a finished rebuild replaces the traced tree and its copy of the spheres in one go;
+	// edits made while it ran are copied in below
+	bool swapped = false;
+	if (sphereRebuild.valid() && sphereRebuild.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready)
+	{
+		const SphereRebuild rebuilt = sphereRebuild.get();
+		delete bvhSpheres;
+		delete tracedSpheres;
+		bvhSpheres = rebuilt.bvh;
+		tracedSpheres = rebuilt.spheres;
+		tracedVersion = rebuilt.version;
+		spheresEdited = true;
+		swapped = true;
+	}
+	// spheres were added or removed: the traced copy stays as it is until a tree over the
+	// new set is ready
+	if (tracedVersion != sphereVersion)
+	{
+		if (!sphereRebuild.valid()) StartSphereRebuild();
+		return swapped;
+	}
+	if (!spheresEdited) return false;
+	spheresEdited = false;
+	// same spheres at the same indices: copy the new centers, radii and colors and refit
+	*tracedSpheres = *spheres;
+	if (bvhSpheres->Refit() >= SPHEREREBUILDCOST && !sphereRebuild.valid()) StartSphereRebuild();
+	return true;
+}
+
+void Scene::StartSphereRebuild()
+{
+	// the worker builds over its own copy, so the spheres stay editable and the traced
+	// tree stays valid in the meantime
+	sphereRebuild = std::async( std::launch::async, [copy = new SphereSet( *spheres ), version = sphereVersion]()
+	{
+		return SphereRebuild{ copy, BuildSphereBVH( *copy ), version };
+	} );
 }
 
-void Scene::Set(const uint x, const uint y, const uint z, const VoxelData& data) const
+size_t Scene::VoxelMemoryUsage() const
 {
-	grid[x + y * GRIDSIZE + z * GRIDSIZE2] = data;
+	const size_t palette = materialManager->VoxelPaletteMemoryUsage();
+	if (tree) return tree->MemoryUsage() + palette;
+	if (bricks) return bricks->ResidentBytes() + bricks->SummaryBytes() + palette;
+	const size_t voxelCount = static_cast<size_t>(extent.x) * extent.y * extent.z;
+	size_t bytes = voxelCount / 8 + voxelCount * sizeof( ushort ) + palette;
+#ifdef TWOLEVEL
+	bytes += voxelCount / BRICKSIZE3 * sizeof( ushort );
+#endif
+#ifdef DISTANCEFIELD
+	bytes += voxelCount * sizeof( uchar );
+#endif
+	return bytes;
 }
 
-bool Scene::Setup3DDDA( const Ray& ray, DDAState& state ) const
+void Scene::FillHitInfo( Ray& ray, const ushort paletteIndex, const float t, HitInfo& info ) const
+{
+	const VoxelData& cell = materialManager->GetVoxelData( paletteIndex );
+	ray.length = t;
+	info.point = ray.GetIntersection();
+	info.normal = ray.GetNormal( extent.scale );
+	info.color = cell.color;
+	info.material = cell.material;
+	info.special = cell.special;
+	info.specialColor = cell.specialColor;
+}
+
+template <class F>
+auto Scene::WithExtent( F&& f ) const
+{
+	// calls f with the extent of this world, as compile-time constants for the common sizes
+	switch (commonExtent)
+	{
+	case CommonExtent::Cube16: return f( FixedExtent<16, 16, 16>() );
+	case CommonExtent::Cube64: return f( FixedExtent<64, 64, 64>() );
+	case CommonExtent::Cube128: return f( FixedExtent<128, 128, 128>() );
+	case CommonExtent::Cube256: return f( FixedExtent<256, 256, 256>() );
+	case CommonExtent::Terrain1024x128: return f( FixedExtent<1024, 128, 1024>() );
+	default: return f( extent );
+	}
+}
+
+template <class Extent>
+bool Scene::Setup3DDDA( const Ray& ray, DDAState& state, const Extent world ) const
 {
 	// if ray is not inside the world: advance until it is
 	state.t = 0;
@@ -158,12 +602,13 @@ bool Scene::Setup3DDDA( const Ray& ray, DDAState& state ) const
 	const auto direction = ray.GetDirection();
 	const auto reciprocal = ray.GetReciprocalDirection();
 	
-	// setup amanatides & woo - assume world is 1x1x1, from (0,0,0) to (1,1,1)
-	static constexpr float cellSize = 1.0f / GRIDSIZE;
+	// setup amanatides & woo - the world spans (0,0,0) to its extent divided by its scale
+	const float cellSize = GRIDCELLSIZE / world.scale;
 	state.step = make_int3( 1 - ray.dSign * 2 );
-	const float3 posInGrid = GRIDSIZE * (origin + (state.t + 0.00005f) * direction);
+	const float3 posInGrid = (world.scale / GRIDCELLSIZE) * (origin + (state.t + 0.00005f) * direction);
 	const float3 gridPlanes = (ceilf( posInGrid ) - ray.dSign) * cellSize;
-	const int3 P = clamp( make_int3( posInGrid ), 0, GRIDSIZE - 1 );
+	const int3 gridMax = make_int3( world.x / GRIDCELLSIZE, world.y / GRIDCELLSIZE, world.z / GRIDCELLSIZE ) - 1;
+	const int3 P = clamp( make_int3( posInGrid ), make_int3( 0 ), gridMax );
 	state.x = P.x, state.y = P.y, state.z = P.z;
 	state.tDelta = cellSize * float3( state.step ) * reciprocal;
 	state.tMax = (gridPlanes - origin) * reciprocal;
@@ -171,125 +616,584 @@ bool Scene::Setup3DDDA( const Ray& ray, DDAState& state ) const
 	return true;
 }
 
+#ifdef TWOLEVEL
+template <class Extent>
+void Scene::SetupBrickDDA( const Ray& ray, const DDAState& brick, DDAState& state, const float nudge, const Extent world ) const
+{
+	// start the voxel walk where the ray enters the brick. later bricks are entered
+	// exactly on their boundary, so clamping into the brick finds the first voxel;
+	// only the first brick gets the same nudge as Setup3DDDA.
+	const auto origin = ray.GetOrigin();
+	const auto direction = ray.GetDirection();
+	const auto reciprocal = ray.GetReciprocalDirection();
+	const float voxelSize = 1.0f / world.scale;
+	state.t = brick.t;
+	state.step = brick.step;
+	const float3 posInWorld = world.scale * (origin + (state.t + nudge) * direction);
+	const int3 brickMin = make_int3( brick.x, brick.y, brick.z ) * BRICKSIZE;
+	const int3 P = clamp( make_int3( posInWorld ), brickMin, brickMin + (BRICKSIZE - 1) );
+	state.x = P.x, state.y = P.y, state.z = P.z;
+	state.tDelta = voxelSize * float3( state.step ) * reciprocal;
+	state.tMax = ((float3( P ) + 1.0f - ray.dSign) * voxelSize - origin) * reciprocal;
+}
+
+#endif
+
+bool Scene::StepDDA( DDAState& s, const uint3& base, const uint3& size )
+{
+	// advance to the next cell; returns false once the walk leaves [base, base + size).
+	// coordinates are unsigned, so stepping below base wraps around and fails the same test.
+	if (s.tMax.x < s.tMax.y)
+	{
+		if (s.tMax.x < s.tMax.z)
+		{
+			if ((s.x += s.step.x) - base.x >= size.x) return false;
+			s.t = s.tMax.x;
+			s.tMax.x += s.tDelta.x;
+			return true;
+		}
+	}
+	else if (s.tMax.y < s.tMax.z)
+	{
+		if ((s.y += s.step.y) - base.y >= size.y) return false;
+		s.t = s.tMax.y;
+		s.tMax.y += s.tDelta.y;
+		return true;
+	}
+	if ((s.z += s.step.z) - base.z >= size.z) return false;
+	s.t = s.tMax.z;
+	s.tMax.z += s.tDelta.z;
+	return true;
+}
+
+#ifdef DISTANCEFIELD
+template <class Extent>
+bool Scene::JumpDDA( const Ray& ray, DDAState& s, const int radius, const uint3& base, const uint3& size, const Extent world ) const
+{
+	// every voxel within 'radius' of the current one is empty, so leave that
+	// cube through its nearest face and restart the walk in the next voxel
+	const auto origin = ray.GetOrigin();
+	const auto direction = ray.GetDirection();
+	const auto reciprocal = ray.GetReciprocalDirection();
+	const float voxelSize = 1.0f / world.scale;
+	const int3 cell = make_int3( s.x, s.y, s.z );
+	const float3 lo = float3( cell - radius ), hi = float3( cell + (radius + 1) );
+	const float3 planes = (ray.dSign * lo + (1.0f - ray.dSign) * hi) * voxelSize;
+	const float3 tPlanes = (planes - origin) * reciprocal;
+	const int axis = tPlanes.x < tPlanes.y ? (tPlanes.x < tPlanes.z ? 0 : 2) : (tPlanes.y < tPlanes.z ? 1 : 2);
+	s.t = max( s.t, tPlanes.cell[axis] );
+	// floor, not truncation: a ray that already left the world must not be pulled back in
+	const float3 posInWorld = floorf( world.scale * (origin + s.t * direction) );
+	int3 P = clamp( make_int3( posInWorld ), cell - radius, cell + radius );
+	P.cell[axis] = cell.cell[axis] + s.step.cell[axis] * (radius + 1);
+	s.x = P.x, s.y = P.y, s.z = P.z;
+	if (s.x - base.x >= size.x || s.y - base.y >= size.y || s.z - base.z >= size.z) return false;
+	s.tMax = ((float3( P ) + 1.0f - ray.dSign) * voxelSize - origin) * reciprocal;
+	return true;
+}
+#endif
+
+template <class Extent>
+bool Scene::NextCell( const Ray& ray, DDAState& s, const uint3& base, const uint3& size, const Extent world ) const
+{
+#ifdef DISTANCEFIELD
+	// jump over empty space when the nearest voxel is further than one step away
+	const uint distance = distanceField[VoxelIndex( s.x, s.y, s.z )];
+	if (distance > 1) return JumpDDA( ray, s, static_cast<int>(distance) - 1, base, size, world );
+#endif
+	return StepDDA( s, base, size );
+}
+
 int Scene::FindNearest(Ray& ray, HitInfo& info, int depth) const
+{
+	info.direction = ray.GetDirection();
+	info.normal = ray.GetNormal( extent.scale );
+	ushort paletteIndex;
+	const int index = FindNearestVoxel( ray, paletteIndex );
+	if (index >= 0) FillHitInfo( ray, paletteIndex, ray.length, info );
+	return index;
+}
+
+int Scene::FindNearestVoxel( Ray& ray, ushort& paletteIndex ) const
+{
+	if (tree) return FindNearestTree( ray, paletteIndex );
+#ifdef TWOLEVEL
+	if (bricks) return FindNearestStreamed( ray, paletteIndex );
+#endif
+	return WithExtent( [&]( const auto world ) { return FindNearestGrid( ray, paletteIndex, world ); } );
+}
+
+template <class Extent>
+int Scene::FindNearestGrid( Ray& ray, ushort& paletteIndex, const Extent world ) const
 {
 	int index = -1;
 	// setup Amanatides & Woo grid traversal
 	DDAState s;
-	info.direction = ray.GetDirection();
-	info.normal = ray.GetNormal();
-	
-	if (!Setup3DDDA( ray, s )) return index;
+	if (!Setup3DDDA( ray, s, world )) return index;
+#ifdef TWOLEVEL
+	// walk the bricks; only occupied bricks are entered with a voxel-level walk
+	const uint3 gridSize = make_uint3( world.x / BRICKSIZE, world.y / BRICKSIZE, world.z / BRICKSIZE );
+	float nudge = 0.00005f;
+	do
+	{
+		if (brickVoxelCount[s.x + (s.y + s.z * gridSize.y) * gridSize.x])
+		{
+			DDAState v;
+			SetupBrickDDA( ray, s, v, nudge, world );
+			const uint3 base = make_uint3( s.x, s.y, s.z ) * BRICKSIZE;
+			do
+			{
+				index = VoxelIndex( v.x, v.y, v.z );
+				if (IsSolid( index ))
+				{
+					ray.length = v.t;
+					paletteIndex = paletteIndices[index];
+					return index;
+				}
+			} while (NextCell( ray, v, base, make_uint3( BRICKSIZE ), world ));
+		}
+		nudge = 0;
+	} while (StepDDA( s, make_uint3( 0 ), gridSize ));
+	return -1;
+#else
 	// start stepping
-	while (true)
+	do
 	{
-		index = s.x + s.y * GRIDSIZE + s.z * GRIDSIZE2;
-		const auto& cell = grid[index];
+		index = VoxelIndex( s.x, s.y, s.z );
 		
-		if (Math::ValidColor(cell.color))
+		if (IsSolid( index ))
 		{
 			ray.length = s.t;
-			info.point = ray.GetIntersection();
-			info.normal = ray.GetNormal();
-			info.color = cell.color;
-			info.material = cell.material;
-			info.special = cell.special;
-			info.specialColor = cell.specialColor;
+			paletteIndex = paletteIndices[index];
 			return index;
 		}
-		
-		if (s.tMax.x < s.tMax.y)
+	} while (NextCell( ray, s, make_uint3( 0 ), make_uint3( world.x, world.y, world.z ), world ));
+	return -1;
+#endif
+	// TODO:
+	// - Perhaps s.X / s.Y / s.Z (the integer grid coordinates) can be stored in a single uint?
+	// - Loop-unrolling may speed up the while loop.
+}
+
+#ifdef USE_SIMD
+void Scene::FindNearestPacket( Ray* rays, HitRecord* hits ) const
+{
+	for (int i = 0; i < 8; i++) hits[i] = HitRecord();
+	if (tree || bricks)
+	{
+		for (int i = 0; i < 8; i++)
 		{
-			if (s.tMax.x < s.tMax.z)
-			{
-				s.t = s.tMax.x;
-				s.x += s.step.x;
-				if (s.x >= GRIDSIZE) break;
-				s.tMax.x += s.tDelta.x;
-			}
-			else
-			{
-				s.t = s.tMax.z;
-				s.z += s.step.z;
-				if (s.z >= GRIDSIZE) break;
-				s.tMax.z += s.tDelta.z;
-			}
+			ushort paletteIndex;
+			if (FindNearestVoxel( rays[i], paletteIndex ) >= 0) hits[i] = { HitType::Voxel, paletteIndex };
 		}
-		else
+		return;
+	}
+	WithExtent( [&]( const auto world ) { FindNearestPacketGrid( rays, hits, world ); } );
+}
+
+template <class Extent>
+void Scene::FindNearestPacketGrid( Ray* rays, HitRecord* hits, const Extent world ) const
+{
+
+	// per-ray setup, in voxel units so a jump or step needs no rescaling:
+	// position(t) = origin + t * direction, with t the same as for the ray itself
+	ALIGN( 32 ) int cell[3][8], step[3][8], active[8];
+	ALIGN( 32 ) float origin[3][8], direction[3][8], reciprocal[3][8], sign[3][8], tMax[3][8], t[8];
+	for (int i = 0; i < 8; i++)
+	{
+		const Ray& ray = rays[i];
+		float entry = 0;
+		active[i] = cube.Contains( ray.GetOrigin() ) || (entry = cube.Intersect( ray )) < 1e33f ? -1 : 0;
+		const float3 O = ray.GetOrigin() * world.scale, D = ray.GetDirection() * world.scale;
+		const float3 R = ray.GetReciprocalDirection() * (1.0f / world.scale);
+		const int3 P = clamp( make_int3( O + (entry + 0.00005f) * D ), make_int3( 0 ), make_int3( world.x - 1, world.y - 1, world.z - 1 ) );
+		const float3 planes = (float3( P ) + 1.0f - ray.dSign - O) * R;
+		for (int axis = 0; axis < 3; axis++)
 		{
-			if (s.tMax.y < s.tMax.z)
-			{
-				s.t = s.tMax.y;
-				s.y += s.step.y;
-				if (s.y >= GRIDSIZE) break;
-				s.tMax.y += s.tDelta.y;
-			}
-			else
+			cell[axis][i] = P.cell[axis];
+			step[axis][i] = 1 - static_cast<int>(ray.dSign.cell[axis]) * 2;
+			origin[axis][i] = O.cell[axis], direction[axis][i] = D.cell[axis], reciprocal[axis][i] = R.cell[axis];
+			sign[axis][i] = ray.dSign.cell[axis];
+			tMax[axis][i] = planes.cell[axis];
+		}
+		t[i] = entry;
+	}
+	__m256i x8 = _mm256_load_si256( (__m256i*)cell[0] ), y8 = _mm256_load_si256( (__m256i*)cell[1] ), z8 = _mm256_load_si256( (__m256i*)cell[2] );
+	const __m256i stepX8 = _mm256_load_si256( (__m256i*)step[0] ), stepY8 = _mm256_load_si256( (__m256i*)step[1] ), stepZ8 = _mm256_load_si256( (__m256i*)step[2] );
+	__m256 tMaxX8 = _mm256_load_ps( tMax[0] ), tMaxY8 = _mm256_load_ps( tMax[1] ), tMaxZ8 = _mm256_load_ps( tMax[2] );
+	const __m256 tDeltaX8 = _mm256_mul_ps( _mm256_cvtepi32_ps( stepX8 ), _mm256_load_ps( reciprocal[0] ) );
+	const __m256 tDeltaY8 = _mm256_mul_ps( _mm256_cvtepi32_ps( stepY8 ), _mm256_load_ps( reciprocal[1] ) );
+	const __m256 tDeltaZ8 = _mm256_mul_ps( _mm256_cvtepi32_ps( stepZ8 ), _mm256_load_ps( reciprocal[2] ) );
+	__m256 t8 = _mm256_load_ps( t );
+	__m256i active8 = _mm256_load_si256( (__m256i*)active );
+	__m256i hitIndex8 = _mm256_set1_epi32( -1 );
+	__m256 hitT8 = _mm256_setzero_ps();
+
+	const __m256i zero8 = _mm256_setzero_si256(), one8 = _mm256_set1_epi32( 1 );
+	const __m256i lastX8 = _mm256_set1_epi32( world.x - 1 ), lastY8 = _mm256_set1_epi32( world.y - 1 ), lastZ8 = _mm256_set1_epi32( world.z - 1 );
+	const int* alongX = reinterpret_cast<const int*>(layout.alongX.data());
+	const int* alongY = reinterpret_cast<const int*>(layout.alongY.data());
+	const int* alongZ = reinterpret_cast<const int*>(layout.alongZ.data());
+	const int* occupancy32 = reinterpret_cast<const int*>(occupancy);
+	while (!_mm256_testz_si256( active8, active8 ))
+	{
+		// test the current voxel of all active rays; rays that hit retire
+		const __m256i index8 = _mm256_add_epi32( _mm256_add_epi32(
+			_mm256_mask_i32gather_epi32( zero8, alongX, x8, active8, 4 ),
+			_mm256_mask_i32gather_epi32( zero8, alongY, y8, active8, 4 ) ),
+			_mm256_mask_i32gather_epi32( zero8, alongZ, z8, active8, 4 ) );
+		const __m256i word8 = _mm256_mask_i32gather_epi32( zero8, occupancy32, _mm256_srli_epi32( index8, 5 ), active8, 4 );
+		const __m256i bit8 = _mm256_and_si256( _mm256_srlv_epi32( word8, _mm256_and_si256( index8, _mm256_set1_epi32( 31 ) ) ), one8 );
+		const __m256i solid8 = _mm256_and_si256( _mm256_cmpeq_epi32( bit8, one8 ), active8 );
+		hitIndex8 = _mm256_blendv_epi8( hitIndex8, index8, solid8 );
+		hitT8 = _mm256_blendv_ps( hitT8, t8, _mm256_castsi256_ps( solid8 ) );
+		active8 = _mm256_andnot_si256( solid8, active8 );
+		if (_mm256_testz_si256( active8, active8 )) break;
+#ifdef DISTANCEFIELD
+		// rays far from any voxel leave their empty cube in one go, like JumpDDA
+		const __m256i distanceWord8 = _mm256_mask_i32gather_epi32( zero8, reinterpret_cast<const int*>(distanceField), _mm256_srli_epi32( index8, 2 ), active8, 4 );
+		const __m256i distance8 = _mm256_and_si256( _mm256_srlv_epi32( distanceWord8, _mm256_slli_epi32( _mm256_and_si256( index8, _mm256_set1_epi32( 3 ) ), 3 ) ), _mm256_set1_epi32( 255 ) );
+		const __m256i jump8 = _mm256_and_si256( _mm256_cmpgt_epi32( distance8, one8 ), active8 );
+		const __m256i walk8 = _mm256_andnot_si256( jump8, active8 );
+		if (!_mm256_testz_si256( jump8, jump8 ))
+		{
+			const __m256i radius8 = _mm256_sub_epi32( distance8, one8 );
+			const __m256 radius = _mm256_cvtepi32_ps( radius8 );
+			const __m256 hi = _mm256_add_ps( radius, _mm256_set1_ps( 1 ) ), width = _mm256_add_ps( _mm256_add_ps( radius, radius ), _mm256_set1_ps( 1 ) );
+			const __m256 Ox = _mm256_load_ps( origin[0] ), Oy = _mm256_load_ps( origin[1] ), Oz = _mm256_load_ps( origin[2] );
+			const __m256 Rx = _mm256_load_ps( reciprocal[0] ), Ry = _mm256_load_ps( reciprocal[1] ), Rz = _mm256_load_ps( reciprocal[2] );
+			const __m256 Sx = _mm256_load_ps( sign[0] ), Sy = _mm256_load_ps( sign[1] ), Sz = _mm256_load_ps( sign[2] );
+			// exit planes of the cube [cell - radius, cell + radius + 1)
+			const __m256 tx = _mm256_mul_ps( _mm256_sub_ps( _mm256_sub_ps( _mm256_add_ps( _mm256_cvtepi32_ps( x8 ), hi ), _mm256_mul_ps( Sx, width ) ), Ox ), Rx );
+			const __m256 ty = _mm256_mul_ps( _mm256_sub_ps( _mm256_sub_ps( _mm256_add_ps( _mm256_cvtepi32_ps( y8 ), hi ), _mm256_mul_ps( Sy, width ) ), Oy ), Ry );
+			const __m256 tz = _mm256_mul_ps( _mm256_sub_ps( _mm256_sub_ps( _mm256_add_ps( _mm256_cvtepi32_ps( z8 ), hi ), _mm256_mul_ps( Sz, width ) ), Oz ), Rz );
+			const __m256 xFirst = _mm256_cmp_ps( tx, ty, _CMP_LT_OQ );
+			const __m256 exitX = _mm256_and_ps( xFirst, _mm256_cmp_ps( tx, tz, _CMP_LT_OQ ) );
+			const __m256 exitY = _mm256_andnot_ps( xFirst, _mm256_cmp_ps( ty, tz, _CMP_LT_OQ ) );
+			const __m256 exitZ = _mm256_xor_ps( _mm256_or_ps( exitX, exitY ), _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) ) );
+			const __m256 tExit = _mm256_blendv_ps( _mm256_blendv_ps( tz, ty, exitY ), tx, exitX );
+			const __m256 tNew = _mm256_max_ps( t8, tExit );
+			// the exit axis moves into the next voxel, the other axes follow the ray inside the cube
+			const auto Enter = [&]( const __m256i c8, const __m256i step8, const __m256 O, const __m256 D, const __m256 exit )
 			{
-				s.t = s.tMax.z;
-				s.z += s.step.z;
-				if (s.z >= GRIDSIZE) break;
-				s.tMax.z += s.tDelta.z;
-			}
+				const __m256i inside = _mm256_cvtps_epi32( _mm256_floor_ps( _mm256_add_ps( O, _mm256_mul_ps( tNew, D ) ) ) );
+				const __m256i clamped = _mm256_min_epi32( _mm256_max_epi32( inside, _mm256_sub_epi32( c8, radius8 ) ), _mm256_add_epi32( c8, radius8 ) );
+				const __m256i next = _mm256_add_epi32( c8, _mm256_mullo_epi32( step8, _mm256_add_epi32( radius8, one8 ) ) );
+				return _mm256_blendv_epi8( c8, _mm256_blendv_epi8( clamped, next, _mm256_castps_si256( exit ) ), jump8 );
+			};
+			x8 = Enter( x8, stepX8, Ox, _mm256_load_ps( direction[0] ), exitX );
+			y8 = Enter( y8, stepY8, Oy, _mm256_load_ps( direction[1] ), exitY );
+			z8 = Enter( z8, stepZ8, Oz, _mm256_load_ps( direction[2] ), exitZ );
+			t8 = _mm256_blendv_ps( t8, tNew, _mm256_castsi256_ps( jump8 ) );
+			const __m256 one = _mm256_set1_ps( 1 ), jump = _mm256_castsi256_ps( jump8 );
+			tMaxX8 = _mm256_blendv_ps( tMaxX8, _mm256_mul_ps( _mm256_sub_ps( _mm256_sub_ps( _mm256_add_ps( _mm256_cvtepi32_ps( x8 ), one ), Sx ), Ox ), Rx ), jump );
+			tMaxY8 = _mm256_blendv_ps( tMaxY8, _mm256_mul_ps( _mm256_sub_ps( _mm256_sub_ps( _mm256_add_ps( _mm256_cvtepi32_ps( y8 ), one ), Sy ), Oy ), Ry ), jump );
+			tMaxZ8 = _mm256_blendv_ps( tMaxZ8, _mm256_mul_ps( _mm256_sub_ps( _mm256_sub_ps( _mm256_add_ps( _mm256_cvtepi32_ps( z8 ), one ), Sz ), Oz ), Rz ), jump );
 		}
+#else
+		const __m256i walk8 = active8;
+#endif
+		// masked amanatides & woo step, same axis choice as StepDDA
+		const __m256 walk = _mm256_castsi256_ps( walk8 );
+		const __m256 xBeforeY = _mm256_cmp_ps( tMaxX8, tMaxY8, _CMP_LT_OQ );
+		const __m256 stepX = _mm256_and_ps( _mm256_and_ps( xBeforeY, _mm256_cmp_ps( tMaxX8, tMaxZ8, _CMP_LT_OQ ) ), walk );
+		const __m256 stepY = _mm256_and_ps( _mm256_andnot_ps( xBeforeY, _mm256_cmp_ps( tMaxY8, tMaxZ8, _CMP_LT_OQ ) ), walk );
+		const __m256 stepZ = _mm256_andnot_ps( _mm256_or_ps( stepX, stepY ), walk );
+		x8 = _mm256_add_epi32( x8, _mm256_and_si256( stepX8, _mm256_castps_si256( stepX ) ) );
+		y8 = _mm256_add_epi32( y8, _mm256_and_si256( stepY8, _mm256_castps_si256( stepY ) ) );
+		z8 = _mm256_add_epi32( z8, _mm256_and_si256( stepZ8, _mm256_castps_si256( stepZ ) ) );
+		t8 = _mm256_blendv_ps( _mm256_blendv_ps( _mm256_blendv_ps( t8, tMaxZ8, stepZ ), tMaxY8, stepY ), tMaxX8, stepX );
+		tMaxX8 = _mm256_add_ps( tMaxX8, _mm256_and_ps( tDeltaX8, stepX ) );
+		tMaxY8 = _mm256_add_ps( tMaxY8, _mm256_and_ps( tDeltaY8, stepY ) );
+		tMaxZ8 = _mm256_add_ps( tMaxZ8, _mm256_and_ps( tDeltaZ8, stepZ ) );
+
+		// rays that left the world retire without a hit
+		const __m256i outside8 = _mm256_or_si256( _mm256_or_si256(
+			_mm256_or_si256( _mm256_cmpgt_epi32( zero8, x8 ), _mm256_cmpgt_epi32( x8, lastX8 ) ),
+			_mm256_or_si256( _mm256_cmpgt_epi32( zero8, y8 ), _mm256_cmpgt_epi32( y8, lastY8 ) ) ),
+			_mm256_or_si256( _mm256_cmpgt_epi32( zero8, z8 ), _mm256_cmpgt_epi32( z8, lastZ8 ) ) );
+		active8 = _mm256_andnot_si256( outside8, active8 );
+	}
+
+	ALIGN( 32 ) int hitIndex[8];
+	ALIGN( 32 ) float hitT[8];
+	_mm256_store_si256( (__m256i*)hitIndex, hitIndex8 );
+	_mm256_store_ps( hitT, hitT8 );
+	for (int i = 0; i < 8; i++)
+	{
+		if (hitIndex[i] < 0) continue;
+		rays[i].length = hitT[i];
+		hits[i] = { HitType::Voxel, paletteIndices[hitIndex[i]] };
 	}
-	
-	return index;
-	// TODO:
-	// - A nested grid will let rays skip empty space much faster.
-	// - Coherent rays can traverse the grid faster together.
-	// - Perhaps s.X / s.Y / s.Z (the integer grid coordinates) can be stored in a single uint?
-	// - Loop-unrolling may speed up the while loop.
 }
+#endif
 
 bool Scene::IsOccluded( const Ray& ray ) const
+{
+	if (tree) return IsOccludedTree( ray );
+#ifdef TWOLEVEL
+	if (bricks) return IsOccludedStreamed( ray );
+#endif
+	return WithExtent( [&]( const auto world ) { return IsOccludedGrid( ray, world ); } );
+}
+
+template <class Extent>
+bool Scene::IsOccludedGrid( const Ray& ray, const Extent world ) const
 {
 	// setup Amanatides & Woo grid traversal
 	DDAState s;
-	if (!Setup3DDDA( ray, s )) return false;
+	if (!Setup3DDDA( ray, s, world )) return false;
 	
+#ifdef TWOLEVEL
+	const uint3 gridSize = make_uint3( world.x / BRICKSIZE, world.y / BRICKSIZE, world.z / BRICKSIZE );
+	float nudge = 0.00005f;
+	do
+	{
+		if (brickVoxelCount[s.x + (s.y + s.z * gridSize.y) * gridSize.x])
+		{
+			DDAState v;
+			SetupBrickDDA( ray, s, v, nudge, world );
+			const uint3 base = make_uint3( s.x, s.y, s.z ) * BRICKSIZE;
+			do
+			{
+				if (v.t >= ray.length) return false;
+				// if we hit a non-empty cell, the ray is occluded
+				if (IsSolid( VoxelIndex( v.x, v.y, v.z ) )) return true;
+			} while (NextCell( ray, v, base, make_uint3( BRICKSIZE ), world ));
+		}
+		nudge = 0;
+	} while (s.t < ray.length && StepDDA( s, make_uint3( 0 ), gridSize ));
+	return false;
+#else
 	// start stepping
-	while (s.t < ray.length)
+	do
 	{
+		if (s.t >= ray.length) return false;
 		// if we hit a non-empty cell, the ray is occluded
-		const auto color = grid[s.x + s.y * GRIDSIZE + s.z * GRIDSIZE2].color;
-		if (Math::ValidColor(color))  return s.t < ray.length;
-		
-		if (s.tMax.x < s.tMax.y)
+		if (IsSolid( VoxelIndex( s.x, s.y, s.z ) )) return true;
+	} while (NextCell( ray, s, make_uint3( 0 ), make_uint3( world.x, world.y, world.z ), world ));
+	return false;
+#endif
+}
+
+int Scene::FindNearestTree( Ray& ray, ushort& paletteIndex ) const
+{
+	// same world entry as Setup3DDDA; the tree skips empty space from there
+	float t = 0;
+	if (!cube.Contains( ray.GetOrigin() ) && (t = cube.Intersect( ray )) > 1e33f) return -1;
+	uint3 voxel;
+	float tHit;
+	paletteIndex = tree->Intersect( ray, t, 1e34f, voxel, tHit );
+	if (!paletteIndex) return -1;
+	ray.length = tHit;
+	return VoxelIndex( voxel.x, voxel.y, voxel.z );
+}
+
+bool Scene::IsOccludedTree( const Ray& ray ) const
+{
+	float t = 0;
+	if (!cube.Contains( ray.GetOrigin() ) && (t = cube.Intersect( ray )) > 1e33f) return false;
+	uint3 voxel;
+	float tHit;
+	return tree->Intersect( ray, t, ray.length, voxel, tHit ) != 0;
+}
+
+#ifdef TWOLEVEL
+int Scene::FindNearestStreamed( Ray& ray, ushort& paletteIndex ) const
+{
+	// the brick walk of FindNearestGrid. occupied bricks are read from the store, which
+	// maps their chunk on first use; empty bricks are skipped using the summary alone.
+	DDAState s;
+	if (!Setup3DDDA( ray, s, extent )) return -1;
+	const uint3 gridSize = make_uint3( extent.x / BRICKSIZE, extent.y / BRICKSIZE, extent.z / BRICKSIZE );
+	float nudge = 0.00005f;
+	do
+	{
+		const uint brickIndex = s.x + (s.y + s.z * gridSize.y) * gridSize.x;
+		if (brickVoxelCount[brickIndex])
 		{
-			if (s.tMax.x < s.tMax.z)
-			{
-				if ((s.x += s.step.x) >= GRIDSIZE) return false;
-				s.t = s.tMax.x;
-				s.tMax.x += s.tDelta.x;
-			}
-			else
+			const StreamedBrick* brick = bricks->Brick( brickIndex );
+			DDAState v;
+			SetupBrickDDA( ray, s, v, nudge, extent );
+			const uint3 base = make_uint3( s.x, s.y, s.z ) * BRICKSIZE;
+			do
 			{
-				if ((s.z += s.step.z) >= GRIDSIZE) return false;
-				s.t = s.tMax.z;
-				s.tMax.z += s.tDelta.z;
-			}
+				const uint index = VoxelIndex( v.x, v.y, v.z ), voxel = index & (BRICKSIZE3 - 1);
+				if (brick->occupancy[voxel >> 6] >> (voxel & 63) & 1)
+				{
+					ray.length = v.t;
+					paletteIndex = brick->paletteIndices[voxel];
+					return static_cast<int>(index);
+				}
+			} while (StepDDA( v, base, make_uint3( BRICKSIZE ) ));
 		}
-		else
+		nudge = 0;
+	} while (StepDDA( s, make_uint3( 0 ), gridSize ));
+	return -1;
+}
+
+bool Scene::IsOccludedStreamed( const Ray& ray ) const
+{
+	DDAState s;
+	if (!Setup3DDDA( ray, s, extent )) return false;
+	const uint3 gridSize = make_uint3( extent.x / BRICKSIZE, extent.y / BRICKSIZE, extent.z / BRICKSIZE );
+	float nudge = 0.00005f;
+	do
+	{
+		const uint brickIndex = s.x + (s.y + s.z * gridSize.y) * gridSize.x;
+		if (brickVoxelCount[brickIndex])
 		{
-			if (s.tMax.y < s.tMax.z)
-			{
-				if ((s.y += s.step.y) >= GRIDSIZE) return false;
-				s.t = s.tMax.y;
-				s.tMax.y += s.tDelta.y;
-			}
-			else
+			const StreamedBrick* brick = bricks->Brick( brickIndex );
+			DDAState v;
+			SetupBrickDDA( ray, s, v, nudge, extent );
+			const uint3 base = make_uint3( s.x, s.y, s.z ) * BRICKSIZE;
+			do
 			{
-				if ((s.z += s.step.z) >= GRIDSIZE) return false;
-				s.t = s.tMax.z;
-				s.tMax.z += s.tDelta.z;
-			}
+				if (v.t >= ray.length) return false;
+				const uint voxel = VoxelIndex( v.x, v.y, v.z ) & (BRICKSIZE3 - 1);
+				if (brick->occupancy[voxel >> 6] >> (voxel & 63) & 1) return true;
+			} while (StepDDA( v, base, make_uint3( BRICKSIZE ) ));
 		}
-	}
+		nudge = 0;
+	} while (s.t < ray.length && StepDDA( s, make_uint3( 0 ), gridSize ));
 	return false;
 }
+#endif
 
+#ifdef DISTANCEFIELD
+static void NearestAlongLine( const uchar* in, uchar* out, const int count )
+{
+	// out[i] = min over k of max( |k|, in[i + k] ); offsets beyond the current best cannot improve it.
+	// 'near' counts the values below MAXDISTANCE within reach, so open space is settled at once.
+	int near = 0;
+	for (int i = 0; i < min( count, MAXDISTANCE - 1 ); i++) near += in[i] < MAXDISTANCE;
+	for (int i = 0; i < count; i++)
+	{
+		if (i + MAXDISTANCE - 1 < count) near += in[i + MAXDISTANCE - 1] < MAXDISTANCE;
+		if (i >= MAXDISTANCE) near -= in[i - MAXDISTANCE] < MAXDISTANCE;
+		if (!near)
+		{
+			out[i] = MAXDISTANCE;
+			continue;
+		}
+		int best = in[i];
+		for (int k = 1; k < best; k++)
+		{
+			if (i >= k && in[i - k] < best) best = max( k, static_cast<int>(in[i - k]) );
+			if (i + k < count && in[i + k] < best) best = max( k, static_cast<int>(in[i + k]) );
+		}
+		out[i] = static_cast<uchar>(best);
+	}
+}
 
+void Scene::BuildDistanceField()
+{
+	distanceField = static_cast<uchar*>(MALLOC64(static_cast<size_t>(extent.x) * extent.y * extent.z));
+	RefreshDistanceField( make_int3( 0 ), make_int3( extent.x - 1, extent.y - 1, extent.z - 1 ) );
+}
 
+void Scene::AddToDistanceField( const uint x, const uint y, const uint z ) const
+{
+	const int3 P = make_int3( x, y, z );
+	const int3 lo = max( P - (MAXDISTANCE - 1), make_int3( 0 ) ), hi = min( P + (MAXDISTANCE - 1), make_int3( extent.x - 1, extent.y - 1, extent.z - 1 ) );
+	for (int z1 = lo.z; z1 <= hi.z; z1++) for (int y1 = lo.y; y1 <= hi.y; y1++) for (int x1 = lo.x; x1 <= hi.x; x1++)
+	{
+		const int distance = max( max( abs( x1 - P.x ), abs( y1 - P.y ) ), abs( z1 - P.z ) );
+		uchar& cell = distanceField[VoxelIndex( x1, y1, z1 )];
+		cell = static_cast<uchar>(min( static_cast<int>(cell), distance ));
+	}
+}
 
+void Scene::RefreshDistanceField( const int3 lo, const int3 hi ) const
+{
+	// the Chebyshev distance separates per axis: the distance to the nearest voxel in each
+	// row along x, then the nearest of those along y, then along z. only occupancy within
+	// MAXDISTANCE - 1 of [lo, hi] is read and only [lo, hi] is written, so boxes that do not
+	// overlap can be refreshed at the same time. lines run in parallel unless the caller
+	// already is a parallel loop.
+	const int reach = MAXDISTANCE - 1;
+	const int3 from = max( lo - reach, make_int3( 0 ) ), to = min( hi + reach, make_int3( extent.x - 1, extent.y - 1, extent.z - 1 ) );
+	const int3 n = to - from + make_int3( 1 );
+	vector<uchar> field( static_cast<size_t>(n.x) * n.y * n.z ); // x-major over [from, to]
+	const auto at = [&]( const int x, const int y, const int z ) -> uchar&
+	{
+		return field[(x - from.x) + ((y - from.y) + static_cast<size_t>(z - from.z) * n.y) * n.x];
+	};
+#pragma omp parallel for schedule(dynamic)
+	for (int line = 0; line < n.y * n.z; line++)
+	{
+		const int y = from.y + line % n.y, z = from.z + line / n.y;
+		uchar* row = &at( from.x, y, z );
+		int distance = MAXDISTANCE;
+		for (int x = 0; x < n.x; x++)
+			row[x] = static_cast<uchar>(distance = IsSolid( VoxelIndex( from.x + x, y, z ) ) ? 0 : min( distance + 1, MAXDISTANCE ));
+		distance = MAXDISTANCE;
+		for (int x = n.x - 1; x >= 0; x--) row[x] = static_cast<uchar>(distance = min( static_cast<int>(row[x]), distance + 1 ));
+	}
+	// the y pass only needs the columns above and below the box, the z pass only the box
+#pragma omp parallel for schedule(dynamic)
+	for (int z = from.z; z <= to.z; z++)
+	{
+		vector<uchar> in( n.y ), out( n.y );
+		for (int x = lo.x; x <= hi.x; x++)
+		{
+			for (int y = from.y; y <= to.y; y++) in[y - from.y] = at( x, y, z );
+			NearestAlongLine( in.data(), out.data(), n.y );
+			for (int y = lo.y; y <= hi.y; y++) at( x, y, z ) = out[y - from.y];
+		}
+	}
+#pragma omp parallel for schedule(dynamic)
+	for (int y = lo.y; y <= hi.y; y++)
+	{
+		vector<uchar> in( n.z ), out( n.z );
+		for (int x = lo.x; x <= hi.x; x++)
+		{
+			for (int z = from.z; z <= to.z; z++) in[z - from.z] = at( x, y, z );
+			NearestAlongLine( in.data(), out.data(), n.z );
+			for (int z = lo.z; z <= hi.z; z++) distanceField[VoxelIndex( x, y, z )] = out[z - from.z];
+		}
+	}
+}
 
+void Scene::RefreshDistanceField( const vector<DirtyBrick>& changed ) const
+{
+	// a filled or emptied voxel changes distances up to MAXDISTANCE - 1 away. the boxes around
+	// changed bricks are merged per 64^3 block, and the blocks are refreshed in parallel.
+	constexpr int BlockSize = 64;
+	const int3 last = make_int3( extent.x - 1, extent.y - 1, extent.z - 1 );
+	const int blocksX = last.x / BlockSize + 1, blocksY = last.y / BlockSize + 1;
+	std::unordered_map<int, std::pair<int3, int3>> blocks;
+	for (const DirtyBrick& brick : changed)
+	{
+		if (!(brick.changes & OccupancyChanged)) continue;
+		const int3 first = make_int3( VoxelCoordinates( brick.index * VoxelLayout::TileVoxels ) );
+		const int3 lo = max( first - (MAXDISTANCE - 1), make_int3( 0 ) );
+		const int3 hi = min( first + (static_cast<int>(VoxelLayout::TileSize) - 1 + MAXDISTANCE - 1), last );
+		for (int bz = lo.z / BlockSize; bz <= hi.z / BlockSize; bz++)
+			for (int by = lo.y / BlockSize; by <= hi.y / BlockSize; by++)
+				for (int bx = lo.x / BlockSize; bx <= hi.x / BlockSize; bx++)
+				{
+					const int3 blockLo = make_int3( bx, by, bz ) * BlockSize;
+					const int3 boxLo = max( lo, blockLo ), boxHi = min( hi, blockLo + (BlockSize - 1) );
+					const auto [box, added] = blocks.try_emplace( bx + (by + bz * blocksY) * blocksX, boxLo, boxHi );
+					if (!added) box->second = { min( box->second.first, boxLo ), max( box->second.second, boxHi ) };
+				}
+	}
+	vector<std::pair<int3, int3>> boxes;
+	size_t volume = 0;
+	for (const auto& block : blocks)
+	{
+		boxes.push_back( block.second );
+		const int3 size = block.second.second - block.second.first + make_int3( 1 );
+		volume += static_cast<size_t>(size.x) * size.y * size.z;
+	}
+	// a box also reads a margin around itself, so many scattered edits are cheaper as one pass
+	if (volume * 2 > static_cast<size_t>(extent.x) * extent.y * extent.z)
+	{
+		RefreshDistanceField( make_int3( 0 ), last );
+		return;
+	}
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < static_cast<int>(boxes.size()); i++) RefreshDistanceField( boxes[i].first, boxes[i].second );
+}
+#endif
@@ -1,51 +1,98 @@
 #pragma once
 
 // high level settings
-// #define TWOLEVEL
-#define VOXELAMOUNT 16 // power of 2. Warning: max 512 for a 512x512x512x4 bytes = 512MB world!
-// #define USE_SIMD
+#define TWOLEVEL
+#define DISTANCEFIELD
+#define VOXELAMOUNT 16 // size of the default world; a voxel costs 1 bit + a 2-byte palette index
+#define WORLDFILE "world.voxels" // written by the Save World button, loaded with Scene( WORLDFILE )
+#define MESHFILE "assets/mesh.obj" // Wavefront OBJ placed in the world by the Load Mesh button
+#define USE_SIMD // AVX2 ray packets for primary rays
+#define TILESIZE 32 // screen tiles are the render jobs; a multiple of 8, the packet width
+#define RUSSIANROULETTE 3 // paths that have bounced this often end at random when dim; comment out to always reach maxDepth
+// #define WAVEFRONT // trace all paths of a frame stage by stage, from structure-of-arrays queues
+#define SPHEREBVH4 // 4-wide sphere BVH: one SSE test covers four child boxes or four spheres
+#define SPHEREREBUILDCOST 1.5f // a refitted sphere BVH is rebuilt in the background past this SAH cost, relative to its build
+// #define SPHEREBVHQUANTIZED // without SPHEREBVH4: trace 16-byte sphere BVH nodes with 8-bit child boxes, for scenes that do not fit in cache
+// #define SPHERELBVH // build sphere BVHs from Morton codes: much faster for 1M+ spheres, somewhat slower to trace
 // #define USE_FMA3
 // #define SKYDOME
 // #define WHITTED
 // #define DOF
 
 // low-level / derived
-#define VOXELAMOUNT2	(VOXELAMOUNT * VOXELAMOUNT)
-
 
+// worlds are sized at run time (see WorldExtent). every axis must be a multiple of 8,
+// the storage tile size of voxels/voxelLayout.h; the longest axis spans one world unit.
 #ifdef TWOLEVEL
-// feel free to replace with whatever suits your two-level implementation,
-// should you chose this challenge.
+// the top-level grid stores one voxel count per 8x8x8 brick, so the DDA can
+// jump over empty bricks and only walks single voxels inside occupied ones.
 #define BRICKSIZE	8
 #define BRICKSIZE2	(BRICKSIZE*BRICKSIZE)
 #define BRICKSIZE3	(BRICKSIZE*BRICKSIZE*BRICKSIZE) 
-#define GRIDSIZE	(WORLDSIZE/BRICKSIZE)
-#define VOXELSIZE	(1.0f/WORLDSIZE)
+#define GRIDCELLSIZE	BRICKSIZE // voxels per top-level grid cell along an axis
+// streamed worlds (VoxelStructure::Streamed) keep their bricks in this file and map
+// at most this many bytes of it at the end of a frame. a new scene replaces the file;
+// only Scene( Scene::ReopenBrickStore() ) continues the world that is in it
+#define BRICKSTOREFILE	"world.bricks"
+#define BRICKSTOREBUDGET	(256ull << 20)
 #else
-#define GRIDSIZE	VOXELAMOUNT
+#define GRIDCELLSIZE	1
+#endif
+#ifdef DISTANCEFIELD
+// every empty voxel stores the Chebyshev distance to the nearest filled voxel, so the
+// DDA can skip that many voxels at once. distances are clamped to keep edits local.
+#define MAXDISTANCE	16
 #endif
-#define GRIDSIZE2	(GRIDSIZE*GRIDSIZE)
-#define GRIDSIZE3	(GRIDSIZE*GRIDSIZE*GRIDSIZE)
+
+#include <functional>
+#include <future>
 
 #include "lights/skydome.h"
 #include "primitives/sphere.h"
+#include "primitives/tlas.h"
+#include "voxels/voxelLayout.h"
 
 class SpecialLights;
 class BVHSphere;
+class BVH4Sphere;
+#ifdef SPHEREBVH4
+using SphereBVH = BVH4Sphere;
+#else
+using SphereBVH = BVHSphere;
+#endif
+class BrickStore;
+class Mesh;
+class Tree64;
 class MaterialManager;
 class LightManager;
 class UIManager;
 
-struct VoxelData
-{
-    Material material;
-    uint color = 0;
-    uint specialColor = 0;
-    bool special = false;
-};
-
 namespace Tmpl8
 {
+    // storage for the voxel world, chosen when the scene is constructed
+    enum class VoxelStructure
+    {
+        Grid, // flat grid (with bricks when TWOLEVEL is defined)
+        Tree64, // sparse 64-tree, memory scales with the number of filled voxels
+        Streamed // bricks paged in from a memory-mapped file on demand (requires TWOLEVEL)
+    };
+
+    // voxel dimensions of a world and the number of voxels per world unit. the traversal
+    // code is templated on the extent type: common world sizes run with the bounds as
+    // compile-time constants (FixedExtent), other sizes read them from the scene.
+    struct WorldExtent
+    {
+        uint x, y, z;
+        float scale;
+    };
+
+    template <uint X, uint Y, uint Z>
+    struct FixedExtent
+    {
+        static constexpr uint x = X, y = Y, z = Z;
+        static constexpr float scale = static_cast<float>(X > Y ? (X > Z ? X : Z) : (Y > Z ? Y : Z));
+    };
+
     class Cube
     {
     public:
@@ -68,24 +115,170 @@ namespace Tmpl8
             float3 tMax;
         };
 
-        Scene();
+        // what an edit changed in a brick (an 8x8x8 storage tile) since the last ApplyChanges
+        enum BrickChange : uchar
+        {
+            OccupancyChanged = 1, // a voxel was filled or emptied
+            AppearanceChanged = 2 // a voxel only changed palette entry
+        };
+
+        struct DirtyBrick
+        {
+            uint index; // storage tile index, as for brickVoxelCount
+            uchar changes; // BrickChange flags
+        };
+
+        using ChangeListener = std::function<void(const vector<DirtyBrick>&)>;
+
+        explicit Scene(const uint3& size = make_uint3(VOXELAMOUNT), VoxelStructure structure = VoxelStructure::Grid);
+        // loads a world saved with WorldFile::Save
+        explicit Scene(const char* worldFile, VoxelStructure structure = VoxelStructure::Grid);
+        // a streamed scene over the bricks and palette an earlier session left in BRICKSTOREFILE
+        struct ReopenBrickStore {};
+        explicit Scene(ReopenBrickStore);
+        // frees the voxel storage, the managers, the spheres and meshes, and waits for a
+        // pending sphere rebuild; a scene owns all of them, so it cannot be copied
+        ~Scene();
+        Scene(const Scene&) = delete;
+        Scene& operator=(const Scene&) = delete;
+        // voxel indices (FindNearest, Get, Set, specialVoxels) are in storage order
+        [[nodiscard]] uint VoxelIndex(uint x, uint y, uint z) const;
+        [[nodiscard]] uint3 VoxelCoordinates(uint index) const;
         [[nodiscard]] int GetHitVoxelIndex(Ray& ray) const;
         int FindNearest(Ray& ray, HitInfo& info, int depth) const;
+        // the voxel search alone: sets ray.length and the palette index of the hit voxel,
+        // and leaves the rest of the hit to FillHitInfo
+        int FindNearestVoxel(Ray& ray, ushort& paletteIndex) const;
+        void FillHitInfo(Ray& ray, ushort paletteIndex, float t, HitInfo& info) const;
+#ifdef USE_SIMD
+        // FindNearestVoxel for 8 coherent rays at once, walked together with AVX2; every
+        // record is set, to a voxel hit or to HitType::None
+        void FindNearestPacket(Ray* rays, HitRecord* hits) const;
+#endif
         [[nodiscard]] bool IsOccluded(const Ray& ray) const;
-        void Set(const uint x, const uint y, const uint z, const VoxelData& data) const;
-        VoxelData* grid;
+        void Set(const uint x, const uint y, const uint z, const VoxelData& data);
+        void Set(uint index, const VoxelData& data);
+        [[nodiscard]] VoxelData Get(uint index) const;
+        // bulk access to the palette indices of one storage tile (8x8x8 voxels), in storage
+        // order. SetBrick is for bulk loads: it is not tracked as a change and leaves the
+        // distance field alone; tiles can be set from several threads at once, except in a Tree64.
+        void GetBrick(uint brickIndex, ushort* brickPaletteIndices) const;
+        void SetBrick(uint brickIndex, const ushort* brickPaletteIndices);
+        [[nodiscard]] size_t VoxelMemoryUsage() const;
+        // Set records the bricks it changes. ApplyChanges runs between frames: it refreshes
+        // the distance field around changed bricks in parallel, then passes the list to every
+        // subscriber, so derived structures can update only what changed.
+        // ApplyChanges also brings the traced spheres up to date and refreshes the TLAS, and
+        // returns whether rays can hit anything different from the previous frame: voxels,
+        // spheres, or the set of meshes.
+        void Subscribe(ChangeListener listener);
+        bool ApplyChanges();
+        // sphere edits only touch spheres; rays are traced against bvhSpheres, which is
+        // built over a copy of them that only ApplyChanges replaces, so a frame never sees
+        // a half-built tree. call SpheresEdited after changing centers, radii or colors:
+        // the next ApplyChanges copies them and refits, and starts a background rebuild
+        // past SPHEREREBUILDCOST. call SpheresChanged after adding or removing spheres: the
+        // tree is rebuilt in the background and swapped in by the first ApplyChanges after
+        // it is done; until then the old spheres are traced.
+        void SpheresEdited();
+        void SpheresChanged();
+        VoxelStructure structure;
+        WorldExtent extent;
+        VoxelLayout::Offsets layout; // per-axis storage offsets for VoxelIndex
+        // the grid is split in two arrays: one occupancy bit per voxel for traversal
+        // and a palette index into MaterialManager for shading
+        uint64* occupancy = nullptr;
+        ushort* paletteIndices = nullptr;
+        Tree64* tree = nullptr;
+        BrickStore* bricks = nullptr; // for streamed worlds; brickVoxelCount then points into its summary
+#ifdef TWOLEVEL
+        ushort* brickVoxelCount = nullptr; // number of non-empty voxels per brick
+#endif
+#ifdef DISTANCEFIELD
+        uchar* distanceField = nullptr; // capped Chebyshev distance to the nearest voxel
+#endif
         Cube cube;
         float size;
         LightManager* lightManager;
         UIManager* uiManager;
         MaterialManager* materialManager;
         Skydome skydome;
-        vector<Sphere*> spheres;
-        BVHSphere* bvhSpheres;
+        SphereSet* spheres; // the editable spheres
+        SphereBVH* bvhSpheres; // the traced spheres
+        vector<Mesh*> meshes; // in world space; the TLAS picks up changes in ApplyChanges
+        TLAS tlas; // closest hit over the voxels, the spheres and the meshes
         vector<uint> specialVoxels;
-        SpecialLights* specialLights;
+        SpecialLights* specialLights = nullptr;
 
     private:
-        bool Setup3DDDA(const Ray& ray, DDAState& state) const;
+        enum class WorldSource
+        {
+            Generate, // fill the world procedurally
+            WorldFile, // left empty for WorldFile::Load
+            BrickStore // the voxels are already in BRICKSTOREFILE
+        };
+
+        Scene(const uint3& size, VoxelStructure structure, WorldSource source);
+        // pads specialVoxels to the six the game cycles through; source names the world in errors
+        void CompleteSpecialVoxels(const char* source);
+
+        // the common world sizes that get their own compiled traversal code
+        enum class CommonExtent
+        {
+            None,
+            Cube16,
+            Cube64,
+            Cube128,
+            Cube256,
+            Terrain1024x128
+        };
+
+        template <class F> auto WithExtent(F&& f) const;
+        template <class Extent> int FindNearestGrid(Ray& ray, ushort& paletteIndex, Extent world) const;
+        template <class Extent> bool IsOccludedGrid(const Ray& ray, Extent world) const;
+#ifdef USE_SIMD
+        template <class Extent> void FindNearestPacketGrid(Ray* rays, HitRecord* hits, Extent world) const;
+#endif
+        [[nodiscard]] bool IsSolid(const uint index) const { return occupancy[index >> 6] >> (index & 63) & 1; }
+        template <class Extent> bool Setup3DDDA(const Ray& ray, DDAState& state, Extent world) const;
+        int FindNearestTree(Ray& ray, ushort& paletteIndex) const;
+        [[nodiscard]] bool IsOccludedTree(const Ray& ray) const;
+#ifdef TWOLEVEL
+        int FindNearestStreamed(Ray& ray, ushort& paletteIndex) const;
+        [[nodiscard]] bool IsOccludedStreamed(const Ray& ray) const;
+#endif
+#ifdef TWOLEVEL
+        template <class Extent> void SetupBrickDDA(const Ray& ray, const DDAState& brick, DDAState& state, float nudge, Extent world) const;
+#endif
+        static bool StepDDA(DDAState& state, const uint3& base, const uint3& size);
+        template <class Extent> bool NextCell(const Ray& ray, DDAState& state, const uint3& base, const uint3& size, Extent world) const;
+#ifdef DISTANCEFIELD
+        template <class Extent> bool JumpDDA(const Ray& ray, DDAState& state, int radius, const uint3& base, const uint3& size, Extent world) const;
+        void BuildDistanceField();
+        void AddToDistanceField(uint x, uint y, uint z) const;
+        void RefreshDistanceField(int3 lo, int3 hi) const;
+        void RefreshDistanceField(const vector<DirtyBrick>& changed) const;
+#endif
+
+        void MarkChanged(uint brickIndex, uchar change);
+        bool ApplySphereChanges(); // whether the traced spheres changed
+        void StartSphereRebuild();
+
+        CommonExtent commonExtent = CommonExtent::None;
+        vector<uchar> brickChanges; // pending BrickChange flags per brick
+        vector<uint> dirtyBricks; // bricks with pending changes, in the order they were first changed
+        vector<ChangeListener> listeners;
+        // a sphere BVH and the copy of the spheres it indexes, built on a worker
+        struct SphereRebuild
+        {
+            SphereSet* spheres;
+            SphereBVH* bvh;
+            uint version; // sphereVersion when the copy was taken
+        };
+
+        SphereSet* tracedSpheres = nullptr; // the copy bvhSpheres indexes
+        uint sphereVersion = 0, tracedVersion = 0; // counts SpheresChanged calls
+        bool spheresEdited = false;
+        std::future<SphereRebuild> sphereRebuild;
     };
 }
@@ -1,9 +1,13 @@
 ﻿#include "precomp.h"
 #include "uiManager.h"
 
+#include "benchmarks/benchmarks.h"
 #include "game/specialLights.h"
 #include "lights/lightManager.h"
 #include "primitives/bvh.h"
+#include "primitives/bvh4.h"
+#include "primitives/mesh.h"
+#include "voxels/worldFile.h"
 
 
 void UIManager::HandleAllUI(float deltaTime, Camera& camera)
@@ -11,6 +15,7 @@ void UIManager::HandleAllUI(float deltaTime, Camera& camera)
     HandleRenderUI(deltaTime);
     HandleCameraUI(camera);
     HandleSphereUI();
+    HandleMeshUI();
     HandleLightingUI();
     HandleSkydomeUI();
 }
@@ -47,28 +52,71 @@ void UIManager::HandleSphereUI()
         break;
     }
     
+    SphereSet& spheres = *scene->spheres;
     if (ImGui::Button("Add Sphere"))
     {
-        scene->spheres.emplace_back(new Sphere{ float3(0.0f), 0.2f, material, 0xffffff });
-        delete scene->bvhSpheres;
-        scene->bvhSpheres = new BVHSphere(scene->spheres);
+        spheres.Add(float3(0.0f), 0.2f, material, 0xffffff);
+        scene->SpheresChanged();
     }
-    for (int i = 0; i < scene->spheres.size(); i++)
+    // widgets are keyed by handle slot, so a removal does not hand one sphere's
+    // widget state to the sphere moved into its place
+    for (uint i = 0; i < spheres.Count(); i++)
     {
-        const auto& sphere = scene->spheres[i];
-        ImGui::PushID(i);
-        ImGui::Text("Sphere %d", i);
-        ImGui::DragFloat3("Sphere Center", &sphere->center.x, 0.1f, -10.0f, 10.0f);
-        ImGui::DragFloat("Sphere Radius", &sphere->radius, 0.1f, -10.0f, 10.0f);
-        auto& color = sphere->color;
-        float3 colorVec = Math::GetColorNormalised(color);
-        ImGui::ColorEdit3("Sphere Color", &colorVec.x);
-        color = Math::GetColor(colorVec);
+        const SphereHandle handle = spheres.HandleAt(i);
+        ImGui::PushID(static_cast<int>(handle.slot));
+        ImGui::Text("Sphere %u", handle.slot);
+        float3 center = spheres.Center(i);
+        bool moved = ImGui::DragFloat3("Sphere Center", &center.x, 0.1f, -10.0f, 10.0f);
+        moved |= ImGui::DragFloat("Sphere Radius", &spheres.radius[i], 0.1f, -10.0f, 10.0f);
+        if (moved)
+        {
+            spheres.SetCenter(i, center);
+            scene->SpheresEdited();
+        }
+        float3 colorVec = Math::GetColorNormalised(spheres.color[i]);
+        if (ImGui::ColorEdit3("Sphere Color", &colorVec.x))
+        {
+            spheres.color[i] = Math::GetColor(colorVec);
+            scene->SpheresEdited();
+        }
         if (ImGui::Button("Remove Sphere"))
         {
-            scene->spheres.erase(scene->spheres.begin() + i);
-            delete scene->bvhSpheres;
-            scene->bvhSpheres = new BVHSphere(scene->spheres);
+            spheres.Remove(handle);
+            scene->SpheresChanged();
+            i--;
+        }
+        ImGui::PopID();
+    }
+}
+
+void UIManager::HandleMeshUI()
+{
+    if (!ImGui::CollapsingHeader("Mesh")) return;
+    // the mesh gets the material selected under Sphere
+    static float3 position(0.5f);
+    static float scale = 0.1f;
+    static bool loadFailed = false; // the last Load Mesh could not read MESHFILE
+    ImGui::DragFloat3("Mesh Position", &position.x, 0.01f);
+    ImGui::DragFloat("Mesh Scale", &scale, 0.01f, 0.001f, 100.0f);
+    if (ImGui::Button("Load Mesh"))
+    {
+        Mesh* mesh = Mesh::LoadOBJ(MESHFILE, position, scale, material, 0xffffff);
+        if (mesh) scene->meshes.push_back(mesh);
+        loadFailed = !mesh;
+    }
+    if (loadFailed)
+    {
+        ImGui::SameLine();
+        ImGui::Text("could not load %s", MESHFILE);
+    }
+    for (int i = 0; i < scene->meshes.size(); i++)
+    {
+        ImGui::PushID(i);
+        ImGui::Text("Mesh %d: %u triangles", i, scene->meshes[i]->TriangleCount());
+        if (ImGui::Button("Remove Mesh"))
+        {
+            delete scene->meshes[i];
+            scene->meshes.erase(scene->meshes.begin() + i);
             i--;
         }
         ImGui::PopID();
@@ -208,7 +256,7 @@ void UIManager::HandleCameraUI(Camera& camera)
     ImGui::DragFloat("Camera Focal Length", &camera.focalLength, 0.1f, 0, 10);
     ImGui::DragFloat("Camera Aperture", &camera.apertureRadius, 0.01f,0, 10);
     ImGui::Checkbox("Accumulate", &camera.bAccumulate);
-    ImGui::SliderInt("Frames to Accumulate", &camera.numFramesToAccumulate, 1, 8);
+    ImGui::SliderInt("Frames to Accumulate", &camera.numFramesToAccumulate, 0, 64, camera.numFramesToAccumulate ? "%d" : "all");
 }
 
 void UIManager::HandleRenderUI(const float deltaTime)
@@ -218,6 +266,12 @@ void UIManager::HandleRenderUI(const float deltaTime)
     ImGui::Text("Frame Rate: %f", 1.0f / deltaTime);
     ImGui::Text("Resolution: %d x %d", SCRWIDTH, SCRHEIGHT);
     ImGui::Text("Million Rays/s: %f", (SCRWIDTH * SCRHEIGHT) / deltaTime / 1000000);
+    ImGui::Text("Voxel Memory: %.2f MB", static_cast<double>(scene->VoxelMemoryUsage()) / (1024 * 1024));
+    if (ImGui::Button("Benchmark Voxel Layout")) Benchmarks::VoxelLayout();
+    if (ImGui::Button("Benchmark World File")) Benchmarks::WorldFile();
+    if (ImGui::Button("Benchmark Sphere BVH")) Benchmarks::SphereBVH();
+    if (ImGui::Button("Benchmark Mesh")) Benchmarks::Mesh();
+    if (ImGui::Button("Save World")) WorldFile::Save(*scene, WORLDFILE);
 }
 
 void UIManager::HandleMaterialsUI() const
@@ -4,6 +4,7 @@ class UIManager
 {
 public:
     void HandleSphereUI();
+    void HandleMeshUI();
     void HandleLightingUI() const;
     void HandlePointLightUI() const;
     void HandleDirectionalLightUI() const;
@@ -0,0 +1,234 @@
+﻿#include "precomp.h"
+#include "brickStore.h"
+
+#ifdef _WIN32
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    constexpr uint Magic = 0x4b435242; // "BRCK"
+    constexpr uint ChunkBricks = 8; // bricks per chunk along an axis
+    constexpr uint BricksPerChunk = ChunkBricks * ChunkBricks * ChunkBricks;
+    // views must start on the allocation granularity of MapViewOfFile, which is also a
+    // multiple of the page size elsewhere
+    constexpr size_t Granularity = 64 * 1024;
+    constexpr size_t HeaderBytes = 64;
+
+    constexpr size_t RoundUp(const size_t bytes) { return (bytes + Granularity - 1) / Granularity * Granularity; }
+    constexpr size_t ChunkBytes = RoundUp(BricksPerChunk * sizeof(StreamedBrick));
+    // room for every palette index a brick can hold
+    constexpr uint MaxPaletteSize = 0x10000;
+    constexpr size_t PaletteBytes = RoundUp(MaxPaletteSize * sizeof(PaletteEntry));
+
+    struct Header
+    {
+        uint magic;
+        uint brickBytes;
+        uint worldSize[3];
+        uint paletteSize; // entries in the palette section; bricks only use indices below it
+    };
+
+    bool SameWorld(const Header& a, const Header& b)
+    {
+        return a.magic == b.magic && a.brickBytes == b.brickBytes && a.worldSize[0] == b.worldSize[0] &&
+            a.worldSize[1] == b.worldSize[1] && a.worldSize[2] == b.worldSize[2];
+    }
+}
+
+BrickStore::BrickStore(const char* path, const uint3& worldSize, const size_t residentBudget, const Open open):
+    bricksX(worldSize.x / 8), bricksY(worldSize.y / 8), bricksZ(worldSize.z / 8),
+    chunksX((bricksX + ChunkBricks - 1) / ChunkBricks), chunksY((bricksY + ChunkBricks - 1) / ChunkBricks),
+    chunksZ((bricksZ + ChunkBricks - 1) / ChunkBricks), budget(max(residentBudget / ChunkBytes, static_cast<size_t>(1)))
+{
+    const size_t brickCount = static_cast<size_t>(bricksX) * bricksY * bricksZ;
+    const size_t chunkCount = static_cast<size_t>(chunksX) * chunksY * chunksZ;
+    summaryBytes = RoundUp(HeaderBytes + brickCount * sizeof(ushort));
+    paletteOffset = summaryBytes + chunkCount * ChunkBytes;
+    const uint64 fileBytes = paletteOffset + PaletteBytes;
+    const Header expected = {Magic, sizeof(StreamedBrick), {worldSize.x, worldSize.y, worldSize.z}, 0};
+
+    // an existing store is only reused on request, and must hold a world of this size;
+    // otherwise the file is replaced by an empty, sparse one, so unused chunks take no disk space
+    Header header = {};
+#ifdef _WIN32
+    file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, open == Open::Existing ? OPEN_EXISTING : CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL, nullptr);
+    FATALERROR_IF(file == INVALID_HANDLE_VALUE, "could not open brick store %s", path);
+    if (open == Open::Existing)
+    {
+        LARGE_INTEGER existingBytes;
+        DWORD bytesRead = 0;
+        GetFileSizeEx(file, &existingBytes);
+        ReadFile(file, &header, sizeof(Header), &bytesRead, nullptr);
+        FATALERROR_IF(static_cast<uint64>(existingBytes.QuadPart) != fileBytes || bytesRead != sizeof(Header) || !SameWorld(header, expected),
+                      "brick store %s does not hold a %ux%ux%u world", path, worldSize.x, worldSize.y, worldSize.z);
+    }
+    else
+    {
+        DWORD unused;
+        DeviceIoControl(file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &unused, nullptr);
+        LARGE_INTEGER position;
+        position.QuadPart = static_cast<LONGLONG>(fileBytes);
+        SetFilePointerEx(file, position, nullptr, FILE_BEGIN);
+        FATALERROR_IF(!SetEndOfFile(file), "could not size brick store %s", path);
+    }
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(fileBytes >> 32), static_cast<DWORD>(fileBytes), nullptr);
+    FATALERROR_IF(!mapping, "could not map brick store %s", path);
+#else
+    file = ::open(path, open == Open::Existing ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    FATALERROR_IF(file < 0, "could not open brick store %s", path);
+    if (open == Open::Existing)
+    {
+        struct stat status;
+        fstat(file, &status);
+        FATALERROR_IF(static_cast<uint64>(status.st_size) != fileBytes || pread(file, &header, sizeof(Header), 0) != sizeof(Header) ||
+                      !SameWorld(header, expected), "brick store %s does not hold a %ux%ux%u world", path, worldSize.x, worldSize.y, worldSize.z);
+    }
+    else FATALERROR_IF(ftruncate(file, static_cast<off_t>(fileBytes)), "could not size brick store %s", path);
+#endif
+    summaryView = MapView(0, summaryBytes);
+    if (open == Open::Create) memcpy(summaryView, &expected, sizeof(Header));
+    brickVoxelCount = reinterpret_cast<ushort*>(summaryView + HeaderBytes);
+
+    views = std::make_unique<std::atomic<uchar*>[]>(chunkCount);
+    lastUse = std::make_unique<std::atomic<uint>[]>(chunkCount);
+    for (size_t i = 0; i < chunkCount; i++) views[i] = nullptr, lastUse[i] = 0;
+}
+
+BrickStore::~BrickStore()
+{
+    const size_t chunkCount = static_cast<size_t>(chunksX) * chunksY * chunksZ;
+    for (size_t i = 0; i < chunkCount; i++) if (views[i]) UnmapView(views[i], ChunkBytes);
+    UnmapView(summaryView, summaryBytes);
+#ifdef _WIN32
+    CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    close(file);
+#endif
+}
+
+uint BrickStore::ChunkIndex(const uint brickIndex, uint& brickInChunk) const
+{
+    // bricks are numbered like storage tiles: x first, then y, then z
+    const uint x = brickIndex % bricksX, y = brickIndex / bricksX % bricksY, z = brickIndex / (bricksX * bricksY);
+    brickInChunk = x % ChunkBricks + (y % ChunkBricks + z % ChunkBricks * ChunkBricks) * ChunkBricks;
+    return x / ChunkBricks + (y / ChunkBricks + z / ChunkBricks * chunksY) * chunksX;
+}
+
+StreamedBrick* BrickStore::Brick(const uint brickIndex) const
+{
+    uint brickInChunk;
+    const uint chunk = ChunkIndex(brickIndex, brickInChunk);
+    uchar* view = views[chunk].load(std::memory_order_acquire);
+    if (!view) view = MapChunk(chunk);
+    // only write the stamp when it changes, so threads sharing a chunk do not fight over the cache line
+    if (lastUse[chunk].load(std::memory_order_relaxed) != frame) lastUse[chunk].store(frame, std::memory_order_relaxed);
+    return reinterpret_cast<StreamedBrick*>(view) + brickInChunk;
+}
+
+uchar* BrickStore::MapChunk(const uint chunk) const
+{
+    std::lock_guard<std::mutex> lock(mapMutex);
+    uchar* view = views[chunk].load(std::memory_order_relaxed);
+    if (view) return view; // another thread mapped it first
+    view = MapView(summaryBytes + static_cast<uint64>(chunk) * ChunkBytes, ChunkBytes);
+    views[chunk].store(view, std::memory_order_release);
+    ++residentChunks;
+    return view;
+}
+
+void BrickStore::EndFrame()
+{
+    frame++;
+    if (residentChunks <= budget) return;
+    // unmap the chunks that were used longest ago; dirty pages are written back by the OS
+    const size_t chunkCount = static_cast<size_t>(chunksX) * chunksY * chunksZ;
+    vector<uint> resident;
+    for (uint i = 0; i < chunkCount; i++) if (views[i].load(std::memory_order_relaxed)) resident.push_back(i);
+    const size_t evictCount = resident.size() - budget;
+    std::nth_element(resident.begin(), resident.begin() + evictCount, resident.end(),
+                     [this](const uint a, const uint b) { return lastUse[a] < lastUse[b]; });
+    for (size_t i = 0; i < evictCount; i++)
+    {
+        UnmapView(views[resident[i]].exchange(nullptr), ChunkBytes);
+        --residentChunks;
+    }
+}
+
+size_t BrickStore::ResidentBytes() const
+{
+    return residentChunks * ChunkBytes;
+}
+
+size_t BrickStore::SummaryBytes() const
+{
+    return summaryBytes;
+}
+
+bool BrickStore::ReadSize(const char* path, uint3& size)
+{
+    std::ifstream file(path, std::ios::binary);
+    Header header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(Header)) || header.magic != Magic || header.brickBytes != sizeof(StreamedBrick)) return false;
+    size = make_uint3(header.worldSize[0], header.worldSize[1], header.worldSize[2]);
+    return true;
+}
+
+void BrickStore::StorePalette(const vector<VoxelData>& palette)
+{
+    FATALERROR_IF(palette.size() > MaxPaletteSize, "voxel palette of %zu entries does not fit the brick store", palette.size());
+    uchar* view = MapView(paletteOffset, PaletteBytes);
+    auto* entries = reinterpret_cast<PaletteEntry*>(view);
+    for (size_t i = 0; i < palette.size(); i++) entries[i] = PaletteEntry::From(palette[i]);
+    UnmapView(view, PaletteBytes);
+    // the size is raised last, so the store never claims entries it does not hold yet
+    reinterpret_cast<Header*>(summaryView)->paletteSize = static_cast<uint>(palette.size());
+}
+
+bool BrickStore::LoadPalette(vector<VoxelData>& palette) const
+{
+    const uint paletteSize = PaletteSize();
+    if (paletteSize == 0 || paletteSize > MaxPaletteSize) return false;
+    uchar* view = MapView(paletteOffset, PaletteBytes);
+    const auto* entries = reinterpret_cast<const PaletteEntry*>(view);
+    // entry 0 is the empty voxel whatever the file says
+    vector<VoxelData> stored(1);
+    for (uint i = 1; i < paletteSize && entries[i].Valid(); i++) stored.push_back(entries[i].Voxel());
+    UnmapView(view, PaletteBytes);
+    if (stored.size() != paletteSize) return false;
+    palette = std::move(stored);
+    return true;
+}
+
+uint BrickStore::PaletteSize() const
+{
+    return reinterpret_cast<const Header*>(summaryView)->paletteSize;
+}
+
+uchar* BrickStore::MapView(const uint64 offset, const size_t bytes) const
+{
+#ifdef _WIN32
+    void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset), bytes);
+    FATALERROR_IF(!view, "could not map %zu bytes of the brick store", bytes);
+#else
+    void* view = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, static_cast<off_t>(offset));
+    FATALERROR_IF(view == MAP_FAILED, "could not map %zu bytes of the brick store", bytes);
+#endif
+    return static_cast<uchar*>(view);
+}
+
+void BrickStore::UnmapView(uchar* view, const size_t bytes)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+#else
+    munmap(view, bytes);
+#endif
+}
@@ -0,0 +1,80 @@
+﻿#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+// One 8x8x8 brick of a streamed world, in the same format as a storage tile of the
+// in-memory grid: one occupancy bit per voxel and a palette index, both in Morton order.
+struct StreamedBrick
+{
+    uint64 occupancy[8];
+    ushort paletteIndices[512];
+};
+
+// Out-of-core voxel storage. Bricks live in a memory-mapped file, grouped in chunks of
+// 8x8x8 bricks (64^3 voxels) that are mapped when a ray or an edit first touches them.
+// The number of filled voxels per brick is kept in a summary at the start of the file,
+// which stays mapped: traversal skips empty bricks without touching their chunk.
+// Chunks are unmapped least recently used first in EndFrame, so a frame may exceed the
+// budget by the chunks it touches, but memory stays bounded from frame to frame.
+// Bricks hold palette indices, so the store also keeps the palette they index, in a
+// section after the chunks that is only mapped to read or write it.
+class BrickStore
+{
+public:
+    enum class Open
+    {
+        Create, // replace whatever is at path with an empty store
+        Existing // reopen the store an earlier session left at path, with its bricks and palette
+    };
+
+    // an Existing store must hold a world of worldSize; see ReadSize
+    BrickStore(const char* path, const uint3& worldSize, size_t residentBudget, Open open);
+    ~BrickStore();
+    BrickStore(const BrickStore&) = delete;
+    BrickStore& operator=(const BrickStore&) = delete;
+
+    // the brick with this storage tile index; maps its chunk if needed. thread safe.
+    [[nodiscard]] StreamedBrick* Brick(uint brickIndex) const;
+    // advances the frame counter and unmaps chunks until the budget is met;
+    // must not run while other threads use bricks
+    void EndFrame();
+    [[nodiscard]] size_t ResidentBytes() const;
+    [[nodiscard]] size_t SummaryBytes() const;
+    // the world size of the store at path; false if there is no valid store
+    static bool ReadSize(const char* path, uint3& size);
+
+    // the palette is stored whole; call it whenever the palette has grown, before bricks
+    // use the new entries, so the store never indexes past the palette it holds
+    void StorePalette(const vector<VoxelData>& palette);
+    // reads the stored palette; false if it is missing or damaged
+    bool LoadPalette(vector<VoxelData>& palette) const;
+    [[nodiscard]] uint PaletteSize() const;
+
+    ushort* brickVoxelCount = nullptr; // the coarse summary: filled voxels per brick, in tile order
+
+private:
+    [[nodiscard]] uint ChunkIndex(uint brickIndex, uint& brickInChunk) const;
+    uchar* MapChunk(uint chunk) const;
+    uchar* MapView(uint64 offset, size_t bytes) const;
+    static void UnmapView(uchar* view, size_t bytes);
+
+    uint bricksX, bricksY, bricksZ; // world size in bricks
+    uint chunksX, chunksY, chunksZ; // world size in chunks, rounded up
+    size_t budget; // in chunks
+    size_t summaryBytes; // header and summary, rounded up to the mapping granularity
+    uint64 paletteOffset; // of the palette section, after the chunks
+    uchar* summaryView = nullptr;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#else
+    int file = -1;
+#endif
+    // per chunk: its view, or null when not resident, and the frame it was last used in
+    std::unique_ptr<std::atomic<uchar*>[]> views;
+    std::unique_ptr<std::atomic<uint>[]> lastUse;
+    mutable std::mutex mapMutex;
+    mutable std::atomic<uint> residentChunks{0};
+    uint frame = 0;
+};
@@ -0,0 +1,212 @@
+﻿#include "precomp.h"
+#include "tree64.h"
+
+namespace
+{
+    // child blocks are allocated with power-of-two capacity, so repeated inserts into the
+    // same node only relocate its children log2(64) times. blocks that are given up are
+    // kept per capacity and handed out again, so edits do not grow the pools without bound.
+    uint CapacityClass(const uint capacity)
+    {
+        return static_cast<uint>(_mm_popcnt_u32(capacity - 1));
+    }
+
+    template <class T, class FreeBlocks>
+    uint AllocateBlock(vector<T>& pool, FreeBlocks& freeBlocks, const uint capacity)
+    {
+        vector<uint>& blocks = freeBlocks[CapacityClass(capacity)];
+        if (!blocks.empty())
+        {
+            const uint first = blocks.back();
+            blocks.pop_back();
+            return first;
+        }
+        const auto first = static_cast<uint>(pool.size());
+        pool.resize(pool.size() + capacity);
+        return first;
+    }
+
+    template <class T, class FreeBlocks>
+    uint InsertInBlock(vector<T>& pool, FreeBlocks& freeBlocks, uint first, const uint count, uint& capacity, const uint offset, const T& item)
+    {
+        if (count == capacity)
+        {
+            // out of room: move the block to one twice its size and give the old one back
+            const uint newCapacity = capacity ? capacity * 2 : 1;
+            const uint newFirst = AllocateBlock(pool, freeBlocks, newCapacity);
+            for (uint i = 0; i < count; i++) pool[newFirst + i] = pool[first + i];
+            if (capacity) freeBlocks[CapacityClass(capacity)].push_back(first);
+            first = newFirst;
+            capacity = newCapacity;
+        }
+        for (uint i = count; i > offset; i--) pool[first + i] = pool[first + i - 1];
+        pool[first + offset] = item;
+        return first;
+    }
+
+    template <class T>
+    void RemoveFromBlock(vector<T>& pool, const uint first, const uint count, const uint offset)
+    {
+        for (uint i = offset; i + 1 < count; i++) pool[first + i] = pool[first + i + 1];
+    }
+}
+
+Tree64::Tree64(const uint3& worldSize, const float scale): worldSize{worldSize.x, worldSize.y, worldSize.z}, scale(scale)
+{
+    rootShift = 2;
+    while ((1u << rootShift) < max(max(worldSize.x, worldSize.y), worldSize.z)) rootShift += 2;
+    nodes.push_back({});
+}
+
+uint Tree64::ChildIndex(const uint x, const uint y, const uint z, const uint shift)
+{
+    return ((x >> shift) & 3) | (((y >> shift) & 3) << 2) | (((z >> shift) & 3) << 4);
+}
+
+uint Tree64::ChildOffset(const uint64 mask, const uint childIndex)
+{
+    // children are packed, so the offset is the number of occupied siblings before this one
+    return static_cast<uint>(_mm_popcnt_u64(mask & ((1ull << childIndex) - 1)));
+}
+
+void Tree64::Set(const uint x, const uint y, const uint z, const ushort paletteIndex)
+{
+    if (paletteIndex) Insert(x, y, z, paletteIndex);
+    else Remove(x, y, z);
+}
+
+ushort Tree64::Get(const uint x, const uint y, const uint z) const
+{
+    const Tree64Node* node = &nodes[0];
+    for (uint shift = rootShift - 2;; shift -= 2)
+    {
+        const uint child = ChildIndex(x, y, z, shift);
+        if (!(node->childMask >> child & 1)) return 0;
+        const uint index = node->firstChild + ChildOffset(node->childMask, child);
+        if (shift == 0) return voxels[index];
+        node = &nodes[index];
+    }
+}
+
+void Tree64::Insert(const uint x, const uint y, const uint z, const ushort paletteIndex)
+{
+    uint nodeIndex = 0;
+    for (uint shift = rootShift - 2;; shift -= 2)
+    {
+        const uint child = ChildIndex(x, y, z, shift);
+        const uint64 mask = nodes[nodeIndex].childMask;
+        const uint offset = ChildOffset(mask, child);
+        const auto count = static_cast<uint>(_mm_popcnt_u64(mask));
+        if (!(mask >> child & 1))
+        {
+            // new child; pool references are re-fetched below because the pools may grow
+            uint capacity = nodes[nodeIndex].capacity;
+            const uint first = shift == 0
+                ? InsertInBlock(voxels, freeVoxelBlocks, nodes[nodeIndex].firstChild, count, capacity, offset, paletteIndex)
+                : InsertInBlock(nodes, freeNodeBlocks, nodes[nodeIndex].firstChild, count, capacity, offset, Tree64Node{});
+            nodes[nodeIndex].firstChild = first;
+            nodes[nodeIndex].capacity = capacity;
+            nodes[nodeIndex].childMask |= 1ull << child;
+        }
+        const uint index = nodes[nodeIndex].firstChild + offset;
+        if (shift == 0)
+        {
+            voxels[index] = paletteIndex;
+            return;
+        }
+        nodeIndex = index;
+    }
+}
+
+void Tree64::Remove(const uint x, const uint y, const uint z)
+{
+    // record the path so empty nodes can be unlinked from their parents
+    uint path[16], childPath[16], depth = 0;
+    uint nodeIndex = 0;
+    for (uint shift = rootShift - 2;; shift -= 2)
+    {
+        const uint child = ChildIndex(x, y, z, shift);
+        const Tree64Node& node = nodes[nodeIndex];
+        if (!(node.childMask >> child & 1)) return; // already empty
+        path[depth] = nodeIndex, childPath[depth++] = child;
+        if (shift == 0) break;
+        nodeIndex = node.firstChild + ChildOffset(node.childMask, child);
+    }
+    for (int level = static_cast<int>(depth) - 1; level >= 0; level--)
+    {
+        Tree64Node& node = nodes[path[level]];
+        const uint child = childPath[level];
+        const uint count = static_cast<uint>(_mm_popcnt_u64(node.childMask));
+        const uint offset = ChildOffset(node.childMask, child);
+        if (level == static_cast<int>(depth) - 1) RemoveFromBlock(voxels, node.firstChild, count, offset);
+        else RemoveFromBlock(nodes, node.firstChild, count, offset);
+        node.childMask &= ~(1ull << child);
+        if (node.childMask) return;
+        // an empty node gives its block back; the root always stays, other nodes only survive
+        // while they have children and are unlinked from their parent on the next level up
+        FreeBlocks& freeBlocks = level == static_cast<int>(depth) - 1 ? freeVoxelBlocks : freeNodeBlocks;
+        freeBlocks[CapacityClass(node.capacity)].push_back(node.firstChild);
+        node.firstChild = 0, node.capacity = 0;
+        if (level == 0) return;
+    }
+}
+
+ushort Tree64::Intersect(const Ray& ray, float t, float tEnd, uint3& voxel, float& tHit) const
+{
+    // work in voxel units: p(t) = O + t * D
+    const float3 size = make_float3(static_cast<float>(worldSize[0]), static_cast<float>(worldSize[1]), static_cast<float>(worldSize[2]));
+    const float3 O = ray.GetOrigin() * scale;
+    const float3 D = ray.GetDirection() * scale;
+    const float3 R = ray.GetReciprocalDirection() * (1.0f / scale);
+    const float3 exitPlanes = (1.0f - ray.dSign) * size;
+    const float3 tWorld = (exitPlanes - O) * R;
+    tEnd = min(tEnd, min(min(tWorld.x, tWorld.y), tWorld.z));
+    if (t >= tEnd) return 0;
+
+    const int3 start = clamp(make_int3(O + (t + 0.00005f) * D), make_int3(0), make_int3(size) - 1);
+    uint cell[3] = {static_cast<uint>(start.x), static_cast<uint>(start.y), static_cast<uint>(start.z)};
+    while (true)
+    {
+        // descend until we reach a voxel or an empty child
+        const Tree64Node* node = &nodes[0];
+        uint shift = rootShift - 2;
+        while (true)
+        {
+            const uint child = ChildIndex(cell[0], cell[1], cell[2], shift);
+            if (!(node->childMask >> child & 1)) break;
+            const uint index = node->firstChild + ChildOffset(node->childMask, child);
+            if (shift == 0)
+            {
+                voxel = make_uint3(cell[0], cell[1], cell[2]);
+                tHit = t;
+                return voxels[index];
+            }
+            node = &nodes[index];
+            shift -= 2;
+        }
+
+        // the empty child is a cube of 4^level voxels; leave it through the nearest face
+        const uint emptySize = 1u << shift;
+        const uint base[3] = {cell[0] & ~(emptySize - 1), cell[1] & ~(emptySize - 1), cell[2] & ~(emptySize - 1)};
+        const float3 planes = make_float3(static_cast<float>(base[0]), static_cast<float>(base[1]), static_cast<float>(base[2]))
+            + (1.0f - ray.dSign) * static_cast<float>(emptySize);
+        const float3 tPlanes = (planes - O) * R;
+        const int axis = tPlanes.x < tPlanes.y ? (tPlanes.x < tPlanes.z ? 0 : 2) : (tPlanes.y < tPlanes.z ? 1 : 2);
+        t = max(t, tPlanes.cell[axis]);
+        if (t >= tEnd) return 0;
+
+        // the exit axis moves into the neighbouring cube, the others follow the ray
+        const float3 p = O + t * D;
+        for (int i = 0; i < 3; i++)
+        {
+            if (i == axis) cell[i] = ray.dSign.cell[i] > 0 ? base[i] - 1 : base[i] + emptySize;
+            else cell[i] = static_cast<uint>(clamp(static_cast<int>(p.cell[i]), static_cast<int>(base[i]), static_cast<int>(min(base[i] + emptySize, worldSize[i])) - 1));
+        }
+        if (cell[axis] >= worldSize[axis]) return 0;
+    }
+}
+
+size_t Tree64::MemoryUsage() const
+{
+    return nodes.capacity() * sizeof(Tree64Node) + voxels.capacity() * sizeof(ushort);
+}
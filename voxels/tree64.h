@@ -0,0 +1,41 @@
+﻿#pragma once
+
+// Sparse 64-tree: every node covers 4x4x4 children and stores one occupancy bit
+// per child. Only occupied children are stored, packed in mask order, so the
+// index of a child is the popcount of the mask bits below it.
+struct Tree64Node
+{
+    uint64 childMask = 0;
+    uint firstChild = 0; // into nodes, or into voxels for the last level
+    uint capacity = 0; // of the child block, a power of two; fits in the padding of the node
+};
+
+class Tree64
+{
+public:
+    // size in voxels per axis; scale is voxels per world unit, used to walk rays
+    Tree64(const uint3& worldSize, float scale);
+    // voxels are palette indices into MaterialManager; 0 is empty
+    void Set(uint x, uint y, uint z, ushort paletteIndex);
+    [[nodiscard]] ushort Get(uint x, uint y, uint z) const;
+    [[nodiscard]] ushort Intersect(const Ray& ray, float t, float tEnd, uint3& voxel, float& tHit) const;
+    [[nodiscard]] size_t MemoryUsage() const;
+
+    vector<Tree64Node> nodes;
+    vector<ushort> voxels;
+
+private:
+    // blocks given back by nodes that grew or emptied, per capacity 1, 2, 4, ... 64
+    static constexpr uint CapacityClasses = 7;
+    using FreeBlocks = vector<uint>[CapacityClasses];
+
+    static uint ChildIndex(uint x, uint y, uint z, uint shift);
+    static uint ChildOffset(uint64 mask, uint childIndex);
+    void Insert(uint x, uint y, uint z, ushort paletteIndex);
+    void Remove(uint x, uint y, uint z);
+
+    uint worldSize[3];
+    float scale;
+    uint rootShift; // log2 of the root size, the smallest power of 4 that fits the largest axis
+    FreeBlocks freeNodeBlocks, freeVoxelBlocks;
+};
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+// Storage order of per-voxel arrays. Voxels are stored tile by tile (8x8x8 tiles in
+// x, y, z order) and in Morton (Z-) order inside a tile, so a DDA step along any axis
+// mostly stays in the same cache line. A 64-bit word of one-bit-per-voxel data covers
+// a 4x4x4 block, and a tile's 512 bits are exactly one cache line.
+class VoxelLayout
+{
+public:
+    static constexpr uint TileShift = 3;
+    static constexpr uint TileSize = 1 << TileShift;
+    static constexpr uint TileVoxels = TileSize * TileSize * TileSize;
+
+    static uint Index(const uint x, const uint y, const uint z, const uint tilesX, const uint tilesY)
+    {
+        const uint tile = (x >> TileShift) + ((y >> TileShift) + (z >> TileShift) * tilesY) * tilesX;
+        return tile * TileVoxels + (Spread(x & 7) | Spread(y & 7) << 1 | Spread(z & 7) << 2);
+    }
+
+    static uint3 Coordinates(const uint index, const uint tilesX, const uint tilesY)
+    {
+        const uint tile = index / TileVoxels, morton = index & (TileVoxels - 1);
+        const uint tileX = tile % tilesX, tileY = tile / tilesX % tilesY, tileZ = tile / (tilesX * tilesY);
+        return make_uint3(tileX << TileShift | Compact(morton), tileY << TileShift | Compact(morton >> 1),
+                          tileZ << TileShift | Compact(morton >> 2));
+    }
+
+    // the x, y and z parts of Index use disjoint bits, so they can be looked up per
+    // axis and added; this is cheaper than interleaving bits on every DDA step
+    struct Offsets
+    {
+        Offsets(const uint sizeX, const uint sizeY, const uint sizeZ): alongX(sizeX), alongY(sizeY), alongZ(sizeZ)
+        {
+            const uint tilesX = sizeX / TileSize, tilesY = sizeY / TileSize;
+            for (uint i = 0; i < sizeX; i++) alongX[i] = VoxelLayout::Index(i, 0, 0, tilesX, tilesY);
+            for (uint i = 0; i < sizeY; i++) alongY[i] = VoxelLayout::Index(0, i, 0, tilesX, tilesY);
+            for (uint i = 0; i < sizeZ; i++) alongZ[i] = VoxelLayout::Index(0, 0, i, tilesX, tilesY);
+        }
+
+        [[nodiscard]] uint Index(const uint x, const uint y, const uint z) const
+        {
+            return alongX[x] + alongY[y] + alongZ[z];
+        }
+
+        vector<uint> alongX, alongY, alongZ;
+    };
+
+    // plain x-major order, kept for comparison in the benchmark
+    static uint LinearIndex(const uint x, const uint y, const uint z, const uint sizeX, const uint sizeY)
+    {
+        return x + (y + z * sizeY) * sizeX;
+    }
+
+private:
+    // 3 bits abc -> a00b00c
+    static uint Spread(const uint v) { return (v & 1) | (v & 2) << 2 | (v & 4) << 4; }
+    static uint Compact(const uint v) { return (v & 1) | (v >> 2 & 2) | (v >> 4 & 4); }
+};
@@ -0,0 +1,212 @@
+﻿#include "precomp.h"
+#include "worldFile.h"
+
+#include "materials/materialManager.h"
+#include "voxels/brickStore.h"
+
+#include <atomic>
+
+namespace
+{
+    constexpr uint Magic = 0x57584f56; // "VOXW"
+    constexpr uint Version = 1;
+    constexpr uint ChunkBricks = 8; // bricks per chunk along an axis
+    constexpr uint BricksPerChunk = ChunkBricks * ChunkBricks * ChunkBricks;
+    constexpr uint MaskBytes = BricksPerChunk / 8;
+    constexpr uint BrickBytes = VoxelLayout::TileVoxels * sizeof(ushort);
+
+    struct Header
+    {
+        uint magic, version;
+        uint worldSize[3];
+        uint paletteSize, chunkCount;
+    };
+
+    struct ChunkEntry
+    {
+        uint64 offset;
+        uint compressedBytes, rawBytes;
+    };
+
+    struct ChunkGrid
+    {
+        explicit ChunkGrid(const uint3& worldSize):
+            bricks(make_uint3(worldSize.x / VoxelLayout::TileSize, worldSize.y / VoxelLayout::TileSize, worldSize.z / VoxelLayout::TileSize)),
+            chunks(make_uint3((bricks.x + ChunkBricks - 1) / ChunkBricks, (bricks.y + ChunkBricks - 1) / ChunkBricks,
+                              (bricks.z + ChunkBricks - 1) / ChunkBricks)) {}
+
+        [[nodiscard]] uint Count() const { return chunks.x * chunks.y * chunks.z; }
+
+        // calls f(local, brickIndex) for the bricks of a chunk that lie inside the world
+        template <class F>
+        void ForEachBrick(const uint chunk, F&& f) const
+        {
+            const uint3 first = make_uint3(chunk % chunks.x, chunk / chunks.x % chunks.y, chunk / (chunks.x * chunks.y)) * ChunkBricks;
+            for (uint z = 0; z < ChunkBricks; z++) for (uint y = 0; y < ChunkBricks; y++) for (uint x = 0; x < ChunkBricks; x++)
+            {
+                const uint3 brick = first + make_uint3(x, y, z);
+                if (brick.x >= bricks.x || brick.y >= bricks.y || brick.z >= bricks.z) continue;
+                f(x + (y + z * ChunkBricks) * ChunkBricks, brick.x + (brick.y + brick.z * bricks.y) * bricks.x);
+            }
+        }
+
+        uint3 bricks, chunks;
+    };
+
+    // runs body(chunk) for all chunks, in parallel unless the scene is a Tree64, which
+    // cannot be edited from several threads. streamed worlds unmap bricks between batches.
+    template <class F>
+    void ForEachChunk(const Scene& scene, const uint chunkCount, const bool parallel, F&& body)
+    {
+        const int batch = scene.bricks ? 64 : static_cast<int>(chunkCount);
+        for (int first = 0; first < static_cast<int>(chunkCount); first += batch)
+        {
+            const int last = min(first + batch, static_cast<int>(chunkCount));
+#pragma omp parallel for schedule(dynamic) if (parallel)
+            for (int chunk = first; chunk < last; chunk++) body(static_cast<uint>(chunk));
+            if (scene.bricks) scene.bricks->EndFrame();
+        }
+    }
+}
+
+bool WorldFile::Save(const Scene& scene, const char* path)
+{
+    const ChunkGrid grid(make_uint3(scene.extent.x, scene.extent.y, scene.extent.z));
+    vector<vector<uchar>> chunks(grid.Count());
+    vector<uint> rawBytes(grid.Count());
+    std::atomic<int> failures{0};
+    ForEachChunk(scene, grid.Count(), true, [&](const uint chunk)
+    {
+        vector<uchar> raw(MaskBytes + BricksPerChunk * BrickBytes);
+        uchar* mask = raw.data();
+        memset(mask, 0, MaskBytes);
+        size_t used = MaskBytes;
+        grid.ForEachBrick(chunk, [&](const uint local, const uint brickIndex)
+        {
+            auto* brick = reinterpret_cast<ushort*>(raw.data() + used);
+            scene.GetBrick(brickIndex, brick);
+            for (uint i = 0; i < VoxelLayout::TileVoxels; i++)
+            {
+                if (!brick[i]) continue;
+                mask[local >> 3] |= 1 << (local & 7);
+                used += BrickBytes;
+                break;
+            }
+        });
+        uLongf compressedBytes = compressBound(static_cast<uLong>(used));
+        chunks[chunk].resize(compressedBytes);
+        if (compress2(chunks[chunk].data(), &compressedBytes, raw.data(), static_cast<uLong>(used), Z_BEST_SPEED) != Z_OK) failures++;
+        chunks[chunk].resize(compressedBytes);
+        rawBytes[chunk] = static_cast<uint>(used);
+    });
+    if (failures) return false;
+
+    const vector<VoxelData>& palette = scene.materialManager->voxelPalette;
+    const Header header = {Magic, Version, {scene.extent.x, scene.extent.y, scene.extent.z}, static_cast<uint>(palette.size()), grid.Count()};
+    vector<PaletteEntry> entries;
+    for (const VoxelData& voxel : palette) entries.push_back(PaletteEntry::From(voxel));
+    vector<ChunkEntry> table(grid.Count());
+    uint64 offset = sizeof(Header) + entries.size() * sizeof(PaletteEntry) + table.size() * sizeof(ChunkEntry);
+    for (uint i = 0; i < grid.Count(); i++)
+    {
+        table[i] = {offset, static_cast<uint>(chunks[i].size()), rawBytes[i]};
+        offset += chunks[i].size();
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(PaletteEntry));
+    file.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(ChunkEntry));
+    for (const vector<uchar>& chunk : chunks) file.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    return file.good();
+}
+
+bool WorldFile::Load(Scene& scene, const char* path)
+{
+    // read the whole file at once; chunks are inflated straight from this buffer
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return false;
+    vector<uchar> data(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(data.data()), data.size());
+    if (!file || data.size() < sizeof(Header)) return false;
+    Header header;
+    memcpy(&header, data.data(), sizeof(Header));
+    const ChunkGrid grid(make_uint3(scene.extent.x, scene.extent.y, scene.extent.z));
+    if (header.magic != Magic || header.version != Version || header.worldSize[0] != scene.extent.x ||
+        header.worldSize[1] != scene.extent.y || header.worldSize[2] != scene.extent.z || header.chunkCount != grid.Count() ||
+        header.paletteSize == 0) return false;
+    const size_t tableOffset = sizeof(Header) + header.paletteSize * sizeof(PaletteEntry);
+    if (data.size() < tableOffset + header.chunkCount * sizeof(ChunkEntry)) return false;
+
+    // palette indices in the file are mapped to entries of this scene's palette
+    vector<ushort> remap(header.paletteSize);
+    vector<uchar> special(header.paletteSize);
+    const auto* entries = reinterpret_cast<const PaletteEntry*>(data.data() + sizeof(Header));
+    for (uint i = 1; i < header.paletteSize; i++)
+    {
+        const VoxelData voxel = entries[i].Voxel();
+        remap[i] = scene.materialManager->GetVoxelPaletteIndex(voxel);
+        special[i] = voxel.special;
+    }
+    // a streamed scene keeps the palette next to the bricks that index it
+    if (scene.bricks) scene.bricks->StorePalette(scene.materialManager->voxelPalette);
+
+    const auto* table = reinterpret_cast<const ChunkEntry*>(data.data() + tableOffset);
+    vector<vector<uint>> specialVoxels(grid.Count());
+    std::atomic<int> failures{0};
+    ForEachChunk(scene, grid.Count(), scene.structure != VoxelStructure::Tree64, [&](const uint chunk)
+    {
+        const ChunkEntry& entry = table[chunk];
+        if (entry.offset + entry.compressedBytes > data.size() || entry.rawBytes < MaskBytes ||
+            entry.rawBytes > MaskBytes + BricksPerChunk * BrickBytes)
+        {
+            failures++;
+            return;
+        }
+        vector<uchar> raw(entry.rawBytes);
+        uLongf rawBytes = entry.rawBytes;
+        if (uncompress(raw.data(), &rawBytes, data.data() + entry.offset, entry.compressedBytes) != Z_OK || rawBytes != entry.rawBytes)
+        {
+            failures++;
+            return;
+        }
+        const uchar* mask = raw.data();
+        size_t used = MaskBytes;
+        ushort brick[VoxelLayout::TileVoxels];
+        grid.ForEachBrick(chunk, [&](const uint local, const uint brickIndex)
+        {
+            if (!(mask[local >> 3] >> (local & 7) & 1) || used + BrickBytes > raw.size())
+            {
+                // the other structures start out empty, but a brick store is written in place
+                if (scene.bricks)
+                {
+                    memset(brick, 0, BrickBytes);
+                    scene.SetBrick(brickIndex, brick);
+                }
+                return;
+            }
+            memcpy(brick, raw.data() + used, BrickBytes);
+            used += BrickBytes;
+            for (uint i = 0; i < VoxelLayout::TileVoxels; i++)
+            {
+                if (brick[i] >= header.paletteSize) brick[i] = 0;
+                if (special[brick[i]]) specialVoxels[chunk].push_back(brickIndex * VoxelLayout::TileVoxels + i);
+                brick[i] = remap[brick[i]];
+            }
+            scene.SetBrick(brickIndex, brick);
+        });
+    });
+    scene.specialVoxels.clear();
+    for (const vector<uint>& voxels : specialVoxels) scene.specialVoxels.insert(scene.specialVoxels.end(), voxels.begin(), voxels.end());
+    return failures == 0;
+}
+
+bool WorldFile::ReadSize(const char* path, uint3& size)
+{
+    std::ifstream file(path, std::ios::binary);
+    Header header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(Header)) || header.magic != Magic || header.version != Version) return false;
+    size = make_uint3(header.worldSize[0], header.worldSize[1], header.worldSize[2]);
+    return true;
+}
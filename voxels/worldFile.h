@@ -0,0 +1,16 @@
+﻿#pragma once
+
+// Binary voxel world: a header, the voxel palette, a chunk table and the chunks. A chunk
+// covers 8x8x8 bricks (64^3 voxels): a mask of its non-empty bricks followed by their
+// palette indices in storage order. Every chunk is deflated on its own, so save and load
+// compress and inflate chunks on all cores.
+class WorldFile
+{
+public:
+    static bool Save(const Scene& scene, const char* path);
+    // fills a newly created scene of the size stored in the file; a streamed scene also has
+    // the bricks the file leaves empty cleared. specialVoxels is rebuilt, the distance field
+    // is left to the caller
+    static bool Load(Scene& scene, const char* path);
+    static bool ReadSize(const char* path, uint3& size);
+};